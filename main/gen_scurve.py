@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# Generates the normalized s-curve used by the step ramp in stp_drv.c.
+#
+# Entry i holds the velocity fraction (0..65535) reached after i/STP_SCURVE_LEN
+# of the curve time. The curve is the velocity under constant jerk followed by
+# the same jerk negated, so acceleration starts and ends at zero. The isr uses
+# the first half to jerk up to the planned acceleration and the second half to
+# jerk back down, scaling it with integer math so no float work happens when a
+# move starts.
+
+import sys
+
+STP_SCURVE_LEN = 256    # segments, table holds one extra entry for the end point
+
+
+def scurve(x):
+    if x < 0.5:
+        return 2.0 * x * x
+    return 1.0 - 2.0 * (1.0 - x) * (1.0 - x)
+
+
+def main():
+    values = []
+    for i in range(STP_SCURVE_LEN + 1):
+        values.append(round(scurve(i / STP_SCURVE_LEN) * 65535))
+
+    lines = []
+    lines.append("// generated by gen_scurve.py, do not edit")
+    lines.append("#ifndef __STP_SCURVE__H__")
+    lines.append("#define __STP_SCURVE__H__")
+    lines.append("")
+    lines.append("#include <stdint.h>")
+    lines.append("")
+    lines.append("#define STP_SCURVE_LEN      %d" % STP_SCURVE_LEN)
+    lines.append("")
+    lines.append("static const uint16_t stp_scurve_tbl[STP_SCURVE_LEN + 1] = {")
+    for i in range(0, len(values), 12):
+        lines.append("    " + ", ".join("%5d" % v for v in values[i:i + 12]) + ",")
+    lines.append("};")
+    lines.append("")
+    lines.append("#endif")
+
+    with open(sys.argv[1], "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
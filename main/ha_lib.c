@@ -76,9 +76,9 @@ static const char *discover_packet_button = "{"
 static const char *discover_packet_text_sensor = "{"
 "\"name\": \"%s\","
 "\"uniq_id\": \"%s\","
-"\"cmd_t \": \"sensor/%s/state\","
+"\"stat_t\": \"sensor/%s/state\","
 "\"avty_t\": \"sensor/%s/availability\","
-"\"platform\": \"text\","
+"%s"
 "\"device\": {"
 "\"name\": \"%s\","
 "\"manufacturer\": \"%s\","
@@ -213,6 +213,7 @@ static void _create_discover_packet_text_sensor(char *buffer, uint16_t buffer_le
         unique_id,
         unique_id,
         unique_id,
+        param->diagnostic ? "\"ent_cat\": \"diagnostic\"," : "",
         param->device_name,
         param->manufacturer,
         param->model,
@@ -52,6 +52,7 @@ typedef struct {
     const char *model;
     const char *identifiers;
     const char *sw_version;
+    uint8_t diagnostic;     // listed under diagnostics in Home Assistant
 } ha_text_param_t;
 
 typedef struct {
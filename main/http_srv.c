@@ -13,6 +13,7 @@
 
 static vprintf_like_t debug_root_func;
 static char debug_buf[DEBUG_BUF_SIZE] = {0};
+static void (*_on_settings)(void) = NULL;
 
 //-----------------------------------------------------------------------------
 static esp_err_t ota_post_handler(httpd_req_t *req)
@@ -135,6 +136,16 @@ const char html[] =
 "    document.getElementById('dhcp_enable').checked = data.dhcp_enable;\n"
 "    document.getElementById('dir_invert').checked = data.dir_invert;\n"
 "    document.getElementById('max_speed').value = data.max_speed;\n"
+"    document.getElementById('spread_rpm').value = data.spread_rpm;\n"
+"    document.getElementById('coolstep_rpm').value = data.coolstep_rpm;\n"
+"    document.getElementById('coolstep_semin').value = data.coolstep_semin;\n"
+"    document.getElementById('coolstep_semax').value = data.coolstep_semax;\n"
+"    document.getElementById('stall_lost').checked = data.stall_lost;\n"
+"    document.getElementById('current_run').value = data.current_run;\n"
+"    document.getElementById('current_boost').value = data.current_boost;\n"
+"    document.getElementById('current_hold').value = data.current_hold;\n"
+"    document.getElementById('current_hold_delay').value = data.current_hold_delay;\n"
+"    document.getElementById('adapt_margin').value = data.adapt_margin;\n"
 "    document.getElementById('mqtt_uri').value = data.mqtt_uri;\n"
 "    document.getElementById('mqtt_user').value = data.mqtt_user;\n"
 "    document.getElementById('mqtt_pass').value = data.mqtt_pass;\n"
@@ -151,6 +162,16 @@ const char html[] =
 "    dhcp_enable: document.getElementById('dhcp_enable').checked,\n"
 "    dir_invert: document.getElementById('dir_invert').checked,\n"
 "    max_speed: parseInt(document.getElementById('max_speed').value),\n"
+"    spread_rpm: parseInt(document.getElementById('spread_rpm').value),\n"
+"    coolstep_rpm: parseInt(document.getElementById('coolstep_rpm').value),\n"
+"    coolstep_semin: parseInt(document.getElementById('coolstep_semin').value),\n"
+"    coolstep_semax: parseInt(document.getElementById('coolstep_semax').value),\n"
+"    stall_lost: document.getElementById('stall_lost').checked,\n"
+"    current_run: parseInt(document.getElementById('current_run').value),\n"
+"    current_boost: parseInt(document.getElementById('current_boost').value),\n"
+"    current_hold: parseInt(document.getElementById('current_hold').value),\n"
+"    current_hold_delay: parseInt(document.getElementById('current_hold_delay').value),\n"
+"    adapt_margin: parseInt(document.getElementById('adapt_margin').value),\n"
 "    mqtt_uri: document.getElementById('mqtt_uri').value,\n"
 "    mqtt_user: document.getElementById('mqtt_user').value,\n"
 "    mqtt_pass: document.getElementById('mqtt_pass').value,\n"
@@ -221,7 +242,18 @@ const char html[] =
 "<form onsubmit=\"event.preventDefault(); saveSettings();\">\n"
 "<label>Device Name: <input type=\"text\" id=\"device_name\"></label><br>\n"
 "<label>Direction Invert: <input type=\"checkbox\" id=\"dir_invert\"></label><br>\n"
-"<label>Max Speed: <input type=\"number\" id=\"max_speed\"></label><br>\n"
+"<label>Max Speed: <input type=\"number\" id=\"max_speed\" min=\"30\" max=\"300\"></label><br>\n"
+"<h3>Driver Configuration</h3>\n"
+"<label>SpreadCycle above RPM: <input type=\"number\" id=\"spread_rpm\" min=\"0\" max=\"300\"></label><br>\n"
+"<label>CoolStep above RPM: <input type=\"number\" id=\"coolstep_rpm\" min=\"0\" max=\"300\"></label><br>\n"
+"<label>CoolStep SEMIN: <input type=\"number\" id=\"coolstep_semin\" min=\"0\" max=\"15\"></label><br>\n"
+"<label>CoolStep SEMAX: <input type=\"number\" id=\"coolstep_semax\" min=\"0\" max=\"15\"></label><br>\n"
+"<label>Stall in CoolStep homes again: <input type=\"checkbox\" id=\"stall_lost\"></label><br>\n"
+"<label>Run current, 0 keeps 31: <input type=\"number\" id=\"current_run\" min=\"0\" max=\"31\"></label><br>\n"
+"<label>Accel/brake current boost: <input type=\"number\" id=\"current_boost\" min=\"0\" max=\"31\"></label><br>\n"
+"<label>Hold current: <input type=\"number\" id=\"current_hold\" min=\"0\" max=\"31\"></label><br>\n"
+"<label>Hold current delay: <input type=\"number\" id=\"current_hold_delay\" min=\"0\" max=\"15\"></label><br>\n"
+"<label>Adaptive speed, load margin %: <input type=\"number\" id=\"adapt_margin\" min=\"0\" max=\"340\"></label><br>\n"
 "<h3>Network Configuration</h3>\n"
 "<label>IP Address: <input type=\"text\" id=\"ip_address\" required pattern=\"^((\\d{1,2}|1\\d\\d|2[0-4]\\d|25[0-5])\\.){3}(\\d{1,2}|1\\d\\d|2[0-4]\\d|25[0-5])$\"></label><br>\n"
 "<label>Gateway: <input type=\"text\" id=\"gateway\" required pattern=\"^((\\d{1,2}|1\\d\\d|2[0-4]\\d|25[0-5])\\.){3}(\\d{1,2}|1\\d\\d|2[0-4]\\d|25[0-5])$\"></label><br>\n"
@@ -269,6 +301,16 @@ static esp_err_t api_get_settings_handler(httpd_req_t *req)
     cJSON_AddBoolToObject(json, "dhcp_enable", settings.dhcp_enable);
     cJSON_AddBoolToObject(json, "dir_invert", settings.dir_invert);
     cJSON_AddNumberToObject(json, "max_speed", settings.max_speed);
+    cJSON_AddNumberToObject(json, "spread_rpm", settings.spread_rpm);
+    cJSON_AddNumberToObject(json, "coolstep_rpm", settings.coolstep_rpm);
+    cJSON_AddNumberToObject(json, "coolstep_semin", settings.coolstep_semin);
+    cJSON_AddNumberToObject(json, "coolstep_semax", settings.coolstep_semax);
+    cJSON_AddBoolToObject(json, "stall_lost", settings.stall_lost);
+    cJSON_AddNumberToObject(json, "current_run", settings.current_run);
+    cJSON_AddNumberToObject(json, "current_boost", settings.current_boost);
+    cJSON_AddNumberToObject(json, "current_hold", settings.current_hold);
+    cJSON_AddNumberToObject(json, "current_hold_delay", settings.current_hold_delay);
+    cJSON_AddNumberToObject(json, "adapt_margin", settings.adapt_margin);
     cJSON_AddStringToObject(json, "mqtt_uri", settings.mqtt_uri);
     cJSON_AddStringToObject(json, "mqtt_user", settings.mqtt_user);
     cJSON_AddStringToObject(json, "mqtt_pass", settings.mqtt_pass);
@@ -282,6 +324,16 @@ static esp_err_t api_get_settings_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+// the page limits the inputs too, but anything can post here
+static int setting_clamp(int value, int min, int max)
+{
+    if (value < min)
+        return min;
+    if (value > max)
+        return max;
+    return value;
+}
+
 static esp_err_t api_post_settings_handler(httpd_req_t *req)
 {
     int data_read = req->content_len;
@@ -342,7 +394,47 @@ static esp_err_t api_post_settings_handler(httpd_req_t *req)
 
     item = cJSON_GetObjectItemCaseSensitive(json, "max_speed");
     if (cJSON_IsNumber(item))
-        settings.max_speed = item->valueint;
+        settings.max_speed = setting_clamp(item->valueint, 30, 300);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "spread_rpm");
+    if (cJSON_IsNumber(item))
+        settings.spread_rpm = setting_clamp(item->valueint, 0, 300);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "coolstep_rpm");
+    if (cJSON_IsNumber(item))
+        settings.coolstep_rpm = setting_clamp(item->valueint, 0, 300);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "coolstep_semin");
+    if (cJSON_IsNumber(item))
+        settings.coolstep_semin = setting_clamp(item->valueint, 0, 15);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "coolstep_semax");
+    if (cJSON_IsNumber(item))
+        settings.coolstep_semax = setting_clamp(item->valueint, 0, 15);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "stall_lost");
+    if (cJSON_IsBool(item))
+        settings.stall_lost = cJSON_IsTrue(item);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "current_run");
+    if (cJSON_IsNumber(item))
+        settings.current_run = setting_clamp(item->valueint, 0, 31);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "current_boost");
+    if (cJSON_IsNumber(item))
+        settings.current_boost = setting_clamp(item->valueint, 0, 31);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "current_hold");
+    if (cJSON_IsNumber(item))
+        settings.current_hold = setting_clamp(item->valueint, 0, 31);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "current_hold_delay");
+    if (cJSON_IsNumber(item))
+        settings.current_hold_delay = setting_clamp(item->valueint, 0, 15);
+
+    item = cJSON_GetObjectItemCaseSensitive(json, "adapt_margin");
+    if (cJSON_IsNumber(item))
+        settings.adapt_margin = setting_clamp(item->valueint, 0, SETTINGS_ADAPT_MARGIN_MAX);
 
     item = cJSON_GetObjectItemCaseSensitive(json, "mqtt_uri");
     if (cJSON_IsString(item) && (item->valuestring != NULL))
@@ -365,6 +457,8 @@ static esp_err_t api_post_settings_handler(httpd_req_t *req)
     print_settings(&settings);
 
     save_settings(&settings);
+    if (_on_settings)
+        _on_settings();
 
     // Return success
     httpd_resp_set_status(req, "200 OK");
@@ -397,8 +491,10 @@ static esp_err_t debug_logs_get_handler(httpd_req_t *req)
 }
 
 //-----------------------------------------------------------------------------
-httpd_handle_t start_webserver(void)
+httpd_handle_t start_webserver(void (*on_settings)(void))
 {
+    _on_settings = on_settings;
+
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.lru_purge_enable = true;
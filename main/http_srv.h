@@ -2,6 +2,7 @@
 
 #include <esp_http_server.h>
 
-httpd_handle_t start_webserver(void);
+// on_settings is called once new settings from the page are saved
+httpd_handle_t start_webserver(void (*on_settings)(void));
 
 void setup_log_capture(void);
\ No newline at end of file
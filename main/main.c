@@ -13,6 +13,7 @@
 #include "mqtt_client.h"
 
 #include "esp_timer.h"
+#include "esp_rom_sys.h"
 #include "esp_netif.h"
 #include "esp_ota_ops.h"
 #include "esp_flash_partitions.h"
@@ -24,6 +25,7 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/event_groups.h>
 
 #include "lwip/ip_addr.h"
 
@@ -46,22 +48,45 @@ typedef enum {
     CMD_SWITCH_SETUP_OFF,
     CMD_SWITCH_SETUP_ON,
     CMD_BUTTON_SETUP_PRESS,
-    CMD_NUMBER_RPM
+    CMD_NUMBER_RPM,
+    CMD_STEPPER_DONE,
+    CMD_STEPPER_STALL,
+    CMD_STEPPER_CURRENT,
+    CMD_STEPPER_LOST,
+    CMD_STEPPER_HEALTH,
+    CMD_STEPPER_ISR_STATS,
+    CMD_SETTINGS_CHANGED
 } command_type_t;
 
 typedef struct {
     command_type_t type;
-    int value;  // Used for position or RPM commands
+    int value;  // Used for position or RPM commands, CMD_STEPPER_HEALTH: see blinds_health_text
+    int blind;  // stepper commands: blind the event came from
+    int load;   // CMD_STEPPER_DONE: lowest SG_RESULT of the cruise, 0 without a reading
+    uint32_t rx_us; // cover commands: esp_timer time the mqtt message came in
 } command_t;
 
 #define COMMAND_QUEUE_SIZE 10
+
+// step interrupt cost goes to the log and the diagnostic sensor this often
+#define ISR_STATS_PERIOD_US (60 * 1000 * 1000)
 static QueueHandle_t command_queue = NULL;
 
+// mqtt receipt of the cover command the next move starts for, 0 without one
+static volatile uint32_t motion_rx_us = 0;
+static uint32_t motion_latency_max = 0;
+
+// the blinds of the cover, moved together
+static stp_group_t blind_group;
+
 /////////////////////////////////////////////////////////////////////////////
 static char s_ip_addr_str[16] = "0.0.0.0";
-static bool s_handle_event_got_ip_address = false;
-static bool s_handle_event_got_ip_address_mqtt = false;
-static bool s_handle_event_disconnected = false;
+
+// set by the wifi and ip event handlers, the wifi task sleeps on them
+#define NET_EVENT_GOT_IP        (1 << 0)
+#define NET_EVENT_DISCONNECTED  (1 << 1)
+#define NET_EVENT_IP_READY      (1 << 2)   // stays set for app_main once we had an address
+static EventGroupHandle_t net_events = NULL;
 
 //-----------------------------------------------------------------------------
 static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -79,7 +104,7 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t e
     case WIFI_EVENT_STA_DISCONNECTED:
         printf("Disconnected. Connecting to the AP again...\n");
         esp_wifi_connect();
-        s_handle_event_disconnected = true;
+        xEventGroupSetBits(net_events, NET_EVENT_DISCONNECTED);
         break;
 
     default:
@@ -99,8 +124,7 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t eve
         // Note, I had to disable an ARP check on LWIP:
         // menuconfig -> Component config -> LWIP -> DISABLE 'DHCP: Perform ARP check on any offered address'
         // https://www.esp32.com/viewtopic.php?t=12859
-        s_handle_event_got_ip_address = true;
-        s_handle_event_got_ip_address_mqtt = true;
+        xEventGroupSetBits(net_events, NET_EVENT_GOT_IP | NET_EVENT_IP_READY);
         break;
 
     default:
@@ -109,6 +133,15 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t eve
     }
 }
 
+// the web page saved new settings, the main loop applies them
+static void settings_cb_changed(void)
+{
+    command_t cmd = {
+        .type = CMD_SETTINGS_CHANGED,
+    };
+    xQueueSend(command_queue, &cmd, 0);
+}
+
 static void wifi_task(void *Param)
 {
     printf("Wifi & OTA task starting!\n");
@@ -165,13 +198,12 @@ static void wifi_task(void *Param)
 
     esp_wifi_start();
 
-    const uint32_t task_delay_ms = 10;
-
     while (1)
     {
-        if (s_handle_event_got_ip_address)
+        EventBits_t bits = xEventGroupWaitBits(net_events, NET_EVENT_GOT_IP | NET_EVENT_DISCONNECTED, pdTRUE, pdFALSE, portMAX_DELAY);
+
+        if (bits & NET_EVENT_GOT_IP)
         {
-            s_handle_event_got_ip_address = false;
             esp_netif_ip_info_t ip_info;
             esp_netif_get_ip_info(IP_EVENT_STA_GOT_IP, &ip_info);
             printf("My IP: " IPSTR "\n", IP2STR(&ip_info.ip));
@@ -180,14 +212,12 @@ static void wifi_task(void *Param)
             if (server == NULL)
             {
                 printf("Starting webserver\n");
-                server = start_webserver();
+                server = start_webserver(settings_cb_changed);
             }
         }
 
-        if (s_handle_event_disconnected)
+        if (bits & NET_EVENT_DISCONNECTED)
         {
-            s_handle_event_disconnected = false;
-
             if (server)
             {
                 printf("Stopping webserver\n");
@@ -195,12 +225,76 @@ static void wifi_task(void *Param)
                 server = NULL;
             }
         }
-
-        vTaskDelay(task_delay_ms / portTICK_PERIOD_MS);
     }
 }
 
 /////////////////////////////////////////////////////////////////////////////
+static void stp_cb_event(const stp_event_t *event)
+{
+    command_t cmd;
+
+    if (event->type == STP_EVENT_DONE)
+    {
+        // a move that ended or was already there has nothing left to start.
+        // An axis that braked for the next move leaves it to that START.
+        if (stepper_group_ready(&blind_group))
+            motion_rx_us = 0;
+        ESP_LOGI("STP", "Move done at %d in %d ms", (int)event->position, (int)event->duration_ms);
+        cmd.type = CMD_STEPPER_DONE;
+    }
+    else if (event->type == STP_EVENT_STALL)
+    {
+        ESP_LOGI("STP", "Stalled at %d", (int)event->position);
+        cmd.type = CMD_STEPPER_STALL;
+    }
+    else if (event->type == STP_EVENT_LOST)
+    {
+        ESP_LOGW("STP", "Lost %d steps at %d", (int)event->lost, (int)event->position);
+        cmd.type = CMD_STEPPER_LOST;
+    }
+    else if (event->type == STP_EVENT_START)
+    {
+        // the first axis of the move to start measures for all of them
+        uint32_t rx_us = motion_rx_us;
+        if (rx_us)
+        {
+            motion_rx_us = 0;
+            uint32_t latency = (uint32_t)esp_timer_get_time() - rx_us;
+            if (latency > motion_latency_max)
+                motion_latency_max = latency;
+            ESP_LOGI("STP", "MQTT to motion start %u us, max %u us", (unsigned int)latency, (unsigned int)motion_latency_max);
+        }
+        return;
+    }
+    else if (event->type == STP_EVENT_DECEL)
+    {
+        // current scale coolstep ran the cruise at, in percent of IRUN
+        cmd.type = CMD_STEPPER_CURRENT;
+        cmd.value = (event->cs_actual + 1) * 100 / (event->cs_irun + 1);
+        xQueueSend(command_queue, &cmd, 0);
+        return;
+    }
+    else if (event->type == STP_EVENT_HEALTH)
+    {
+        ESP_LOGW("STP", "Driver health %02x, gstat %02x, derated to %d%%", event->health, event->gstat, event->derate_pct);
+        cmd.type = CMD_STEPPER_HEALTH;
+        cmd.value = event->health | event->gstat << 8 | event->derate_pct << 16;
+        cmd.blind = event->axis;
+        xQueueSend(command_queue, &cmd, 0);
+        return;
+    }
+    else
+    {
+        return;
+    }
+
+    // report back through the main loop
+    cmd.value = event->position;
+    cmd.blind = event->axis;
+    cmd.load = event->sg_min;
+    xQueueSend(command_queue, &cmd, 0);
+}
+
 tmc2209_io_t stepper = {
     //
     .enable = 2, //
@@ -208,9 +302,232 @@ tmc2209_io_t stepper = {
     .rx = 26,    //
     .dir = 18,   //
     .step = 23,  //
-    .spread = 4  //
+    .spread = 4, //
+
+    // step pulses from the timer isr, &stp_backend_rmt moves them to hardware,
+    // &stp_backend_vactual lets the driver step itself from uart
+    .backend = &stp_backend_isr,
+
+    // .mres_rpm = 120 half steps above 120 rpm for a quarter of the step
+    // interrupts, the pulses pause for a uart round trip at every switch
+
+    .on_event = stp_cb_event
+};
+
+// Blinds hanging side by side, driven as one cover. More drivers go on the
+// uart of the first one at their own addr, with their own dir and step pins.
+static tmc2209_io_t *blinds[] = {
+    &stepper,
 };
 
+#define BLIND_COUNT ((int)(sizeof(blinds) / sizeof(blinds[0])))
+_Static_assert(BLIND_COUNT <= SETTINGS_BLINDS_MAX && BLIND_COUNT <= STP_AXES_MAX, "too many blinds");
+
+// steps from open to closed
+static int32_t blind_limit(int i)
+{
+    return i == 0 ? settings.roller_limit : settings.blind_limit[i - 1];
+}
+
+// every blind to the same share of its own travel, they all arrive together
+static void blinds_go_to(int percent)
+{
+    int32_t target[STP_AXES_MAX];
+
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        target[i] = (int64_t)blind_limit(i) * percent / 100;
+    }
+
+    // not synchronised off the isr backend, each blind on its own then
+    if (stepper_group_go_to_pos(&blind_group, settings.max_speed, target) != 0)
+    {
+        for (int i = 0; i < BLIND_COUNT; i++)
+        {
+            stepper_go_to_pos(blinds[i], settings.max_speed, target[i]);
+        }
+    }
+}
+
+// Step interrupt cost of all blinds for the diagnostic sensor, the worst of
+// each in us. Blinds that never stepped have nothing to say.
+static void blinds_isr_stats_text(char *buffer, size_t len)
+{
+    uint32_t mhz = esp_rom_get_cpu_ticks_per_us();
+    uint32_t avg = 0;
+    uint32_t max = 0;
+
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        stp_isr_stats_t stats;
+        stepper_get_isr_stats(blinds[i], &stats);
+        if (stats.count == 0)
+        {
+            continue;
+        }
+        ESP_LOGI("STP", "Step isr of blind %d: %u steps, avg %u max %u cycles", i, (unsigned int)stats.count, (unsigned int)stats.avg, (unsigned int)stats.max);
+
+        if (stats.avg > avg)
+        {
+            avg = stats.avg;
+        }
+        if (stats.max > max)
+        {
+            max = stats.max;
+        }
+    }
+
+    snprintf(buffer, len, "avg %u.%u us, max %u.%u us",
+             (unsigned int)(avg / mhz), (unsigned int)(avg * 10 / mhz % 10),
+             (unsigned int)(max / mhz), (unsigned int)(max * 10 / mhz % 10));
+}
+
+static void isr_stats_timer_cb(void *arg)
+{
+    command_t cmd = {
+        .type = CMD_STEPPER_ISR_STATS,
+    };
+    xQueueSend(command_queue, &cmd, 0);
+}
+
+// Health of all blinds for the diagnostic sensor, the worst of each. health
+// holds DRV_STATUS bits 0..7, GSTAT in bits 8..15 and the derating in
+// 16..23 of each blind.
+static void blinds_health_text(char *buffer, size_t len, const int *health)
+{
+    int drv_status = 0;
+    int gstat = 0;
+    int derate = 100;
+
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        drv_status |= health[i] & 0xFF;
+        gstat |= (health[i] >> 8) & 0xFF;
+        int pct = (health[i] >> 16) & 0xFF;
+        if (pct && pct < derate)
+            derate = pct;
+    }
+
+    int n = 0;
+    if (drv_status & TMC_DRV_STATUS_OT)
+        n += snprintf(buffer + n, len - n, "%sovertemperature", n ? ", " : "");
+    if (drv_status & TMC_DRV_STATUS_OTPW)
+        n += snprintf(buffer + n, len - n, "%swarm, %d%% speed", n ? ", " : "", derate);
+    if (drv_status & TMC_DRV_STATUS_SHORT)
+        n += snprintf(buffer + n, len - n, "%sshort", n ? ", " : "");
+    if (drv_status & TMC_DRV_STATUS_OPEN)
+        n += snprintf(buffer + n, len - n, "%sopen load", n ? ", " : "");
+    if (gstat & TMC_GSTAT_DRV_ERR)
+        n += snprintf(buffer + n, len - n, "%sdriver error", n ? ", " : "");
+    if (gstat & TMC_GSTAT_UV_CP)
+        n += snprintf(buffer + n, len - n, "%sundervoltage", n ? ", " : "");
+    if (gstat & TMC_GSTAT_RESET)
+        n += snprintf(buffer + n, len - n, "%sreset", n ? ", " : "");
+    if (n == 0)
+        snprintf(buffer, len, "ok");
+}
+
+// The setup runs the whole travel once each way at max_speed and keeps the
+// lowest SG_RESULT of the cruise. Its headroom over the stall level is taken
+// to shrink in proportion to speed: each direction runs as fast as keeps
+// PROFILE_MARGIN times the stall level, headroom left at PROFILE_PCT_MAX
+// lowers the run current instead.
+#define PROFILE_MARGIN      2
+#define PROFILE_PCT_MIN     50
+#define PROFILE_PCT_MAX     200
+
+// the learned profiles and adaptive cruise to the drivers, or neither for
+// the setup to measure with
+static void blinds_set_profiles(bool learned)
+{
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        tmc2209_io_t *stp = blinds[i];
+        stp->adapt_sg = learned ? 2 * stp->sg_threshold * settings.adapt_margin / 100 : 0;
+
+        for (int dir = 0; dir < 2; dir++)
+        {
+            stp_profile_t profile = {0};
+            if (learned)
+            {
+                profile.speed_pct = settings.profile_speed[dir];
+                profile.accel_pct = settings.profile_accel[dir];
+                profile.irun = settings.profile_irun[dir];
+            }
+            stepper_set_profile(stp, dir, &profile);
+        }
+    }
+}
+
+// current and chopper settings to the drivers, at boot and whenever the web
+// page saved new ones with the blinds standing still
+static void blinds_set_settings(void)
+{
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        tmc2209_io_t *stp = blinds[i];
+
+        // run current by phase of the move, hold current at standstill
+        stp_current_t current = {
+            .run = settings.current_run,
+            .boost = settings.current_boost,
+            .hold = settings.current_hold,
+            .hold_delay = settings.current_hold_delay,
+        };
+        int ret = stepper_set_current(stp, &current);
+        ESP_LOGI("SYS", "STP %d current", ret);
+
+        // spreadcycle at speed, coolstep below it
+        stp_chopper_t chopper = {
+            .spread_rpm = settings.spread_rpm,
+            .coolstep_rpm = settings.coolstep_rpm,
+            .semin = settings.coolstep_semin,
+            .semax = settings.coolstep_semax,
+            .sg_lost = settings.stall_lost,
+        };
+        ret = stepper_set_chopper(stp, &chopper);
+        ESP_LOGI("SYS", "STP %d chopper", ret);
+    }
+}
+
+// dir is STP_DIR_FWD for closing, load the lowest SG_RESULT of all blinds
+static void profile_learn(int dir, int load)
+{
+    int stall = 2 * blinds[0]->sg_threshold;
+    int irun = 0;
+
+    if (load == 0)
+    {
+        ESP_LOGW("STP", "No load reading %s, max speed outside the CoolStep band?", dir == STP_DIR_FWD ? "closing" : "opening");
+        settings.profile_speed[dir] = 100;
+        settings.profile_accel[dir] = 100;
+        settings.profile_irun[dir] = 0;
+        return;
+    }
+
+    int pct = 100 * (load - stall) / ((PROFILE_MARGIN - 1) * stall);
+    if (pct > PROFILE_PCT_MAX)
+    {
+        // torque goes with the current, the driver runs at full scale without a run current set
+        int irun_full = settings.current_run ? settings.current_run : 31;
+        irun = irun_full * PROFILE_PCT_MAX / pct;
+        if (irun < irun_full / 2)
+        {
+            irun = irun_full / 2;
+        }
+        pct = PROFILE_PCT_MAX;
+    }
+    if (pct < PROFILE_PCT_MIN)
+    {
+        pct = PROFILE_PCT_MIN;
+    }
+
+    settings.profile_speed[dir] = pct;
+    settings.profile_accel[dir] = pct;
+    settings.profile_irun[dir] = irun;
+    ESP_LOGI("STP", "Profile %s: load %d, stall at %d, speed %d%%, irun %d", dir == STP_DIR_FWD ? "closing" : "opening", load, stall, pct, irun);
+}
+
 static int _atoi_checked(const char *str, int *ret)
 {
     int sign = 1;
@@ -265,7 +582,10 @@ void ha_cb_cover_update(char *topic, char *data, int data_len)
     memset(buffer, 0, data_len + 1);
     memcpy(buffer, data, data_len);
     
-    command_t cmd;
+    // stamped for the latency up to the start of the move
+    command_t cmd = {
+        .rx_us = (uint32_t)esp_timer_get_time(),
+    };
 
     if (strcmp(buffer, "OPEN") == 0)
     {
@@ -407,6 +727,32 @@ ha_text_param_t ha_text_status = {
     .identifiers = "RBS1",
     .sw_version = "1.0"};
 
+ha_text_param_t ha_text_current = {
+    .name = "",
+    .device_name = "",
+    .manufacturer = "Sander",
+    .model = "RBS1",
+    .identifiers = "RBS1",
+    .sw_version = "1.0"};
+
+ha_text_param_t ha_text_health = {
+    .name = "",
+    .device_name = "",
+    .manufacturer = "Sander",
+    .model = "RBS1",
+    .identifiers = "RBS1",
+    .sw_version = "1.0",
+    .diagnostic = 1};
+
+ha_text_param_t ha_text_isr = {
+    .name = "",
+    .device_name = "",
+    .manufacturer = "Sander",
+    .model = "RBS1",
+    .identifiers = "RBS1",
+    .sw_version = "1.0",
+    .diagnostic = 1};
+
 ha_number_param_t ha_rpm_max = {
     .name = "",
     .device_name = "",
@@ -419,17 +765,30 @@ ha_number_param_t ha_rpm_max = {
     .step = 1,
     .update_mqtt = ha_cb_number_rpm};
 
+// Setup finds both end stops on its own: run into one at speed, back off and
+// come in again slowly for the exact position. A full run each way learns
+// the profiles of the directions after that.
 typedef enum
 {
     STP_SETUP_NONE,
     STP_SETUP_DOWN_FAST,
+    STP_SETUP_DOWN_BACK,
     STP_SETUP_DOWN_SLOW,
-    STP_SETUP_DOWN_STOP,
     STP_SETUP_UP_FAST,
+    STP_SETUP_UP_BACK,
     STP_SETUP_UP_SLOW,
-    STP_SETUP_UP_STOP,
+    STP_SETUP_LEARN_DOWN,
+    STP_SETUP_LEARN_UP,
 } stp_setup_state_t;
 
+// half a turn away from the end stop before the slow approach
+#define STP_SETUP_BACK_STEPS    (STP_STEP_PER_RPM / 2)
+
+// Homing runs end here without a stall and setup gives up. The fast run may
+// cross the longest blind, the slow one only the way it backed off.
+#define STP_SETUP_TRAVEL_STEPS  (50 * STP_STEP_PER_RPM)
+#define STP_SETUP_SLOW_STEPS    (2 * STP_SETUP_BACK_STEPS)
+
 ///////////////////////////////////////
 
 void app_main(void)
@@ -438,21 +797,36 @@ void app_main(void)
 
     ESP_LOGI("SYS", "Starting, SW: " SW_VERSION_STR);
 
+    // Create command queue, stepper events post to it as soon as the first
+    // driver runs and the web server once it is up
+    command_queue = xQueueCreate(COMMAND_QUEUE_SIZE, sizeof(command_t));
+    net_events = xEventGroupCreate();
+    if (command_queue == NULL || net_events == NULL)
+    {
+        ESP_LOGE("MAIN", "Failed to create command queue");
+        return;
+    }
+
+    for (int i = 0; i < BLIND_COUNT; i++)
     {
+        tmc2209_io_t *stp = blinds[i];
+
         gpio_config_t io_conf = {};
         io_conf.intr_type = GPIO_INTR_DISABLE;
         io_conf.mode = GPIO_MODE_OUTPUT;
-        io_conf.pin_bit_mask = ((1ULL << stepper.enable) | (1ULL << stepper.spread) | (1ULL << stepper.step) | (1ULL << stepper.dir));
+        io_conf.pin_bit_mask = ((1ULL << stp->enable) | (1ULL << stp->spread) | (1ULL << stp->step) | (1ULL << stp->dir));
         io_conf.pull_down_en = 0;
         io_conf.pull_up_en = 0;
         gpio_config(&io_conf);
-    }
 
-    gpio_set_level(stepper.enable, 0);
-    gpio_set_level(stepper.spread, 0);
+        gpio_set_level(stp->enable, 0);
+        gpio_set_level(stp->spread, 0);
 
-    // initialize stepper
-    stepper_init(&stepper);
+        // initialize stepper, its axis is its index
+        stepper_init(stp);
+        blind_group.axis[i] = stp;
+    }
+    blind_group.count = BLIND_COUNT;
 
     // Initialize NVS.
     esp_err_t error = nvs_flash_init();
@@ -509,22 +883,19 @@ void app_main(void)
     xTaskCreate(wifi_task, "wifi_task", 4096, NULL, 0, NULL);
 
     // wait for connection
-    while (!s_handle_event_got_ip_address_mqtt)
-    {
-        vTaskDelay(50);
-    }
+    xEventGroupWaitBits(net_events, NET_EVENT_IP_READY, pdFALSE, pdTRUE, portMAX_DELAY);
 
-    // Create command queue
-    command_queue = xQueueCreate(COMMAND_QUEUE_SIZE, sizeof(command_t));
-    if (command_queue == NULL)
+    // restore position on boot, the other blinds are at the same share of their travel
+    for (int i = 0; i < BLIND_COUNT; i++)
     {
-        ESP_LOGE("MAIN", "Failed to create command queue");
-        return;
+        int32_t pos = settings.roller_pos;
+        if (i > 0 && settings.roller_limit > 0)
+        {
+            pos = (int64_t)pos * blind_limit(i) / settings.roller_limit;
+        }
+        stepper_set_position(blinds[i], pos);
     }
 
-    // restore position on boot
-    stepper_set_position(&stepper, settings.roller_pos);
-
     // create names
     ha_cover.device_name = settings.device_name;
     snprintf(ha_cover.name, sizeof(ha_cover.name), "%s Blind", settings.device_name);
@@ -534,6 +905,12 @@ void app_main(void)
     snprintf(ha_switch_setup_enable.name, sizeof(ha_switch_setup_enable.name), "%s Setup Active", settings.device_name);
     ha_button_setup.device_name = settings.device_name;
     snprintf(ha_button_setup.name, sizeof(ha_button_setup.name), "%s Setup Button", settings.device_name);
+    ha_text_current.device_name = settings.device_name;
+    snprintf(ha_text_current.name, sizeof(ha_text_current.name), "%s Motor Current", settings.device_name);
+    ha_text_health.device_name = settings.device_name;
+    snprintf(ha_text_health.name, sizeof(ha_text_health.name), "%s Driver Health", settings.device_name);
+    ha_text_isr.device_name = settings.device_name;
+    snprintf(ha_text_isr.name, sizeof(ha_text_isr.name), "%s Step ISR", settings.device_name);
     ha_rpm_max.device_name = settings.device_name;
     snprintf(ha_rpm_max.name, sizeof(ha_rpm_max.name), "%s RPM Max", settings.device_name);
 
@@ -544,6 +921,9 @@ void app_main(void)
     subscribe_buffer_t *button_handle = ha_lib_button_register(&ha_button_setup);
     // subscribe_buffer_t *text_handle = ha_lib_text_register(&ha_text_status);
     subscribe_buffer_t *number_handle = ha_lib_number_register(&ha_rpm_max);
+    subscribe_buffer_t *current_handle = ha_lib_text_register(&ha_text_current);
+    subscribe_buffer_t *health_handle = ha_lib_text_register(&ha_text_health);
+    subscribe_buffer_t *isr_handle = ha_lib_text_register(&ha_text_isr);
 
     // connect to mqtt
     ha_lib_init(settings.mqtt_uri, settings.mqtt_user, settings.mqtt_pass);
@@ -557,13 +937,16 @@ void app_main(void)
     ha_lib_switch_update(switch_handle, "OFF");
 
     // set position of the roller
-    float calc_pos = ((float)stepper.step_position / (float)settings.roller_limit * (float)100) + 1;
+    float calc_pos = ((float)stepper_get_position(&stepper) / (float)settings.roller_limit * (float)100) + 1;
     ha_lib_cover_set_position(cover_handle, (int)calc_pos);
 
     // set dir invert switch
     if (settings.dir_invert)
     {
-        stepper_set_invert(&stepper, 1);
+        for (int i = 0; i < BLIND_COUNT; i++)
+        {
+            stepper_set_invert(blinds[i], 1);
+        }
         ha_lib_switch_update(switch_handle_mount, "ON");
     }
     else
@@ -574,37 +957,51 @@ void app_main(void)
     // update max speed
     ha_lib_number_update(number_handle, settings.max_speed);
 
-    // hold current to 0
-    uint32_t data = 0;
-    vTaskDelay(10);
-    ret = stepper_read_reg(&stepper, 0x10, &data);
-    ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
-    data &= ~(0x0000001F);
-    vTaskDelay(10);
-    ret = stepper_write_reg(&stepper, 0x10, data);
-    ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
+    // the drivers report what goes wrong from here
+    ha_lib_text_sensor_update(health_handle, "ok");
+
+    // the step interrupt cost, measured by the driver on every step
+    esp_timer_handle_t isr_stats_timer;
+    const esp_timer_create_args_t isr_stats_timer_args = {
+        .callback = isr_stats_timer_cb,
+        .name = "isr_stats",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&isr_stats_timer_args, &isr_stats_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(isr_stats_timer, ISR_STATS_PERIOD_US));
 
-    // short coils on standstill
-    vTaskDelay(10);
-    ret = stepper_read_reg(&stepper, 0x70, &data);
-    ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
-    data &= ~(0x00300000);
-    data |= 0x00200000;
     vTaskDelay(10);
-    ret = stepper_write_reg(&stepper, 0x70, data);
-    ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
+    for (int i = 0; i < BLIND_COUNT; i++)
+    {
+        tmc2209_io_t *stp = blinds[i];
+
+        // short coils on standstill, with a hold current of 0
+        uint32_t data = 0;
+        ret = stepper_read_reg(stp, TMC_REG_PWMCONF, &data);
+        ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
+        data &= ~(0x00300000);
+        data |= 0x00200000;
+        ret = stepper_write_reg(stp, TMC_REG_PWMCONF, data);
+        ESP_LOGI("SYS", "STP %d %08x", ret, (unsigned int)data);
+    }
+    blinds_set_settings();
+    blinds_set_profiles(true);
 
     stp_setup_state_t setup_active_state = STP_SETUP_NONE;
-    int32_t setup_limit_step = settings.roller_limit;
+    int32_t setup_limit_step[BLIND_COUNT];
+    int setup_load[BLIND_COUNT];    // of the current setup step
+    uint8_t setup_stalled = 0;      // one bit per blind
+    int setup_pending = 0;          // blinds still running the current setup step
+    uint8_t setup_home_only = 0;    // the setup button only finds the open end stop again
+    uint8_t setup_rehome = 0;       // lost steps, home again once the blinds stopped
+    int blind_health[BLIND_COUNT] = {0};
+    uint8_t settings_changed = 0;   // from the web page, applied once the blinds stand still
     uint8_t stepper_moving_state = 0;
 
     while (1)
     {
-        vTaskDelay(1);
-
-        // Process commands from queue
+        // Process commands from queue, the stepper reports back through it as well
         command_t cmd;
-        if (xQueueReceive(command_queue, &cmd, 0) == pdTRUE)
+        if (xQueueReceive(command_queue, &cmd, portMAX_DELAY) == pdTRUE)
         {
             ESP_LOGI("MAIN", "Processing command type: %d, value: %d\n", cmd.type, cmd.value);
 
@@ -614,17 +1011,11 @@ void app_main(void)
                 // setup not active?
                 if (setup_active_state == STP_SETUP_NONE)
                 {
-                    if (stepper_ready(&stepper))
-                    {
-                        ha_lib_cover_set_state(cover_handle, "opening");
-                        stepper_go_to_pos(&stepper, settings.max_speed, 0);
-                        stepper_moving_state = 1;
-                    }
-                    else
-                    {
-                        // Stepper busy, re-enqueue command
-                        xQueueSend(command_queue, &cmd, 0);
-                    }
+                    // an active move is retargeted by the driver, a group of blinds brakes first
+                    ha_lib_cover_set_state(cover_handle, "opening");
+                    motion_rx_us = cmd.rx_us;
+                    blinds_go_to(0);
+                    stepper_moving_state = 1;
                 }
                 break;
 
@@ -632,22 +1023,15 @@ void app_main(void)
                 // setup not active?
                 if (setup_active_state == STP_SETUP_NONE)
                 {
-                    if (stepper_ready(&stepper))
-                    {
-                        ha_lib_cover_set_state(cover_handle, "closing");
-                        stepper_go_to_pos(&stepper, settings.max_speed, setup_limit_step);
-                        stepper_moving_state = 2;
-                    }
-                    else
-                    {
-                        // Stepper busy, re-enqueue command
-                        xQueueSend(command_queue, &cmd, 0);
-                    }
+                    ha_lib_cover_set_state(cover_handle, "closing");
+                    motion_rx_us = cmd.rx_us;
+                    blinds_go_to(100);
+                    stepper_moving_state = 2;
                 }
                 break;
 
             case CMD_COVER_STOP:
-                stepper_stop(&stepper);
+                stepper_group_stop(&blind_group);
                 stepper_moving_state = 3;
                 break;
 
@@ -655,106 +1039,80 @@ void app_main(void)
                 // setup not active?
                 if (setup_active_state == STP_SETUP_NONE)
                 {
-                    if (stepper_ready(&stepper))
-                    {
-                        int calc_pos = setup_limit_step * cmd.value / 100;
-                        stepper_go_to_pos(&stepper, settings.max_speed, calc_pos);
-                        stepper_moving_state = 4;
+                    int calc_pos = blind_limit(0) * cmd.value / 100;
+                    motion_rx_us = cmd.rx_us;
+                    blinds_go_to(cmd.value);
+                    stepper_moving_state = 4;
 
-                        // if we move to a bigger position, we are closing. If we move to a smaller position, we are opening
-                        if (calc_pos > stepper.step_position)
-                        {
-                            ha_lib_cover_set_state(cover_handle, "closing");
-                        }
-                        else
-                        {
-                            ha_lib_cover_set_state(cover_handle, "opening");
-                        }
+                    // if we move to a bigger position, we are closing. If we move to a smaller position, we are opening
+                    if (calc_pos > stepper_get_position(&stepper))
+                    {
+                        ha_lib_cover_set_state(cover_handle, "closing");
                     }
                     else
                     {
-                        // Stepper busy, re-enqueue command
-                        xQueueSend(command_queue, &cmd, 0);
+                        ha_lib_cover_set_state(cover_handle, "opening");
                     }
                 }
                 break;
 
             case CMD_SWITCH_MOUNT_OFF:
-                stepper_set_invert(&stepper, 0);
+                for (int i = 0; i < BLIND_COUNT; i++)
+                {
+                    stepper_set_invert(blinds[i], 0);
+                }
                 settings.dir_invert = 0;
                 save_settings(&settings);
                 ha_lib_switch_update(switch_handle_mount, "OFF");
                 break;
 
             case CMD_SWITCH_MOUNT_ON:
-                stepper_set_invert(&stepper, 1);
+                for (int i = 0; i < BLIND_COUNT; i++)
+                {
+                    stepper_set_invert(blinds[i], 1);
+                }
                 settings.dir_invert = 1;
                 save_settings(&settings);
                 ha_lib_switch_update(switch_handle_mount, "ON");
                 break;
 
             case CMD_SWITCH_SETUP_OFF:
-                stepper_stop(&stepper);
+                stepper_group_stop(&blind_group);
                 setup_active_state = STP_SETUP_NONE;
+                setup_home_only = 0;
                 ha_lib_switch_update(switch_handle, "OFF");
                 break;
 
             case CMD_SWITCH_SETUP_ON:
+                // bottom end stops first, every blind finds its own, at the plain speed
+                blinds_set_profiles(false);
+                setup_stalled = 0;
+                setup_pending = BLIND_COUNT;
+                setup_home_only = 0;
+                for (int i = 0; i < BLIND_COUNT; i++)
+                {
+                    stepper_home(blinds[i], settings.max_speed, stepper_get_position(blinds[i]) + STP_SETUP_TRAVEL_STEPS);
+                }
                 setup_active_state = STP_SETUP_DOWN_FAST;
                 ha_lib_switch_update(switch_handle, "ON");
                 break;
 
             case CMD_BUTTON_SETUP_PRESS:
-                // setup active?
-                switch (setup_active_state)
+                // the open end stop only, the learned travel and profiles stay
+                if (setup_active_state != STP_SETUP_NONE)
                 {
-                case STP_SETUP_DOWN_FAST:
-                    stepper_go_to_pos(&stepper, settings.max_speed, 16777215);
-                    setup_active_state = STP_SETUP_DOWN_SLOW;
-                    break;
-                case STP_SETUP_DOWN_SLOW:
-                    stepper_stop(&stepper);
-                    while (!stepper_ready(&stepper)) {vTaskDelay(10);}
-                    vTaskDelay(10);
-                    stepper_go_to_pos(&stepper, 30, 16777215);
-                    setup_active_state = STP_SETUP_DOWN_STOP;
-                    break;
-                case STP_SETUP_DOWN_STOP:
-                    stepper_stop(&stepper);
-                    setup_active_state = STP_SETUP_UP_FAST;
-                    break;
-                case STP_SETUP_UP_FAST:
-                    setup_limit_step = stepper.step_position;
-                    stepper_go_to_pos(&stepper, settings.max_speed, -16777215);
-                    setup_active_state = STP_SETUP_UP_SLOW;
-                    break;
-                case STP_SETUP_UP_SLOW:
-                    stepper_stop(&stepper);
-                    while (!stepper_ready(&stepper)) {vTaskDelay(10);}
-                    vTaskDelay(10);
-                    stepper_go_to_pos(&stepper, 30, -16777215);
-                    setup_active_state = STP_SETUP_UP_STOP;
-                    break;
-                case STP_SETUP_UP_STOP:
-                    stepper_stop(&stepper);
-                    vTaskDelay(200);
-                    setup_limit_step -= stepper.step_position;
-
-                    ESP_LOGI("STP", "Step limit %d", (int)setup_limit_step);
-
-                    stepper_set_position(&stepper, 0);
-
-                    ha_lib_switch_update(switch_handle, "OFF");
-                    setup_active_state = STP_SETUP_NONE;
-
-                    settings.roller_limit = setup_limit_step;
-                    settings.roller_pos = 0;
-                    save_settings(&settings);
-
-                    break;
-                default:
                     break;
                 }
+                blinds_set_profiles(false);
+                setup_stalled = 0;
+                setup_pending = BLIND_COUNT;
+                setup_home_only = 1;
+                stepper_moving_state = 0;
+                for (int i = 0; i < BLIND_COUNT; i++)
+                {
+                    stepper_home(blinds[i], settings.max_speed, stepper_get_position(blinds[i]) - STP_SETUP_TRAVEL_STEPS);
+                }
+                setup_active_state = STP_SETUP_UP_FAST;
                 break;
 
             case CMD_NUMBER_RPM:
@@ -763,55 +1121,245 @@ void app_main(void)
                 ha_lib_number_update(number_handle, settings.max_speed);
                 break;
 
-            default:
-                ESP_LOGW("MAIN", "Unknown command type: %d\n", cmd.type);
+            case CMD_STEPPER_STALL:
+                setup_stalled |= 1 << cmd.blind;
                 break;
-            }
-        }
 
-        if (stepper_moving_state && stepper_ready(&stepper))
-        {
-            if (stepper_moving_state == 1)
+            case CMD_STEPPER_LOST:
+                // setup finds the position on its own
+                if (setup_active_state == STP_SETUP_NONE)
+                {
+                    setup_rehome = 1;
+                }
+                break;
+
+            case CMD_STEPPER_CURRENT:
             {
-                ha_lib_cover_set_position(cover_handle, 0);
-                ha_lib_cover_set_state(cover_handle, "open");
+                char buffer[16];
+                snprintf(buffer, sizeof(buffer), "%d%%", cmd.value);
+                ha_lib_text_sensor_update(current_handle, buffer);
+                break;
             }
-            else if (stepper_moving_state == 2)
+
+            case CMD_SETTINGS_CHANGED:
+                settings_changed = 1;
+                ha_lib_number_update(number_handle, settings.max_speed);
+                break;
+
+            case CMD_STEPPER_HEALTH:
             {
-                ha_lib_cover_set_position(cover_handle, 100);
-                ha_lib_cover_set_state(cover_handle, "close");
+                char buffer[96];
+                blind_health[cmd.blind] = cmd.value;
+                blinds_health_text(buffer, sizeof(buffer), blind_health);
+                ha_lib_text_sensor_update(health_handle, buffer);
+                break;
             }
-            else if (stepper_moving_state == 3)
+
+            case CMD_STEPPER_ISR_STATS:
             {
-                float calc_pos = ((float)stepper.step_position / (float)setup_limit_step * (float)100) + 1;
-                ha_lib_cover_set_position(cover_handle, (int)calc_pos);
-                if (calc_pos == 100)
+                char buffer[48];
+                blinds_isr_stats_text(buffer, sizeof(buffer));
+                ha_lib_text_sensor_update(isr_handle, buffer);
+                break;
+            }
+
+            case CMD_STEPPER_DONE:
+                // setup runs from one step to the next on its own, once all blinds finished the current one
+                if (setup_active_state != STP_SETUP_NONE)
                 {
-                    ha_lib_cover_set_state(cover_handle, "close");
+                    setup_load[cmd.blind] = cmd.load;
+                    if (--setup_pending > 0)
+                    {
+                        break;
+                    }
+
+                    uint8_t stalled = setup_stalled;
+                    setup_stalled = 0;
+                    setup_pending = BLIND_COUNT;
+
+                    // one of them ran the whole way without hitting anything?
+                    bool homing = setup_active_state == STP_SETUP_DOWN_FAST || setup_active_state == STP_SETUP_DOWN_SLOW ||
+                                  setup_active_state == STP_SETUP_UP_FAST || setup_active_state == STP_SETUP_UP_SLOW;
+                    if (stalled != (1 << BLIND_COUNT) - 1 && homing)
+                    {
+                        ESP_LOGW("STP", "Setup found no end stop");
+                        setup_active_state = STP_SETUP_NONE;
+                        if (setup_home_only)
+                        {
+                            setup_home_only = 0;
+                            blinds_set_profiles(true);
+                        }
+                        ha_lib_switch_update(switch_handle, "OFF");
+                        break;
+                    }
+
+                    // the weakest blind sets the pace of the group
+                    int load = setup_load[0];
+                    for (int i = 1; i < BLIND_COUNT; i++)
+                    {
+                        if (setup_load[i] < load)
+                        {
+                            load = setup_load[i];
+                        }
+                    }
+                    if (setup_active_state == STP_SETUP_LEARN_DOWN)
+                    {
+                        profile_learn(STP_DIR_FWD, load);
+                    }
+                    else if (setup_active_state == STP_SETUP_LEARN_UP)
+                    {
+                        profile_learn(STP_DIR_REV, load);
+                    }
+
+                    for (int i = 0; i < BLIND_COUNT; i++)
+                    {
+                        tmc2209_io_t *stp = blinds[i];
+                        int32_t pos = stepper_get_position(stp);
+
+                        switch (setup_active_state)
+                        {
+                        case STP_SETUP_DOWN_FAST:
+                            stepper_go_to_pos(stp, settings.max_speed, pos - STP_SETUP_BACK_STEPS);
+                            break;
+                        case STP_SETUP_DOWN_BACK:
+                            stepper_home(stp, STP_RPM_DIRECT, pos + STP_SETUP_SLOW_STEPS);
+                            break;
+                        case STP_SETUP_DOWN_SLOW:
+                            setup_limit_step[i] = pos;
+                            stepper_home(stp, settings.max_speed, pos - STP_SETUP_TRAVEL_STEPS);
+                            break;
+                        case STP_SETUP_UP_FAST:
+                            stepper_go_to_pos(stp, settings.max_speed, pos + STP_SETUP_BACK_STEPS);
+                            break;
+                        case STP_SETUP_UP_BACK:
+                            stepper_home(stp, STP_RPM_DIRECT, pos - STP_SETUP_SLOW_STEPS);
+                            break;
+                        case STP_SETUP_UP_SLOW:
+                            if (setup_home_only)
+                            {
+                                stepper_set_position(stp, 0);
+                                break;
+                            }
+                            setup_limit_step[i] -= pos;
+                            ESP_LOGI("STP", "Step limit %d of blind %d", (int)setup_limit_step[i], i);
+                            stepper_set_position(stp, 0);
+                            if (i == 0)
+                            {
+                                settings.roller_limit = setup_limit_step[i];
+                            }
+                            else
+                            {
+                                settings.blind_limit[i - 1] = setup_limit_step[i];
+                            }
+                            stepper_go_to_pos(stp, settings.max_speed, setup_limit_step[i]);
+                            break;
+                        case STP_SETUP_LEARN_DOWN:
+                            stepper_go_to_pos(stp, settings.max_speed, 0);
+                            break;
+                        default:
+                            break;
+                        }
+                    }
+
+                    if (setup_active_state == STP_SETUP_LEARN_UP || (setup_active_state == STP_SETUP_UP_SLOW && setup_home_only))
+                    {
+                        ha_lib_switch_update(switch_handle, "OFF");
+                        setup_active_state = STP_SETUP_NONE;
+                        setup_home_only = 0;
+                        blinds_set_profiles(true);
+
+                        settings.roller_pos = 0;
+                        save_settings(&settings);
+
+                        ha_lib_cover_set_position(cover_handle, 0);
+                        ha_lib_cover_set_state(cover_handle, "open");
+                    }
+                    else
+                    {
+                        // the steps follow each other in stp_setup_state_t
+                        setup_active_state++;
+                    }
+                    break;
                 }
-                else
+
+                // the group arrives together, report once all blinds stand still
+                if (!stepper_group_ready(&blind_group))
                 {
-                    ha_lib_cover_set_state(cover_handle, "open");
+                    break;
                 }
-            }
-            else if (stepper_moving_state == 4)
-            {
-                float calc_pos = ((float)stepper.step_position / (float)setup_limit_step * (float)100) + 1;
-                ha_lib_cover_set_position(cover_handle, (int)calc_pos);
-                if (calc_pos == 100)
+                cmd.value = stepper_get_position(&stepper);
+
+                // the position can't be trusted, learn it again through the setup
+                if (setup_rehome)
                 {
-                    ha_lib_cover_set_state(cover_handle, "close");
+                    setup_rehome = 0;
+                    stepper_moving_state = 0;
+
+                    cmd.type = CMD_SWITCH_SETUP_ON;
+                    cmd.value = 0;
+                    xQueueSend(command_queue, &cmd, 0);
+                    break;
                 }
-                else
+
+                // moves from the setup don't report to home assistant
+                if (stepper_moving_state)
                 {
-                    ha_lib_cover_set_state(cover_handle, "open");
+                    if (stepper_moving_state == 1)
+                    {
+                        ha_lib_cover_set_position(cover_handle, 0);
+                        ha_lib_cover_set_state(cover_handle, "open");
+                    }
+                    else if (stepper_moving_state == 2)
+                    {
+                        ha_lib_cover_set_position(cover_handle, 100);
+                        ha_lib_cover_set_state(cover_handle, "close");
+                    }
+                    else if (stepper_moving_state == 3)
+                    {
+                        float calc_pos = ((float)cmd.value / (float)blind_limit(0) * (float)100) + 1;
+                        ha_lib_cover_set_position(cover_handle, (int)calc_pos);
+                        if (calc_pos == 100)
+                        {
+                            ha_lib_cover_set_state(cover_handle, "close");
+                        }
+                        else
+                        {
+                            ha_lib_cover_set_state(cover_handle, "open");
+                        }
+                    }
+                    else if (stepper_moving_state == 4)
+                    {
+                        float calc_pos = ((float)cmd.value / (float)blind_limit(0) * (float)100) + 1;
+                        ha_lib_cover_set_position(cover_handle, (int)calc_pos);
+                        if (calc_pos == 100)
+                        {
+                            ha_lib_cover_set_state(cover_handle, "close");
+                        }
+                        else
+                        {
+                            ha_lib_cover_set_state(cover_handle, "open");
+                        }
+                    }
+
+                    settings.roller_pos = cmd.value;
+                    save_settings(&settings);
+
+                    stepper_moving_state = 0;
                 }
-            }
+                break;
 
-            settings.roller_pos = stepper.step_position;
-            save_settings(&settings);
+            default:
+                ESP_LOGW("MAIN", "Unknown command type: %d\n", cmd.type);
+                break;
+            }
 
-            stepper_moving_state = 0;
+            // the done of the last move comes by here as well
+            if (settings_changed && setup_active_state == STP_SETUP_NONE && stepper_group_ready(&blind_group))
+            {
+                settings_changed = 0;
+                blinds_set_settings();
+                blinds_set_profiles(true);
+            }
         }
     }
 }
\ No newline at end of file
@@ -1,370 +1,2791 @@
 #include "stp_drv.h"
-#include "driver/uart.h"
 #include "driver/gptimer.h"
 #include "esp_log.h"
-#include <math.h>
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "soc/gpio_struct.h"
+#include <assert.h>
+#include <stdlib.h>
+#include "stp_scurve.h"
 
-#define RPM_TO_PERIOD(rpm) ((CLOCK_PWM) / ((rpm / 60) * STP_STEP_PER_RPM))
+// APB / 2, the finest the timer divider allows
+#define STP_TIMER_HZ        40000000
 
-#define S_CURVE_FLEX    3
+// every ramp starts from this speed
+#define STP_RPM_START       30
 
-static bool IRAM_ATTR example_timer_on_alarm_cb_v1(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_data)
+#define STP_US_TO_TICKS(us) ((us) * (STP_TIMER_HZ / 1000000))
+
+// why the stepper task was woken
+#define STP_NOTIFY_CMD      (1 << 0)
+#define STP_NOTIFY_CRUISE   (1 << 1)
+#define STP_NOTIFY_DECEL    (1 << 2)
+#define STP_NOTIFY_DONE     (1 << 3)
+#define STP_NOTIFY_STALL    (1 << 4)
+#define STP_NOTIFY_MRES     (1 << 5)
+#define STP_NOTIFY_VACTUAL  (1 << 6)
+#define STP_NOTIFY_VERIFY   (1 << 7)   // background reads came back, lost step or health
+
+// every axis has a byte of the stepper task's notification value
+#define STP_NOTIFY_SHIFT(axis)  ((axis) * 8)
+#define STP_NOTIFY_MASK         0xFF
+
+// steps this close to the alarm go out in the same interrupt
+#define STP_SCHED_MERGE_TICKS   STP_US_TO_TICKS(2)
+
+// Microstep switch in flight: the isr asked for it, the stepper task queued
+// the CHOPCONF write, the uart task reports how it went. The pulse after the
+// switch point waits for the result, checked every STP_MRES_POLL_TICKS.
+#define STP_MRES_IDLE       0
+#define STP_MRES_ASK        1
+#define STP_MRES_WRITE      2
+#define STP_MRES_OK         3
+#define STP_MRES_FAIL       4
+#define STP_MRES_LOST       5   // back to fine failed, the isr stopped
+#define STP_MRES_POLL_TICKS STP_US_TO_TICKS(20)
+
+// a retarget joins its ramp at the velocity it was planned for, off by more
+// than 1/8 of it the isr leaves it to the stepper task to plan again
+#define STP_RETARGET_SLIP_DIV   8
+
+static uint32_t IRAM_ATTR _stp_ramp_velocity(const stp_ramp_t *ramp, uint32_t t)
+{
+    // past the end of the ramp?
+    if (t >= ramp->ticks)
+        return ramp->v_cruise;
+
+    // constant acceleration between the two jerk phases
+    if (t >= ramp->tj && t < ramp->tj + ramp->ta)
+        return ramp->v_start + ramp->v_jerk / 2 + (uint32_t)(((uint64_t)ramp->accel * (t - ramp->tj)) >> 32);
+
+    // jerk phases run the first and second half of the s-curve
+    uint32_t v = ramp->v_start;
+    if (t >= ramp->tj) {
+        t -= ramp->ta;
+        v += ramp->v_cruise - ramp->v_start - ramp->v_jerk;
+    }
+
+    // position on the table, interpolate between the two entries around us.
+    // len rounds up, the last tick of the curve shifted down must stay short
+    // of it or idx + 1 reads past the end of the table
+    uint32_t len = ((2 * ramp->tj - 1) >> ramp->shift) + 1;
+    uint32_t x = (t >> ramp->shift) * STP_SCURVE_LEN;
+    uint32_t idx = x / len;
+    int32_t frac = x % len;
+    int32_t s0 = stp_scurve_tbl[idx];
+    int32_t s1 = stp_scurve_tbl[idx + 1];
+    uint32_t s = s0 + (s1 - s0) * frac / (int32_t)len;
+
+    return v + ((ramp->v_jerk * s) >> 16);
+}
+
+static void _stp_ramp_load(stp_ramp_t *ramp, const stp_plan_t *plan)
+{
+    ramp->v_start = plan->v_start;
+    ramp->v_cruise = plan->v_peak;
+    ramp->tj = STP_US_TO_TICKS(plan->t_jerk);
+    ramp->ta = STP_US_TO_TICKS(plan->t_accel);
+    ramp->ticks = 2 * ramp->tj + ramp->ta;
+
+    // the table lookup multiplies the jerk phase ticks by STP_SCURVE_LEN and
+    // the slope between two entries, up to 512
+    ramp->shift = 0;
+    while (((2 * ramp->tj) >> ramp->shift) >= (1UL << 21))
+        ramp->shift++;
+
+    // velocity gained in the two jerk phases together, the rest comes from constant acceleration
+    ramp->v_jerk = 0;
+    ramp->accel = 0;
+    if (ramp->ta) {
+        ramp->v_jerk = (uint64_t)plan->a_peak * plan->t_jerk / 1000000;
+        ramp->accel = ((uint64_t)(ramp->v_cruise - ramp->v_start - ramp->v_jerk) << 32) / ramp->ta;
+    }
+    else if (ramp->tj) {
+        ramp->v_jerk = ramp->v_cruise - ramp->v_start;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// One step scheduler for every axis: one timer and one task however many
+// drivers share the bus
+/////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    tmc2209_io_t *axis[STP_AXES_MAX];
+    volatile uint8_t count;
+    TaskHandle_t task;
+
+    // isr backend: free running timer, alarm on the earliest step due
+    gptimer_handle_t gptimer;
+} stp_sched_t;
+
+static stp_sched_t _stp_sched;
+
+/////////////////////////////////////////////////////////////////////////////
+// Shared state: the api posts commands in a single slot mailbox, the motion
+// core publishes its state through a seqlock. Neither side ever waits on the
+// other, the step path takes no lock.
+/////////////////////////////////////////////////////////////////////////////
+
+static void IRAM_ATTR _stp_notify(tmc2209_io_t *stp, uint32_t bits)
+{
+    TaskHandle_t task = _stp_sched.task;
+    if (task == NULL)
+        return;
+
+    bits <<= STP_NOTIFY_SHIFT(stp->axis);
+
+    // the first rmt refill runs from rmt_transmit in the stepper task
+    if (xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        xTaskNotifyFromISR(task, bits, eSetBits, &woken);
+        if (woken)
+            portYIELD_FROM_ISR();
+    }
+    else {
+        xTaskNotify(task, bits, eSetBits);
+    }
+}
+
+// Copies the newest command that was not taken yet. Returns its sequence
+// number, 0 when there is none or it is being written right now.
+static uint32_t IRAM_ATTR _stp_cmd_peek(tmc2209_io_t *stp, stp_cmd_t *cmd)
+{
+    uint32_t seq = __atomic_load_n(&stp->cmd_seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || seq == stp->cmd_taken)
+        return 0;
+
+    *cmd = stp->cmd;
+
+    // overwritten while we copied?
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&stp->cmd_seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+
+    return seq;
+}
+
+// writes the slot claimed at seq and hands it over
+static void _stp_cmd_fill(tmc2209_io_t *stp, uint32_t seq, const stp_cmd_t *cmd)
+{
+    stp->cmd = *cmd;
+
+    // skip 0, it means no command
+    seq += 2;
+    if (seq == 0)
+        seq = 2;
+    __atomic_store_n(&stp->cmd_seq, seq, __ATOMIC_RELEASE);
+}
+
+static void _stp_cmd_post(tmc2209_io_t *stp, const stp_cmd_t *cmd)
+{
+    // claim the slot, only other api callers can hold it
+    uint32_t seq = __atomic_load_n(&stp->cmd_seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&stp->cmd_seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        vTaskDelay(1);
+        seq = __atomic_load_n(&stp->cmd_seq, __ATOMIC_RELAXED);
+    }
+
+    _stp_cmd_fill(stp, seq, cmd);
+
+    // the isr takes it itself while moving, the task needs it when idle
+    _stp_notify(stp, STP_NOTIFY_CMD);
+}
+
+// Replaces command seq by cmd. Returns 0 when a newer one was posted
+// meanwhile, that one wins.
+static uint8_t _stp_cmd_replace(tmc2209_io_t *stp, uint32_t seq, const stp_cmd_t *cmd)
+{
+    if (!__atomic_compare_exchange_n(&stp->cmd_seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    _stp_cmd_fill(stp, seq, cmd);
+    return 1;
+}
+
+static uint8_t _stp_cmd_pending(tmc2209_io_t *stp)
+{
+    return __atomic_load_n(&stp->cmd_seq, __ATOMIC_ACQUIRE) != stp->cmd_taken;
+}
+
+// only ever called by the current owner of the motion state
+static void IRAM_ATTR _stp_status_publish(tmc2209_io_t *stp)
+{
+    uint32_t seq = stp->status_seq;
+
+    __atomic_store_n(&stp->status_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stp->status.position = stp->ramp_position;
+    stp->status.target = stp->step_target;
+    stp->status.ramp_steps = stp->ramp_steps;
+    stp->status.velocity = stp->duty_set;
+    stp->status.state = stp->ramp_state;
+    stp->status.dir = stp->dir_set;
+
+    __atomic_store_n(&stp->status_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static void IRAM_ATTR _stp_brake(tmc2209_io_t *stp)
+{
+    // brake over the same number of steps it took to get up to speed,
+    // counted from the last step the backend has planned
+    if (stp->dir_set)
+        stp->step_target = stp->ramp_position - stp->ramp_steps;
+    else
+        stp->step_target = stp->ramp_position + stp->ramp_steps;
+}
+
+// The app plans a retarget from a status snapshot, the move went on since.
+// Stale when we are no longer near the velocity it joins the new ramp at, or
+// too close to the new target to brake on it: braking started meanwhile.
+static uint8_t IRAM_ATTR _stp_retarget_stale(tmc2209_io_t *stp, const stp_cmd_t *cmd)
+{
+    int32_t remaining;
+    if (stp->dir_set == 0)
+        remaining = cmd->target - stp->ramp_position;
+    else
+        remaining = stp->ramp_position - cmd->target;
+
+    if (remaining < (int32_t)cmd->ramp_steps)
+        return 1;
+
+    uint32_t v = _stp_ramp_velocity(&cmd->ramp, cmd->ramp_time);
+    uint32_t slip = v / STP_RETARGET_SLIP_DIV;
+    return stp->duty_set + slip < v || stp->duty_set > v + slip;
+}
+
+static void IRAM_ATTR _stp_ramp_command(tmc2209_io_t *stp)
+{
+    stp_cmd_t cmd;
+    uint32_t seq = _stp_cmd_peek(stp, &cmd);
+    if (seq == 0)
+        return;
+
+    switch (cmd.type) {
+    case STP_CMD_RETARGET:
+        // out of date? Go on with the active ramp until the stepper task
+        // planned it again from where we are
+        if (seq == stp->cmd_stale)
+            break;
+        if (_stp_retarget_stale(stp, &cmd)) {
+            stp->cmd_stale = seq;
+            _stp_notify(stp, STP_NOTIFY_CMD);
+            break;
+        }
+
+        // continue on the new ramp from the point that matches our velocity
+        stp->ramp = cmd.ramp;
+        stp->ramp_time = cmd.ramp_time;
+        stp->ramp_steps = cmd.ramp_steps;
+        stp->step_target = cmd.target;
+        if (stp->ramp_time >= stp->ramp.ticks)
+            stp->ramp_state = STP_RAMP_CRUISE;
+        else
+            stp->ramp_state = STP_RAMP_ACCEL;
+        stp->cmd_taken = seq;
+
+        // a new target, not just a new speed, starts a move for the app
+        if (cmd.report) {
+            stp->cmd_started = 1;
+            _stp_notify(stp, STP_NOTIFY_CMD);
+        }
+        break;
+
+    case STP_CMD_SLOW:
+        // down the active ramp first, braking for the target wins
+        if (stp->ramp_state == STP_RAMP_DECEL) {
+            stp->cmd_taken = seq;
+        }
+        else if (stp->duty_set > cmd.ramp.v_cruise) {
+            stp->ramp_state = STP_RAMP_SLOW;
+        }
+        else {
+            stp->ramp = cmd.ramp;
+            stp->ramp_time = cmd.ramp_time;
+            stp->ramp_steps = cmd.ramp_steps;
+            stp->ramp_state = STP_RAMP_CRUISE;
+            stp->cmd_taken = seq;
+        }
+        break;
+
+    case STP_CMD_STOP:
+        _stp_brake(stp);
+        stp->cmd_taken = seq;
+        break;
+
+    case STP_CMD_HALT:
+        // no ramp down, the step just made is the last one
+        stp->step_target = stp->ramp_position;
+        stp->cmd_taken = seq;
+        break;
+
+    default:
+        // a new move needs standstill first, the stepper task starts it.
+        // Braking again on the next step lands on the same position.
+        _stp_brake(stp);
+        break;
+    }
+}
+
+// Plans the next step of the move. Returns the period to wait after that step
+// pulse, or 0 when the target is reached and no pulse should be given.
+static uint32_t IRAM_ATTR _stp_ramp_next(tmc2209_io_t *stp)
+{
+    uint8_t state = stp->ramp_state;
+    uint32_t k = stp->mres_k;
+
+    _stp_ramp_command(stp);
+
+    // steps left in our direction, a brake can put the target right behind us
+    int32_t remaining;
+    if (stp->dir_set == 0)
+        remaining = stp->step_target - stp->ramp_position;
+    else
+        remaining = stp->ramp_position - stp->step_target;
+
+    // a coarse pulse never goes past the target
+    if (remaining < (int32_t)k)
+        return 0;
+
+    if (stp->dir_set == 0) {
+        stp->ramp_position += k;
+    }
+    else {
+        stp->ramp_position -= k;
+    }
+    remaining -= k;
+
+    // advance along the curve by the period of the previous step
+    switch (stp->ramp_state) {
+    case STP_RAMP_ACCEL:
+        stp->ramp_steps += k;
+        stp->ramp_time += stp->step_period;
+        if (stp->ramp_time >= stp->ramp.ticks)
+            stp->ramp_state = STP_RAMP_CRUISE;
+        break;
+
+    case STP_RAMP_DECEL:
+    case STP_RAMP_SLOW:
+        if (stp->ramp_steps > k)
+            stp->ramp_steps -= k;
+        else
+            stp->ramp_steps = 0;
+        if (stp->ramp_time > stp->step_period)
+            stp->ramp_time -= stp->step_period;
+        else
+            stp->ramp_time = 0;
+        break;
+
+    default:
+        break;
+    }
+
+    // braking takes as many steps as getting up to speed did
+    if (stp->ramp_state != STP_RAMP_DECEL && remaining <= (int32_t)stp->ramp_steps)
+        stp->ramp_state = STP_RAMP_DECEL;
+
+    stp->duty_set = _stp_ramp_velocity(&stp->ramp, stp->ramp_time);
+
+    // the remainder carries over to the next period, the rate is exact on
+    // average where a single period can't be
+    uint32_t num = STP_TIMER_HZ * k + stp->step_frac;
+    stp->step_period = num / stp->duty_set;
+    stp->step_frac = num - stp->step_period * stp->duty_set;
+
+    _stp_status_publish(stp);
+
+    // entered the next segment of the ramp? Back at cruise after slowing
+    // down is still the same cruise.
+    if (stp->ramp_state != state && !(state == STP_RAMP_SLOW && stp->ramp_state == STP_RAMP_CRUISE)) {
+        if (stp->ramp_state == STP_RAMP_CRUISE)
+            _stp_notify(stp, STP_NOTIFY_CRUISE);
+        else if (stp->ramp_state == STP_RAMP_DECEL)
+            _stp_notify(stp, STP_NOTIFY_DECEL);
+    }
+
+    return stp->step_period;
+}
+
+static void IRAM_ATTR _stp_ramp_finish(tmc2209_io_t *stp)
+{
+    // followers stop with their leader, wherever a brake left them
+    stp_group_t *grp = stp->group;
+    if (grp != NULL && grp->leader == stp) {
+        for (int i = 0; i < grp->count; i++) {
+            tmc2209_io_t *f = grp->axis[i];
+            if (f == stp || f->ramp_state == STP_RAMP_IDLE)
+                continue;
+            f->step_position = f->ramp_position;
+            _stp_ramp_finish(f);
+        }
+    }
+
+    stp->step_target = stp->step_position;
+    stp->ramp_position = stp->step_position;
+    stp->duty_set = 0;
+    stp->ramp_state = STP_RAMP_IDLE;
+    _stp_status_publish(stp);
+    _stp_notify(stp, STP_NOTIFY_DONE);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ISR backend: one gptimer for all axes, one interrupt per step due
+/////////////////////////////////////////////////////////////////////////////
+
+static inline void IRAM_ATTR _stp_delay_cycles(uint32_t start, uint32_t cycles)
+{
+    while (esp_cpu_get_cycle_count() - start < cycles)
+        ;
+}
+
+static void IRAM_ATTR _stp_isr_stats_add(stp_isr_stats_t *stats, uint32_t cycles)
+{
+    stats->count++;
+    stats->last = cycles;
+    if (cycles > stats->max)
+        stats->max = cycles;
+
+    // every field is a single word, readers never see a torn value
+    if (stats->avg == 0)
+        stats->avg = cycles;
+    else
+        stats->avg = stats->avg - (stats->avg >> 4) + (cycles >> 4);
+}
+
+// Resolution the next pulses should have, 0 to keep the current one. Going
+// coarse waits for a full step, going fine works anywhere.
+static uint8_t IRAM_ATTR _stp_mres_next(tmc2209_io_t *stp)
+{
+    if (!stp->mres_on)
+        return 0;
+
+    // back to fine well before the end, the last pulses may not line up
+    uint32_t remaining = abs(stp->step_target - stp->ramp_position);
+
+    if (stp->mres_k == 1) {
+        if (stp->duty_set < stp->mres_up || remaining < 4 * STP_MRES_RATIO)
+            return 0;
+        if ((uint32_t)(stp->ramp_position + stp->mres_align) % MICROSTEPS)
+            return 0;
+        return STP_MRES_RATIO;
+    }
+
+    if (stp->duty_set >= stp->mres_down && remaining >= 4 * STP_MRES_RATIO)
+        return 0;
+    return 1;
+}
+
+// Bresenham against the leader's distance: raises the step pins of the
+// followers due with this pulse, returns them as a mask of group members
+static uint32_t IRAM_ATTR _stp_group_step_set(stp_group_t *grp)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i < grp->count; i++) {
+        tmc2209_io_t *f = grp->axis[i];
+        if (f == grp->leader || f->ramp_state == STP_RAMP_IDLE)
+            continue;
+
+        grp->acc[i] += grp->delta[i];
+        if (grp->acc[i] < grp->lead_delta)
+            continue;
+        grp->acc[i] -= grp->lead_delta;
+
+        // never past its own target
+        if (f->ramp_position == f->step_target)
+            continue;
+
+        *f->step_set_reg = f->step_mask;
+        if (f->dir_set == 0)
+            f->ramp_position++;
+        else
+            f->ramp_position--;
+        mask |= 1UL << i;
+    }
+
+    return mask;
+}
+
+static void IRAM_ATTR _stp_group_step_clr(stp_group_t *grp, uint32_t mask)
+{
+    tmc2209_io_t *lead = grp->leader;
+
+    for (int i = 0; i < grp->count; i++) {
+        if (!(mask & (1UL << i)))
+            continue;
+
+        tmc2209_io_t *f = grp->axis[i];
+        *f->step_clr_reg = f->step_mask;
+
+        // same phase of the ramp as the leader, at a fraction of its speed
+        f->step_position = f->ramp_position;
+        f->ramp_state = lead->ramp_state;
+        f->duty_set = (uint64_t)lead->duty_set * grp->delta[i] / grp->lead_delta;
+        _stp_status_publish(f);
+    }
+}
+
+// Takes the result of a microstep switch. Returns 1 while the write is still
+// out and the pulse has to wait.
+static uint8_t IRAM_ATTR _stp_mres_wait(tmc2209_io_t *stp)
+{
+    uint8_t state = __atomic_load_n(&stp->mres_state, __ATOMIC_ACQUIRE);
+
+    switch (state) {
+    case STP_MRES_ASK:
+    case STP_MRES_WRITE:
+        return 1;
+
+    case STP_MRES_OK:
+        stp->mres_k = stp->mres_pending;
+        break;
+
+    case STP_MRES_FAIL:
+        // still fine, not again in this move
+        if (stp->mres_pending != 1) {
+            stp->mres_on = 0;
+            break;
+        }
+
+        // Coarse pulses can't reach the last steps and the driver may have
+        // taken the write after all. The move ends here, the stepper task
+        // reports it lost.
+        stp->mres_on = 0;
+        stp->step_target = stp->ramp_position;
+        __atomic_store_n(&stp->mres_state, STP_MRES_LOST, __ATOMIC_RELEASE);
+        _stp_notify(stp, STP_NOTIFY_MRES);
+        return 0;
+
+    default:
+        return 0;
+    }
+
+    __atomic_store_n(&stp->mres_state, STP_MRES_IDLE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Pulses one axis. Returns the ticks to its next step, 0 when it stopped.
+static uint32_t IRAM_ATTR _stp_isr_step(tmc2209_io_t *stp)
+{
+    uint32_t t_start = esp_cpu_get_cycle_count();
+
+    // the driver may switch any moment, no pulse until we know it did
+    if (_stp_mres_wait(stp))
+        return STP_MRES_POLL_TICKS;
+
+    uint32_t period = _stp_ramp_next(stp);
+
+    // nothing left to do?
+    if (period == 0) {
+        _stp_ramp_finish(stp);
+        return 0;
+    }
+
+    // pulse through the set/clear registers, held for the driver's minimum
+    // high time. The followers of a group move pulse along.
+    stp_group_t *grp = stp->group;
+    *stp->step_set_reg = stp->step_mask;
+    uint32_t follow = grp ? _stp_group_step_set(grp) : 0;
+    _stp_delay_cycles(esp_cpu_get_cycle_count(), stp->pulse_cycles);
+    *stp->step_clr_reg = stp->step_mask;
+    if (follow)
+        _stp_group_step_clr(grp, follow);
+    stp->step_position = stp->ramp_position;
+
+    // that was the last one?
+    if (stp->step_position == stp->step_target) {
+        _stp_ramp_finish(stp);
+        return 0;
+    }
+
+    // the stepper task queues the CHOPCONF write, the pulses run on. The
+    // next one is already timed for the new resolution.
+    uint8_t k = _stp_mres_next(stp);
+    if (k) {
+        period = period * k / stp->mres_k;
+        stp->step_period = period;
+        stp->mres_pending = k;
+        __atomic_store_n(&stp->mres_state, STP_MRES_ASK, __ATOMIC_RELEASE);
+        _stp_notify(stp, STP_NOTIFY_MRES);
+    }
+
+    _stp_isr_stats_add(&stp->isr_stats, esp_cpu_get_cycle_count() - t_start);
+
+    return period;
+}
+
+// Steps every axis that is due, then aims the alarm at the earliest next step
+static bool IRAM_ATTR _stp_sched_on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_data)
+{
+    stp_sched_t *sched = (stp_sched_t *) user_data;
+    uint64_t due = edata->count_value + STP_SCHED_MERGE_TICKS;
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < sched->count; i++) {
+        tmc2209_io_t *stp = sched->axis[i];
+
+        // the first step of a move the stepper task started
+        if (__atomic_load_n(&stp->step_start_seq, __ATOMIC_ACQUIRE) != stp->step_start_taken) {
+            stp->step_start_taken = stp->step_start_seq;
+            stp->step_deadline = stp->step_start;
+            stp->step_active = 1;
+        }
+
+        if (!stp->step_active)
+            continue;
+
+        if (stp->step_deadline <= due) {
+            uint32_t period = _stp_isr_step(stp);
+            if (period == 0) {
+                stp->step_active = 0;
+                continue;
+            }
+            stp->step_deadline += period;
+        }
+
+        if (stp->step_deadline < next)
+            next = stp->step_deadline;
+    }
+
+    // a deadline we are already past fires right away
+    if (next != UINT64_MAX) {
+        gptimer_alarm_config_t alarm = {
+            .alarm_count = next,
+        };
+        gptimer_set_alarm_action(timer, &alarm);
+    }
+
+    // A start posted after we looked had its alarm overwritten just now,
+    // take it in the next interrupt. One posted after this check aims the
+    // alarm itself.
+    for (int i = 0; i < sched->count; i++) {
+        tmc2209_io_t *stp = sched->axis[i];
+        if (__atomic_load_n(&stp->step_start_seq, __ATOMIC_ACQUIRE) != stp->step_start_taken) {
+            gptimer_alarm_config_t alarm = {
+                .alarm_count = edata->count_value,
+            };
+            gptimer_set_alarm_action(timer, &alarm);
+            break;
+        }
+    }
+
+    return false;
+}
+
+static void _stp_isr_init(tmc2209_io_t *stp)
+{
+    // gpio 32 and up sit in the second output register
+    if (stp->step < 32) {
+        stp->step_set_reg = &GPIO.out_w1ts;
+        stp->step_clr_reg = &GPIO.out_w1tc;
+        stp->step_mask = 1UL << stp->step;
+    }
+    else {
+        stp->step_set_reg = &GPIO.out1_w1ts.val;
+        stp->step_clr_reg = &GPIO.out1_w1tc.val;
+        stp->step_mask = 1UL << (stp->step - 32);
+    }
+    stp->step_active = 0;
+
+    // the first axis sets up the timer for all of them
+    if (_stp_sched.gptimer != NULL)
+        return;
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = STP_TIMER_HZ, // 40MHz, 1 tick=25ns
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &_stp_sched.gptimer));
+
+    gptimer_event_callbacks_t cbs = {
+        .on_alarm = _stp_sched_on_alarm,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(_stp_sched.gptimer, &cbs, &_stp_sched));
+
+    // runs free from here, 64 bits at 40MHz never wrap
+    ESP_ERROR_CHECK(gptimer_enable(_stp_sched.gptimer));
+    ESP_ERROR_CHECK(gptimer_start(_stp_sched.gptimer));
+}
+
+// The isr owns the deadlines, a start goes to it like a command: posted
+// through a sequence number, then the alarm fires right away so the isr
+// takes it and aims at the earliest step again.
+static void _stp_isr_start(tmc2209_io_t *stp)
+{
+    stp_sched_t *sched = &_stp_sched;
+    uint64_t now = 0;
+
+    // first step follows after one period, the axis stopped so the isr
+    // is done with the last start
+    gptimer_get_raw_count(sched->gptimer, &now);
+    stp->step_start = now + stp->step_period;
+    __atomic_store_n(&stp->step_start_seq, stp->step_start_seq + 1, __ATOMIC_RELEASE);
+
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = now,
+    };
+    gptimer_set_alarm_action(sched->gptimer, &alarm);
+}
+
+static int32_t _stp_status_get_position(tmc2209_io_t *stp)
+{
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    return status.position;
+}
+
+const stp_backend_t stp_backend_isr = {
+    .name = "isr",
+    .init = _stp_isr_init,
+    .start = _stp_isr_start,
+    .get_position = _stp_status_get_position,
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// RMT backend: the step train is streamed from the RMT peripheral and counted
+// back by PCNT, the cpu only refills half of the RMT memory per interrupt
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_RMT_MEM_SYMBOLS 64
+#define STP_RMT_CHUNK       (STP_RMT_MEM_SYMBOLS / 2)
+#define STP_RMT_DUR_MAX     0x7FFF
+
+// a symbol half holds 15 bits, 1MHz keeps the slowest ramps in it
+#define STP_RMT_HZ          1000000
+#define STP_RMT_DIV         (STP_TIMER_HZ / STP_RMT_HZ)
+#define STP_PCNT_LIMIT      10000
+
+typedef struct {
+    rmt_encoder_t base;
+    rmt_encoder_handle_t copy_encoder;
+    tmc2209_io_t *stp;
+    rmt_symbol_word_t chunk[STP_RMT_CHUNK];
+    size_t chunk_len;
+} stp_rmt_encoder_t;
+
+static size_t IRAM_ATTR _stp_rmt_fill(stp_rmt_encoder_t *enc)
+{
+    size_t len = 0;
+
+    while (len < STP_RMT_CHUNK) {
+        tmc2209_io_t *stp = enc->stp;
+        uint32_t ticks = _stp_ramp_next(stp);
+        if (ticks == 0)
+            break;
+
+        // down to rmt ticks, what doesn't fit a whole one goes with the next step
+        stp->rmt_frac += ticks;
+        uint32_t period = stp->rmt_frac / STP_RMT_DIV;
+        stp->rmt_frac -= period * STP_RMT_DIV;
+
+        // only matters below ~1 rpm
+        if (period > STP_RMT_DUR_MAX)
+            period = STP_RMT_DUR_MAX;
+
+        enc->chunk[len].level0 = 1;
+        enc->chunk[len].duration0 = stp->rmt_pulse_ticks;
+        enc->chunk[len].level1 = 0;
+        enc->chunk[len].duration1 = period - stp->rmt_pulse_ticks;
+        len++;
+    }
+
+    return len;
+}
+
+static size_t IRAM_ATTR _stp_rmt_encode(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *primary_data, size_t data_size, rmt_encode_state_t *ret_state)
+{
+    stp_rmt_encoder_t *enc = __containerof(encoder, stp_rmt_encoder_t, base);
+    uint32_t t_start = esp_cpu_get_cycle_count();
+    rmt_encode_state_t session_state = RMT_ENCODING_RESET;
+    int state = RMT_ENCODING_RESET;
+    size_t encoded = 0;
+
+    while (1) {
+        // generate the next steps once the previous chunk is copied out
+        if (enc->chunk_len == 0) {
+            enc->chunk_len = _stp_rmt_fill(enc);
+            if (enc->chunk_len == 0) {
+                state |= RMT_ENCODING_COMPLETE;
+                break;
+            }
+        }
+
+        encoded += enc->copy_encoder->encode(enc->copy_encoder, channel, enc->chunk, enc->chunk_len * sizeof(rmt_symbol_word_t), &session_state);
+        if (session_state & RMT_ENCODING_COMPLETE)
+            enc->chunk_len = 0;
+
+        // rmt memory full, continue on the next refill interrupt
+        if (session_state & RMT_ENCODING_MEM_FULL) {
+            state |= RMT_ENCODING_MEM_FULL;
+            break;
+        }
+    }
+
+    _stp_isr_stats_add(&enc->stp->isr_stats, esp_cpu_get_cycle_count() - t_start);
+
+    *ret_state = (rmt_encode_state_t)state;
+    return encoded;
+}
+
+static esp_err_t _stp_rmt_reset(rmt_encoder_t *encoder)
+{
+    stp_rmt_encoder_t *enc = __containerof(encoder, stp_rmt_encoder_t, base);
+    enc->chunk_len = 0;
+    return rmt_encoder_reset(enc->copy_encoder);
+}
+
+static esp_err_t _stp_rmt_del(rmt_encoder_t *encoder)
+{
+    stp_rmt_encoder_t *enc = __containerof(encoder, stp_rmt_encoder_t, base);
+    rmt_del_encoder(enc->copy_encoder);
+    free(enc);
+    return ESP_OK;
+}
+
+static int32_t IRAM_ATTR _stp_rmt_get_position(tmc2209_io_t *stp)
+{
+    int count = 0;
+    pcnt_unit_get_count(stp->pcnt_unit, &count);
+
+    if (stp->dir_set == 0)
+        return stp->move_start + count;
+    else
+        return stp->move_start - count;
+}
+
+static bool IRAM_ATTR _stp_rmt_done_cb(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *user_ctx)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) user_ctx;
+
+    stp->step_position = _stp_rmt_get_position(stp);
+    _stp_ramp_finish(stp);
+
+    return false;
+}
+
+static void _stp_rmt_init(tmc2209_io_t *stp)
+{
+    // high time rounded up to whole rmt ticks
+    stp->rmt_pulse_ticks = ((uint64_t)stp->step_pulse_ns * STP_RMT_HZ + 999999999) / 1000000000;
+    if (stp->rmt_pulse_ticks == 0)
+        stp->rmt_pulse_ticks = 1;
+
+    // step output
+    rmt_tx_channel_config_t tx_config = {
+        .gpio_num = stp->step,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = STP_RMT_HZ,
+        .mem_block_symbols = STP_RMT_MEM_SYMBOLS,
+        .trans_queue_depth = 1,
+        .flags.io_loop_back = 1,
+    };
+    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_config, &stp->rmt_chan));
+
+    rmt_tx_event_callbacks_t cbs = {
+        .on_trans_done = _stp_rmt_done_cb,
+    };
+    ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(stp->rmt_chan, &cbs, stp));
+
+    // encoder that pulls steps from the ramp generator
+    stp_rmt_encoder_t *enc = calloc(1, sizeof(stp_rmt_encoder_t));
+    assert(enc);
+    enc->base.encode = _stp_rmt_encode;
+    enc->base.reset = _stp_rmt_reset;
+    enc->base.del = _stp_rmt_del;
+    enc->stp = stp;
+    rmt_copy_encoder_config_t copy_config = {};
+    ESP_ERROR_CHECK(rmt_new_copy_encoder(&copy_config, &enc->copy_encoder));
+    stp->rmt_enc = &enc->base;
+
+    ESP_ERROR_CHECK(rmt_enable(stp->rmt_chan));
+
+    // count the pulses back from the same pin
+    pcnt_unit_config_t unit_config = {
+        .low_limit = -STP_PCNT_LIMIT,
+        .high_limit = STP_PCNT_LIMIT,
+        .flags.accum_count = 1,
+    };
+    ESP_ERROR_CHECK(pcnt_new_unit(&unit_config, &stp->pcnt_unit));
+
+    pcnt_chan_config_t chan_config = {
+        .edge_gpio_num = stp->step,
+        .level_gpio_num = -1,
+        .flags.io_loop_back = 1,
+    };
+    pcnt_channel_handle_t pcnt_chan = NULL;
+    ESP_ERROR_CHECK(pcnt_new_channel(stp->pcnt_unit, &chan_config, &pcnt_chan));
+    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD));
+
+    // overflow at the limit is accumulated by the driver
+    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(stp->pcnt_unit, STP_PCNT_LIMIT));
+    ESP_ERROR_CHECK(pcnt_unit_enable(stp->pcnt_unit));
+    ESP_ERROR_CHECK(pcnt_unit_start(stp->pcnt_unit));
+}
+
+static void _stp_rmt_start(tmc2209_io_t *stp)
+{
+    rmt_transmit_config_t tx_config = {
+        .loop_count = 0,
+    };
+
+    pcnt_unit_clear_count(stp->pcnt_unit);
+    stp->move_start = stp->step_position;
+    stp->rmt_frac = 0;
+
+    // the payload is not used, steps come from the ramp generator
+    rmt_transmit(stp->rmt_chan, stp->rmt_enc, stp, sizeof(tmc2209_io_t), &tx_config);
+}
+
+static int32_t _stp_rmt_get_position_task(tmc2209_io_t *stp)
+{
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+
+    // not moving, pcnt was already folded into the position
+    if (status.state == STP_RAMP_IDLE)
+        return status.position;
+
+    return _stp_rmt_get_position(stp);
+}
+
+const stp_backend_t stp_backend_rmt = {
+    .name = "rmt",
+    .init = _stp_rmt_init,
+    .start = _stp_rmt_start,
+    .get_position = _stp_rmt_get_position_task,
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// VACTUAL backend: the TMC2209 generates the steps itself from a velocity
+// streamed over uart. The position is integrated from the commanded velocity
+// and trimmed with MSCNT once the motor stands still. MSCNT only tells the
+// angle within an electrical period, every trimmed move measures the driver
+// clock to keep the drift of the next one inside half of it.
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_VACTUAL_PERIOD_US   10000
+#define STP_VACTUAL_MIN_US      500
+
+// VACTUAL counts in fCLK / 2^24 microsteps per second, internal 12 MHz clock
+#define STP_VACTUAL_FCLK        12000000
+#define STP_VACTUAL_MASK        0xFFFFFF
+
+// the internal clock is off by up to this until measured, in ppm, and never
+// known better than the minimum over temperature
+#define STP_VACTUAL_TOL_PPM     30000
+#define STP_VACTUAL_TOL_MIN_PPM 500
+
+// MSCNT walks 1024 counts per electrical period, 256 per full step
+#define STP_MSCNT_PERIOD        1024
+#define STP_MSCNT_PER_STEP      (256 / MICROSTEPS)
+
+// moves over a few electrical periods measure the clock, in shorter ones
+// the update timing is most of the error
+#define STP_VACTUAL_CAL_STEPS   (4 * STP_MSCNT_PERIOD / STP_MSCNT_PER_STEP)
+
+static void _stp_vactual_set(tmc2209_io_t *stp, uint32_t velocity)
+{
+    // direction comes from the sign
+    int32_t vactual = ((uint64_t)velocity << 24) / stp->vactual_fclk;
+    if (stp->dir_set ^ stp->dir_invert)
+        vactual = -vactual;
+
+    // write only register, queued without read back so the ramp never waits on it
+    stepper_write_reg_async(stp, TMC_REG_VACTUAL, (uint32_t)vactual & STP_VACTUAL_MASK, NULL, NULL);
+}
+
+// The integrated position drifts with the driver clock and the rounding of
+// the update times, MSCNT tells where in the electrical period we really
+// are. A move too long for the clock we know could have drifted past half a
+// period and can't be told apart from its alias, it is lost.
+static void _stp_vactual_correct(tmc2209_io_t *stp)
+{
+    // positive VACTUAL counts MSCNT up
+    int32_t moved = stp->ramp_position - stp->move_start;
+    if (stp->dir_invert)
+        moved = -moved;
+
+    uint64_t counts = (uint64_t)abs(moved) * STP_MSCNT_PER_STEP;
+    uint64_t drift = counts * stp->vactual_tol / 1000000 + STP_MSCNT_PER_STEP / 2;
+    if (drift >= STP_MSCNT_PERIOD / 2) {
+        ESP_LOGI("SYS", "vactual: %d steps may have drifted %d counts, position lost", (int)moved, (int)drift);
+        stp->vactual_lost = 1;
+        return;
+    }
+
+    if (!stp->vactual_ok || stp->vactual_busy != 2)
+        return;
+
+    int32_t error = ((int32_t)stp->vactual_mscnt_end - (int32_t)stp->vactual_mscnt - moved * STP_MSCNT_PER_STEP) % STP_MSCNT_PERIOD;
+    if (error >= STP_MSCNT_PERIOD / 2)
+        error -= STP_MSCNT_PERIOD;
+    else if (error < -STP_MSCNT_PERIOD / 2)
+        error += STP_MSCNT_PERIOD;
+
+    // the driver ran error counts more than we asked for, its clock is that
+    // much faster than the one we set VACTUAL with
+    if (abs(moved) >= STP_VACTUAL_CAL_STEPS) {
+        int64_t expect = (int64_t)moved * STP_MSCNT_PER_STEP;
+        uint32_t fclk = (int64_t)stp->vactual_fclk * (expect + error) / expect;
+        if (fclk > STP_VACTUAL_FCLK - STP_VACTUAL_FCLK / 10 && fclk < STP_VACTUAL_FCLK + STP_VACTUAL_FCLK / 10) {
+            stp->vactual_fclk = fclk;
+            stp->vactual_tol = 1000000 / abs(moved);
+            if (stp->vactual_tol < STP_VACTUAL_TOL_MIN_PPM)
+                stp->vactual_tol = STP_VACTUAL_TOL_MIN_PPM;
+        }
+    }
+
+    // round to whole steps
+    int32_t steps = (error + (error < 0 ? -STP_MSCNT_PER_STEP : STP_MSCNT_PER_STEP) / 2) / STP_MSCNT_PER_STEP;
+    if (stp->dir_invert)
+        steps = -steps;
+
+    stp->ramp_position += steps;
+    stp->step_position = stp->ramp_position;
+
+    ESP_LOGI("SYS", "vactual: integrated %d steps, mscnt corrected by %d, clock %d Hz", (int)moved, (int)steps, (int)stp->vactual_fclk);
+}
+
+static void _stp_vactual_start_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    stp->vactual_mscnt = trans->data;
+    stp->vactual_ok = (trans->ret == 0);
+}
+
+static void _stp_vactual_stop_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    stp->vactual_mscnt_end = trans->data;
+    stp->vactual_ok &= (trans->ret == 0);
+    stp->vactual_busy = 2;
+    _stp_notify(stp, STP_NOTIFY_VACTUAL);
+}
+
+static void _stp_vactual_timer_cb(void *arg)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) arg;
+    _stp_notify(stp, STP_NOTIFY_VACTUAL);
+}
+
+// runs from the stepper task on every timer tick of a move
+static void _stp_vactual_update(tmc2209_io_t *stp)
+{
+    // stopped, the move ends once we know where
+    if (stp->vactual_busy == 1)
+        return;
+    if (stp->vactual_busy == 2) {
+        _stp_vactual_correct(stp);
+        stp->vactual_busy = 0;
+        _stp_ramp_finish(stp);
+        return;
+    }
+
+    // the driver ran at the last velocity since the previous update
+    int64_t now = esp_timer_get_time();
+    stp->vactual_acc += (uint64_t)stp->duty_set * (now - stp->vactual_time);
+    stp->vactual_time = now;
+
+    // walk the ramp generator over the steps it made
+    uint32_t period = 1;
+    while (stp->vactual_acc >= 1000000 && period) {
+        stp->vactual_acc -= 1000000;
+        period = _stp_ramp_next(stp);
+        stp->step_position = stp->ramp_position;
+    }
+
+    uint32_t remaining = abs(stp->step_target - stp->ramp_position);
+
+    // there? MSCNT is read behind the stop in the queue
+    if (period == 0 || remaining == 0) {
+        _stp_vactual_set(stp, 0);
+        stp->vactual_busy = 1;
+        if (stepper_read_reg_async(stp, TMC_REG_MSCNT, _stp_vactual_stop_done, stp) != 0) {
+            stp->vactual_busy = 0;
+            _stp_vactual_correct(stp);
+            _stp_ramp_finish(stp);
+        }
+        return;
+    }
+
+    _stp_vactual_set(stp, stp->duty_set);
+
+    // wake up right at the target when it comes before the next update
+    uint64_t t_left = ((uint64_t)remaining * 1000000 - stp->vactual_acc) / stp->duty_set;
+    if (t_left > STP_VACTUAL_PERIOD_US)
+        t_left = STP_VACTUAL_PERIOD_US;
+    if (t_left < STP_VACTUAL_MIN_US)
+        t_left = STP_VACTUAL_MIN_US;
+    esp_timer_start_once(stp->vactual_timer, t_left);
+}
+
+static void _stp_vactual_init(tmc2209_io_t *stp)
+{
+    stp->vactual_fclk = STP_VACTUAL_FCLK;
+    stp->vactual_tol = STP_VACTUAL_TOL_PPM;
+    stp->vactual_busy = 0;
+    stp->vactual_lost = 0;
+
+    // the step input stays unused while VACTUAL is not 0
+    _stp_vactual_set(stp, 0);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = _stp_vactual_timer_cb,
+        .arg = stp,
+        .name = "stp_vactual",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &stp->vactual_timer));
+}
+
+static void _stp_vactual_start(tmc2209_io_t *stp)
+{
+    gpio_set_level(stp->dir, 0);
+
+    // electrical angle to check the integrated position against, read
+    // ahead of the first velocity in the queue
+    stp->vactual_ok = 0;
+    stp->vactual_lost = 0;
+    stepper_read_reg_async(stp, TMC_REG_MSCNT, _stp_vactual_start_done, stp);
+    stp->move_start = stp->step_position;
+
+    stp->vactual_acc = 0;
+    stp->vactual_time = esp_timer_get_time();
+    _stp_vactual_set(stp, stp->duty_set);
+
+    esp_timer_start_once(stp->vactual_timer, STP_VACTUAL_PERIOD_US);
+}
+
+const stp_backend_t stp_backend_vactual = {
+    .name = "vactual",
+    .init = _stp_vactual_init,
+    .start = _stp_vactual_start,
+    .get_position = _stp_status_get_position,
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Register shadow
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_REG_BIT(map, reg)   ((map)[(reg) / 32] & (1UL << ((reg) % 32)))
+#define STP_REG_SET(map, reg)   ((map)[(reg) / 32] |= (1UL << ((reg) % 32)))
+#define STP_REG_CLR(map, reg)   ((map)[(reg) / 32] &= ~(1UL << ((reg) % 32)))
+
+// power on values of the write only registers, they can't be read back
+static const struct {
+    uint8_t reg;
+    uint32_t value;
+} _stp_reg_defaults[] = {
+    {TMC_REG_IHOLD_IRUN, 0x00011F10},
+    {TMC_REG_TPOWERDOWN, 0x00000014},
+    {TMC_REG_TPWMTHRS, 0x00000000},
+    {TMC_REG_TCOOLTHRS, 0x00000000},
+    {TMC_REG_VACTUAL, 0x00000000},
+    {TMC_REG_SGTHRS, 0x00000000},
+    {TMC_REG_COOLCONF, 0x00000000},
+};
+
+// status registers change on their own
+static uint8_t _stp_reg_cacheable(uint8_t reg)
+{
+    switch (reg) {
+    case TMC_REG_GSTAT:
+    case TMC_REG_IFCNT:
+    case TMC_REG_IOIN:
+    case TMC_REG_TSTEP:
+    case TMC_REG_SG_RESULT:
+    case TMC_REG_MSCNT:
+    case TMC_REG_MSCURACT:
+    case TMC_REG_DRV_STATUS:
+    case TMC_REG_PWM_SCALE:
+    case TMC_REG_PWM_AUTO:
+        return 0;
+    default:
+        return reg < TMC_REG_COUNT;
+    }
+}
+
+static void _stp_reg_init(tmc2209_io_t *stp)
+{
+    stp->reg_lock = xSemaphoreCreateMutex();
+    portMUX_INITIALIZE(&stp->reg_mux);
+    stp->ifcnt_valid = 0;
+
+    // the chip may have kept other values over our reset, never synced
+    for (size_t i = 0; i < sizeof(_stp_reg_defaults) / sizeof(_stp_reg_defaults[0]); i++) {
+        stp->reg_shadow[_stp_reg_defaults[i].reg] = _stp_reg_defaults[i].value;
+        STP_REG_SET(stp->reg_known, _stp_reg_defaults[i].reg);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// rpm_set comes with the profile of dir applied already
+static void _stp_limits(tmc2209_io_t *stp, uint32_t rpm_set, uint8_t dir, stp_plan_limits_t *lim)
+{
+    lim->v_start = STP_RPM_START * STP_STEP_PER_RPM / 60;
+    lim->v_max = rpm_set * STP_STEP_PER_RPM / 60;
+    lim->a_max = stp->accel_max ? stp->accel_max : STP_ACCEL_DEFAULT;
+    lim->j_max = stp->jerk_max ? stp->jerk_max : STP_JERK_DEFAULT;
+
+    if (stp->profile[dir].accel_pct)
+        lim->a_max = (uint64_t)lim->a_max * stp->profile[dir].accel_pct / 100;
+}
+
+static void _stp_event(tmc2209_io_t *stp, stp_event_type_t type)
+{
+    if (stp->on_event == NULL)
+        return;
+
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+
+    stp_event_t event = {
+        .type = type,
+        .position = status.position,
+        .target = status.target,
+        .duration_ms = (esp_timer_get_time() - stp->move_start_us) / 1000,
+        .cs_actual = stp->cs_actual,
+        .cs_irun = stp->cs_irun,
+        .axis = stp->axis,
+        .lost = stp->verify_lost,
+        .sg_min = stp->sg_min,
+        .health = stp->health,
+        .gstat = stp->gstat,
+        .derate_pct = stp->derate,
+    };
+    stp->on_event(&event);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Stall detection: StallGuard4 compares SG_RESULT against SGTHRS on every
+// full step. DIAG raises right away, without it the stepper task polls
+// SG_RESULT in the background.
+/////////////////////////////////////////////////////////////////////////////
+
+// SG_RESULT only means something at a steady speed
+#define STP_STALL_BLANK_US      100000
+#define STP_STALL_POLL_TICKS    1
+
+static void IRAM_ATTR _stp_diag_isr(void *arg)
+{
+    _stp_notify((tmc2209_io_t *)arg, STP_NOTIFY_STALL);
+}
+
+static void _stp_stall_init(tmc2209_io_t *stp)
+{
+    stp->stall_guard = 0;
+    if (stp->sg_threshold == 0)
+        stp->sg_threshold = STP_SGTHRS_DEFAULT;
+
+    if (stp->diag == 0)
+        return;
+
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_POSEDGE,
+        .mode = GPIO_MODE_INPUT,
+        .pin_bit_mask = 1ULL << stp->diag,
+    };
+    gpio_config(&io_conf);
+
+    // fails harmlessly when someone else installed it already
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(stp->diag, _stp_diag_isr, stp);
+}
+
+static void _stp_stall_guard(tmc2209_io_t *stp, uint8_t on)
+{
+    if (on == stp->stall_guard)
+        return;
+    stp->stall_guard = on;
+
+    // The stall output only works between TCOOLTHRS and TPWMTHRS, open it
+    // up over the whole speed range for the move, in StealthChop only. Both
+    // are write only and come from the shadow, the writes go out in the
+    // background ahead of the first step the blanking time ignores.
+    if (on) {
+        stepper_read_reg(stp, TMC_REG_TCOOLTHRS, &stp->stall_tcoolthrs);
+        stepper_read_reg(stp, TMC_REG_TPWMTHRS, &stp->stall_tpwmthrs);
+        stepper_write_reg_async(stp, TMC_REG_SGTHRS, stp->sg_threshold, NULL, NULL);
+        stepper_write_reg_async(stp, TMC_REG_TCOOLTHRS, STP_TCOOLTHRS_MAX, NULL, NULL);
+        stepper_write_reg_async(stp, TMC_REG_TPWMTHRS, 0, NULL, NULL);
+    }
+    else {
+        // not queued, the driver keeps the homing thresholds and the shadow
+        // says so. Stays on, the next move without it restores them.
+        if (stepper_write_reg_async(stp, TMC_REG_TCOOLTHRS, stp->stall_tcoolthrs, NULL, NULL) != 0
+            || stepper_write_reg_async(stp, TMC_REG_TPWMTHRS, stp->stall_tpwmthrs, NULL, NULL) != 0)
+            stp->stall_guard = 1;
+    }
+}
+
+static void _stp_stall_read_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    // a failed read never looks like a stall
+    stp->stall_sg = trans->ret == 0 ? trans->data : UINT32_MAX;
+    stp->stall_busy = 2;
+    _stp_notify(stp, STP_NOTIFY_STALL);
+}
+
+// SG_RESULT of the last read, UINT32_MAX while there is none of this move
+static uint32_t _stp_stall_sg(tmc2209_io_t *stp)
+{
+    uint32_t sg = UINT32_MAX;
+
+    // taken before the blanking time ended, maybe in the last move
+    if (stp->stall_busy == 2) {
+        if (stp->stall_time - stp->move_start_us >= STP_STALL_BLANK_US)
+            sg = stp->stall_sg;
+        stp->stall_busy = 0;
+    }
+
+    if (stp->stall_busy)
+        return sg;
+
+    stp->stall_time = esp_timer_get_time();
+    stp->stall_busy = 1;
+    if (stepper_read_reg_async(stp, TMC_REG_SG_RESULT, _stp_stall_read_done, stp) != 0)
+        stp->stall_busy = 0;
+    return sg;
+}
+
+static void _stp_stall_check(tmc2209_io_t *stp, const stp_status_t *status)
+{
+    if (!stp->stall_guard)
+        return;
+
+    if (status->state != STP_RAMP_CRUISE || esp_timer_get_time() - stp->move_start_us < STP_STALL_BLANK_US)
+        return;
+
+    uint32_t sg = 0;
+    if (stp->diag) {
+        if (!gpio_get_level(stp->diag))
+            return;
+    }
+    else {
+        sg = _stp_stall_sg(stp);
+        if (sg > 2 * stp->sg_threshold)
+            return;
+    }
+
+    ESP_LOGI("SYS", "Stall at %d, SG_RESULT %d", (int)status->position, (int)sg);
+
+    // a stall wins over anything the api queued
+    stp_cmd_t cmd = {
+        .type = STP_CMD_HALT,
+    };
+    _stp_cmd_post(stp, &cmd);
+    _stp_event(stp, STP_EVENT_STALL);
+
+    _stp_stall_guard(stp, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Microstep switching: the isr backend runs STP_MICROSTEPS_COARSE above
+// mres_up, a quarter of the interrupts. The CHOPCONF write is queued while
+// the pulses run on, the driver takes it between the pulse that reached a
+// full step and the next one, which waits for it if it has to. MSCNT stays
+// on the full step grid.
+/////////////////////////////////////////////////////////////////////////////
+
+static int _stp_mres_write(tmc2209_io_t *stp, uint32_t microsteps)
+{
+    uint32_t chopconf;
+    int ret = stepper_read_reg(stp, TMC_REG_CHOPCONF, &chopconf);
+    if (ret != 0)
+        return ret;
+
+    chopconf = (chopconf & ~TMC_CHOPCONF_MRES_MASK) | TMC_CHOPCONF_MRES(microsteps);
+    return stepper_write_reg(stp, TMC_REG_CHOPCONF, chopconf);
+}
+
+static void _stp_mres_init(tmc2209_io_t *stp)
+{
+    stp->mres_k = 1;
+    stp->mres_on = 0;
+    stp->mres_state = STP_MRES_IDLE;
+    stp->mres_up = stp->mres_rpm * STP_STEP_PER_RPM / 60;
+    stp->mres_down = stp->mres_up * 7 / 8;
+
+    if (stp->mres_up == 0)
+        return;
+
+    // take the resolution from the register instead of the pins
+    uint32_t gconf;
+    int ret = stepper_read_reg(stp, TMC_REG_GCONF, &gconf);
+    if (ret == 0)
+        ret = stepper_write_reg(stp, TMC_REG_GCONF, gconf | TMC_GCONF_MSTEP_REG_SELECT);
+    if (ret == 0)
+        ret = _stp_mres_write(stp, MICROSTEPS);
+
+    if (ret != 0) {
+        ESP_LOGI("SYS", "Microstep switching off, no driver");
+        stp->mres_up = 0;
+    }
+}
+
+// Finds the coarse grid for the move about to start
+static void _stp_mres_plan(tmc2209_io_t *stp)
+{
+    stp->mres_on = 0;
+    if (stp->mres_up == 0 || stp->backend != &stp_backend_isr || stp->ramp.v_cruise < stp->mres_up)
+        return;
+
+    // followers count the leader's pulses one by one
+    if (stp->group != NULL)
+        return;
+
+    uint32_t mscnt;
+    if (stepper_read_reg(stp, TMC_REG_MSCNT, &mscnt) != 0 || mscnt % STP_MSCNT_PER_STEP)
+        return;
+
+    // steps since the last full step, MSCNT counts up with the position
+    // unless inverted
+    int32_t a = (mscnt / STP_MSCNT_PER_STEP) % MICROSTEPS;
+    if (stp->dir_invert)
+        stp->mres_align = -a - stp->step_position;
+    else
+        stp->mres_align = a - stp->step_position;
+    stp->mres_on = 1;
+}
+
+static void _stp_mres_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    if (trans->ret != 0)
+        ESP_LOGI("SYS", "Microstep switch to %d failed", MICROSTEPS / stp->mres_pending);
+    __atomic_store_n(&stp->mres_state, trans->ret == 0 ? STP_MRES_OK : STP_MRES_FAIL, __ATOMIC_RELEASE);
+}
+
+// the isr asked for mres_pending or gave up on it
+static void _stp_mres_switch(tmc2209_io_t *stp)
+{
+    uint8_t state = __atomic_load_n(&stp->mres_state, __ATOMIC_ACQUIRE);
+
+    // the position has to be set again, moves wait until the resolution is
+    // known
+    if (state == STP_MRES_LOST) {
+        ESP_LOGI("SYS", "Microstep switch to %d failed, stopped at %d", MICROSTEPS, (int)stp->step_position);
+        stp->verify_valid = 0;
+        stp->verify_lost = 0;
+        __atomic_store_n(&stp->mres_state, STP_MRES_IDLE, __ATOMIC_RELEASE);
+        _stp_event(stp, STP_EVENT_LOST);
+        return;
+    }
+
+    if (state != STP_MRES_ASK)
+        return;
+
+    // CHOPCONF is in the shadow since _stp_mres_init, no round trip
+    uint32_t chopconf;
+    int ret = stepper_read_reg(stp, TMC_REG_CHOPCONF, &chopconf);
+    if (ret == 0) {
+        chopconf = (chopconf & ~TMC_CHOPCONF_MRES_MASK) | TMC_CHOPCONF_MRES(MICROSTEPS / stp->mres_pending);
+        __atomic_store_n(&stp->mres_state, STP_MRES_WRITE, __ATOMIC_RELEASE);
+        ret = stepper_write_reg_async(stp, TMC_REG_CHOPCONF, chopconf, _stp_mres_done, stp);
+    }
+
+    // never queued, the driver didn't change
+    if (ret != 0) {
+        ESP_LOGI("SYS", "Microstep switch to %d not queued", MICROSTEPS / stp->mres_pending);
+        __atomic_store_n(&stp->mres_state, STP_MRES_FAIL, __ATOMIC_RELEASE);
+    }
+}
+
+// moves always start fine
+static void _stp_mres_restore(tmc2209_io_t *stp)
+{
+    if (stp->mres_k == 1)
+        return;
+
+    if (_stp_mres_write(stp, MICROSTEPS) == 0)
+        stp->mres_k = 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Lost step detection: MSCNT counts every pulse the driver took and has to
+// follow the position. It is sampled over uart in the background while
+// moving, the step path never waits on it, and checked exactly once the
+// move ended. DRV_STATUS faults and a low SG_RESULT at cruise mean the motor
+// did not follow the pulses. MSCNT wraps every 4 full steps, pulses lost in
+// whole multiples of that go unseen.
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_VERIFY_MS_DEFAULT   10
+
+// how far MSCNT may be off, in counts, the position is published just
+// before the pulse goes out
+#define STP_VERIFY_SLACK        (2 * STP_MSCNT_PER_STEP)
+
+// adaptive cruise averages SG_RESULT over about this many samples
+#define STP_ADAPT_AVG           4
+
+// MSCNT minus what it should be at position, -512..511
+static int32_t _stp_verify_error(tmc2209_io_t *stp, uint32_t mscnt, int32_t position)
+{
+    // MSCNT counts up with the position unless inverted
+    int32_t counts = position * STP_MSCNT_PER_STEP;
+    if (stp->dir_invert)
+        counts = -counts;
+
+    int32_t error = ((int32_t)mscnt - stp->verify_phase - counts) % STP_MSCNT_PERIOD;
+    if (error >= STP_MSCNT_PERIOD / 2)
+        error -= STP_MSCNT_PERIOD;
+    else if (error < -STP_MSCNT_PERIOD / 2)
+        error += STP_MSCNT_PERIOD;
+
+    return error;
+}
+
+// takes the phase at a position we trust, runs from standstill
+static void _stp_verify_arm(tmc2209_io_t *stp)
+{
+    // the driver steps itself from VACTUAL, it is its own reference
+    if (stp->verify_valid || stp->backend == &stp_backend_vactual)
+        return;
+
+    uint32_t mscnt;
+    if (stepper_read_reg(stp, TMC_REG_MSCNT, &mscnt) != 0)
+        return;
+
+    stp->verify_phase = 0;
+    stp->verify_phase = _stp_verify_error(stp, mscnt, stp->step_position);
+    stp->verify_valid = 1;
+}
+
+static void _stp_verify_lost(tmc2209_io_t *stp, int32_t lost)
+{
+    // nothing to compare against until the position is set again
+    stp->verify_valid = 0;
+    stp->verify_lost = lost;
+
+    // a follower of a group stops with its leader
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_IDLE) {
+        stp_cmd_t cmd = {
+            .type = STP_CMD_HALT,
+        };
+        _stp_cmd_post(stp->group ? stp->group->leader : stp, &cmd);
+    }
+
+    _stp_event(stp, STP_EVENT_LOST);
+}
+
+// Checks a sample against every position it might have been taken at.
+// Returns 0 when it fits, the error in counts otherwise.
+static int32_t _stp_verify_window(tmc2209_io_t *stp, uint32_t mscnt, int32_t p0, int32_t p1)
+{
+    int32_t e0 = _stp_verify_error(stp, mscnt, p0);
+    int32_t e1 = e0 - (p1 - p0) * STP_MSCNT_PER_STEP * (stp->dir_invert ? -1 : 1);
+
+    // too wide to tell apart from a wrap of MSCNT
+    if (abs(e1 - e0) + 2 * STP_VERIFY_SLACK >= STP_MSCNT_PERIOD / 2)
+        return 0;
+
+    int32_t lo = e0 < e1 ? e0 : e1;
+    int32_t hi = e0 < e1 ? e1 : e0;
+    if (lo > STP_VERIFY_SLACK)
+        return lo;
+    if (hi < -STP_VERIFY_SLACK)
+        return hi;
+    return 0;
+}
+
+static void _stp_verify_read_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    if (trans->ret != 0)
+        stp->verify_ret = trans->ret;
+
+    switch (trans->reg) {
+    case TMC_REG_MSCNT:
+        stp->verify_mscnt = trans->data;
+        stp->verify_pos[1] = stepper_get_position(stp);
+        break;
+    case TMC_REG_DRV_STATUS:
+        stp->verify_drv_status = trans->data;
+        break;
+    default:
+        // the last of the sample
+        stp->verify_sg = trans->data;
+        stp->verify_busy = 2;
+        _stp_notify(stp, STP_NOTIFY_VERIFY);
+        break;
+    }
+}
+
+// queues the next sample of a move once it is due
+static void _stp_verify_poll(tmc2209_io_t *stp)
+{
+    int64_t now = esp_timer_get_time();
+    if (!stp->verify_valid || stp->verify_busy || now - stp->verify_time < (int64_t)stp->verify_ms * 1000)
+        return;
+
+    stp_uart_trans_t trans[3] = {
+        {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_MSCNT, .done = _stp_verify_read_done, .arg = stp},
+        {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_DRV_STATUS, .done = _stp_verify_read_done, .arg = stp},
+        {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_SG_RESULT, .done = _stp_verify_read_done, .arg = stp},
+    };
+
+    stp->verify_time = now;
+    stp->verify_ret = 0;
+    stp->verify_pos[0] = stepper_get_position(stp);
+    stp->verify_busy = 1;
+    if (stp_uart_submit(stp->bus, trans, 3) != 0)
+        stp->verify_busy = 0;
+}
+
+// CoolStep settles during the cruise, the last background DRV_STATUS of it
+// is what STP_EVENT_DECEL reports, with the IRUN it scaled down from
+static void _stp_cs_sample(tmc2209_io_t *stp, uint32_t drv_status)
+{
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_CRUISE)
+        return;
+
+    uint32_t ihold_irun;
+    if (stepper_read_reg(stp, TMC_REG_IHOLD_IRUN, &ihold_irun) != 0)
+        return;
+    stp->cs_actual = TMC_DRV_STATUS_CS_ACTUAL(drv_status);
+    stp->cs_irun = TMC_IHOLD_IRUN_IRUN(ihold_irun);
+}
+
+// the sample of a move came back
+static void _stp_verify_sample(tmc2209_io_t *stp)
+{
+    if (stp->verify_busy != 2)
+        return;
+    stp->verify_busy = 0;
+    if (stp->verify_ret != 0)
+        return;
+    _stp_cs_sample(stp, stp->verify_drv_status);
+    if (!stp->verify_valid)
+        return;
+
+    if (stp->verify_drv_status & TMC_DRV_STATUS_FAULT) {
+        ESP_LOGI("SYS", "Driver fault at %d, DRV_STATUS %08x", (int)stp->verify_pos[0], (unsigned int)stp->verify_drv_status);
+        _stp_verify_lost(stp, 0);
+        return;
+    }
+
+    int32_t error = _stp_verify_window(stp, stp->verify_mscnt, stp->verify_pos[0], stp->verify_pos[1]);
+    if (error) {
+        ESP_LOGI("SYS", "Lost steps at %d, MSCNT off by %d", (int)stp->verify_pos[0], (int)error);
+        _stp_verify_lost(stp, error / STP_MSCNT_PER_STEP);
+        return;
+    }
+
+    // SG_RESULT is good at cruise in the CoolStep band, a homing move runs
+    // StealthChop all the way and looks for the stall on its own
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_CRUISE || esp_timer_get_time() - stp->move_start_us < STP_STALL_BLANK_US)
+        return;
+    if (!stp->stall_guard && (stp->sg_rpm_min == 0 || stp->rpm_set < stp->sg_rpm_min || (stp->sg_rpm_max && stp->rpm_set >= stp->sg_rpm_max)))
+        return;
+
+    // the load of the move, 0 stays no reading
+    uint16_t sg = stp->verify_sg ? stp->verify_sg : 1;
+    if (stp->sg_min == 0 || sg < stp->sg_min)
+        stp->sg_min = sg;
+    // and for adaptive cruise, averaged over the last few readings
+    if (stp->adapt_count == 0)
+        stp->adapt_avg = stp->verify_sg;
+    else
+        stp->adapt_avg += ((int32_t)stp->verify_sg - stp->adapt_avg) / STP_ADAPT_AVG;
+    if (stp->adapt_count < UINT16_MAX)
+        stp->adapt_count++;
+
+    if (!stp->stall_guard && stp->sg_lost && stp->verify_sg <= 2 * stp->sg_threshold) {
+        ESP_LOGI("SYS", "Stall at %d, SG_RESULT %d", (int)stp->verify_pos[0], (int)stp->verify_sg);
+        _stp_verify_lost(stp, 0);
+    }
+}
+
+// the move ended, MSCNT has to match exactly
+static void _stp_verify_rest(tmc2209_io_t *stp)
+{
+    // VACTUAL could not tell where it stopped
+    if (stp->vactual_lost) {
+        stp->vactual_lost = 0;
+        _stp_verify_lost(stp, 0);
+        return;
+    }
+
+    uint32_t mscnt;
+    if (!stp->verify_valid || stepper_read_reg(stp, TMC_REG_MSCNT, &mscnt) != 0)
+        return;
+
+    int32_t error = _stp_verify_error(stp, mscnt, stp->step_position);
+    if (abs(error) >= STP_MSCNT_PER_STEP / 2) {
+        ESP_LOGI("SYS", "Lost steps, stopped at %d with MSCNT off by %d", (int)stp->step_position, (int)error);
+        _stp_verify_lost(stp, error / STP_MSCNT_PER_STEP);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Direction profiles: a blind lifts its fabric one way and lets it down the
+// other. Each direction scales the speed and acceleration and can have its
+// own run current.
+/////////////////////////////////////////////////////////////////////////////
+
+static uint32_t _stp_profile_rpm(tmc2209_io_t *stp, uint8_t dir, uint32_t rpm_set)
+{
+    if (stp->profile[dir].speed_pct == 0)
+        return rpm_set;
+
+    uint32_t rpm = rpm_set * stp->profile[dir].speed_pct / 100;
+    if (rpm > STP_RPM_MAX)
+        rpm = STP_RPM_MAX;
+    return rpm ? rpm : 1;
+}
+
+// the warmest driver of the axes moving together sets the pace
+static uint32_t _stp_derate_rpm(tmc2209_io_t *stp, stp_group_t *grp, uint32_t rpm_set)
+{
+    uint32_t pct = stp->derate;
+    for (int i = 0; grp != NULL && i < grp->count; i++) {
+        if (grp->axis[i]->derate < pct)
+            pct = grp->axis[i]->derate;
+    }
+    if (pct >= 100)
+        return rpm_set;
+
+    uint32_t rpm = rpm_set * pct / 100;
+    return rpm ? rpm : 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Current schedule: IRUN follows the phase of the move, boosted while the
+// motor speeds up or brakes and lower at cruise. One async write per
+// change, the moves never wait on the uart.
+/////////////////////////////////////////////////////////////////////////////
+
+// IRUN for the phase state of the move in dir_set
+static void _stp_current(tmc2209_io_t *stp, uint8_t state)
+{
+    uint32_t ihold_irun;
+    if (stepper_read_reg(stp, TMC_REG_IHOLD_IRUN, &ihold_irun) != 0)
+        return;
+
+    // what the app set up before the first move
+    if (stp->irun_base > 31)
+        stp->irun_base = TMC_IHOLD_IRUN_IRUN(ihold_irun);
+
+    uint32_t irun = stp->profile[stp->dir_set].irun;
+    if (irun == 0)
+        irun = stp->current.run;
+    if (irun == 0)
+        irun = stp->irun_base;
+
+    if (state == STP_RAMP_ACCEL || state == STP_RAMP_DECEL)
+        irun += stp->current.boost;
+    if (irun > 31)
+        irun = 31;
+
+    // less heat while the driver warns, a homing move keeps the torque its
+    // stall threshold was set up with
+    if (stp->derate < 100 && !stp->stall_guard) {
+        irun = irun * stp->derate / 100;
+        if (irun == 0)
+            irun = 1;
+    }
+
+    if (irun == TMC_IHOLD_IRUN_IRUN(ihold_irun))
+        return;
+
+    // the current follows within a round trip
+    ihold_irun = (ihold_irun & ~TMC_IHOLD_IRUN_IRUN_MASK) | ((irun << 8) & TMC_IHOLD_IRUN_IRUN_MASK);
+    stepper_write_reg_async(stp, TMC_REG_IHOLD_IRUN, ihold_irun, NULL, NULL);
+}
+
+// the followers of a group are in the phase of their leader
+static void _stp_current_group(tmc2209_io_t *stp, uint8_t state)
+{
+    _stp_current(stp, state);
+
+    stp_group_t *grp = stp->group;
+    if (grp == NULL || grp->leader != stp)
+        return;
+
+    for (int i = 0; i < grp->count; i++) {
+        tmc2209_io_t *f = grp->axis[i];
+        if (f != stp && f->ramp_state != STP_RAMP_IDLE)
+            _stp_current(f, state);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static void _stp_dir(tmc2209_io_t *stp, int32_t position)
+{
+    // which direction?
+    if (stp->step_position < position)
+        stp->dir_set = 0;
+    else
+        stp->dir_set = 1;
+
+    // set dir
+    if (!stp->dir_invert)
+        gpio_set_level(stp->dir, stp->dir_set);
+    else
+        gpio_set_level(stp->dir, !stp->dir_set);
+}
+
+static void _stp_start(tmc2209_io_t *stp, uint32_t rpm_set, int32_t position, uint8_t stall, stp_group_t *group)
+{
+    stp->move_start_us = esp_timer_get_time();
+    stp->group = group;
+
+    // already there, done right away
+    if (position == stp->step_position) {
+        _stp_event(stp, STP_EVENT_DONE);
+        return;
+    }
+
+    // a failed switch back to fine left the resolution unknown
+    _stp_mres_restore(stp);
+    if (stp->mres_k != 1) {
+        ESP_LOGI("SYS", "Microstep resolution unknown, move to %d refused", (int)position);
+        _stp_event(stp, STP_EVENT_DONE);
+        return;
+    }
+
+    _stp_stall_guard(stp, stall);
+    _stp_verify_arm(stp);
+    stp->sg_min = 0;
+    stp->adapt_count = 0;
+    stp->adapt_time = stp->move_start_us;
+
+    // speed and torque of the direction
+    uint8_t dir = position > stp->step_position ? STP_DIR_FWD : STP_DIR_REV;
+    rpm_set = _stp_profile_rpm(stp, dir, rpm_set);
+
+    // slower while a driver of the move runs warm, homing stays in the
+    // StallGuard4 band
+    uint32_t rpm_full = rpm_set;
+    if (!stall)
+        rpm_set = _stp_derate_rpm(stp, group, rpm_set);
+    stp->rpm_derate = rpm_set < rpm_full ? rpm_set : 0;
+
+    // plan the ramps
+    stp_plan_limits_t lim;
+    _stp_limits(stp, rpm_set, dir, &lim);
+    stp_plan_move(&lim, abs(position - stp->step_position), &stp->plan);
+    _stp_ramp_load(&stp->ramp, &stp->plan);
+
+    // set start variables
+    stp->step_target = position;
+    stp->rpm_set = rpm_set;
+
+    _stp_dir(stp, stp->step_target);
+    _stp_delay_cycles(esp_cpu_get_cycle_count(), stp->dir_setup_cycles);
+
+    // direct start? (low rpm)
+    if (stp->ramp.ticks == 0)
+        stp->ramp_state = STP_RAMP_CRUISE;
+    else
+        stp->ramp_state = STP_RAMP_ACCEL;
+    _stp_current(stp, stp->ramp_state);
+
+    stp->ramp_time = 0;
+    stp->ramp_steps = 0;
+    stp->ramp_position = stp->step_position;
+    stp->duty_set = stp->ramp.v_start;
+    stp->step_period = STP_TIMER_HZ / stp->duty_set;
+    stp->step_frac = 0;
+    _stp_mres_plan(stp);
+    _stp_status_publish(stp);
+
+    _stp_event(stp, STP_EVENT_START);
+
+    // the isr owns the motion state from here
+    stp->backend->start(stp);
+    ESP_LOGI("SYS", "Moving to %d, peak duty %d, planned %d ms", (int)stp->step_target, (int)stp->ramp.v_cruise, (int)stp->plan.duration_ms);
+}
+
+static uint8_t _stp_group_idle(stp_group_t *grp)
+{
+    for (int i = 0; i < grp->count; i++) {
+        stp_status_t status;
+        stepper_get_status(grp->axis[i], &status);
+        if (status.state != STP_RAMP_IDLE)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Runs with every axis of the group standing still
+static void _stp_group_start(stp_group_t *grp, uint32_t rpm_set, const int32_t *position)
+{
+    int lead = -1;
+    uint32_t lead_delta = 0;
+    uint8_t isr = 1;
+
+    // the axis going furthest leads
+    for (int i = 0; i < grp->count; i++) {
+        tmc2209_io_t *stp = grp->axis[i];
+        grp->delta[i] = abs(position[i] - stp->step_position);
+        if (grp->delta[i] > lead_delta) {
+            lead_delta = grp->delta[i];
+            lead = i;
+        }
+        if (stp->backend != &stp_backend_isr)
+            isr = 0;
+    }
+
+    // Only the isr backend can pulse followers along. The others run on their
+    // own at a speed scaled to their distance and arrive about together.
+    if (lead < 0 || !isr) {
+        for (int i = 0; i < grp->count; i++) {
+            uint32_t rpm = lead_delta ? (uint64_t)rpm_set * grp->delta[i] / lead_delta : rpm_set;
+            _stp_start(grp->axis[i], rpm ? rpm : 1, position[i], 0, NULL);
+        }
+        return;
+    }
+
+    grp->leader = grp->axis[lead];
+    grp->lead_delta = lead_delta;
+
+    // the followers run in proportion to the leader's profile
+    tmc2209_io_t *l = grp->leader;
+    uint32_t lead_rpm = _stp_profile_rpm(l, position[lead] > l->step_position ? STP_DIR_FWD : STP_DIR_REV, rpm_set);
+    lead_rpm = _stp_derate_rpm(l, grp, lead_rpm);
+
+    for (int i = 0; i < grp->count; i++) {
+        tmc2209_io_t *f = grp->axis[i];
+        if (i == lead)
+            continue;
+
+        // the group move replaces what the axis had queued
+        stp_cmd_t cmd;
+        uint32_t seq = _stp_cmd_peek(f, &cmd);
+        if (seq != 0)
+            f->cmd_taken = seq;
+
+        if (grp->delta[i] == 0) {
+            _stp_start(f, rpm_set, position[i], 0, NULL);
+            continue;
+        }
+
+        _stp_verify_arm(f);
+        f->sg_min = 0;
+        f->adapt_count = 0;
+
+        // stepped by the leader's isr from here. The Bresenham runs from 0:
+        // the follower steps on the leader pulse that takes it past its
+        // share, the last one comes with the leader's last
+        f->move_start_us = esp_timer_get_time();
+        f->group = grp;
+        f->step_target = position[i];
+        f->rpm_set = (uint64_t)lead_rpm * grp->delta[i] / lead_delta;
+        _stp_dir(f, f->step_target);
+        _stp_current(f, STP_RAMP_ACCEL);
+        f->ramp_position = f->step_position;
+        f->duty_set = 0;
+        f->ramp_state = STP_RAMP_ACCEL;
+        grp->acc[i] = 0;
+        _stp_status_publish(f);
+
+        _stp_event(f, STP_EVENT_START);
+    }
+
+    // the leader's dir setup time covers the followers as well
+    _stp_start(grp->leader, rpm_set, position[lead], 0, grp);
+}
+
+// Turns a move into a retarget of the active one. The new ramp is planned as
+// if the move started from standstill and we are already on the point of it
+// where the velocity matches ours. Left a plain move when the target is behind
+// us or too close to stop for, the isr brakes and the stepper task restarts.
+// rpm_set comes with the profile applied.
+static void _stp_retarget(tmc2209_io_t *stp, const stp_status_t *status, stp_cmd_t *cmd, uint32_t rpm_set)
+{
+    int32_t remaining;
+    if (status->dir == 0)
+        remaining = cmd->target - status->position;
+    else
+        remaining = status->position - cmd->target;
+
+    if (remaining < (int32_t)status->ramp_steps)
+        return;
+
+    // slowing down to a lower cruise speed is not part of the ramp, keep ours
+    stp_plan_limits_t lim;
+    _stp_limits(stp, rpm_set, status->dir, &lim);
+    if (lim.v_max < status->velocity)
+        lim.v_max = status->velocity;
+
+    // the distance we had covered on the new ramp depends on the ramp itself,
+    // start from the current brake distance and refine
+    stp_plan_t plan;
+    uint32_t t = 0;
+    uint32_t s = status->ramp_steps;
+    for (int i = 0; i < 2; i++) {
+        stp_plan_move(&lim, s + remaining, &plan);
+        t = stp_plan_ramp_time(&plan, status->velocity);
+        s = stp_plan_ramp_distance(&plan, t);
+    }
+
+    cmd->type = STP_CMD_RETARGET;
+    _stp_ramp_load(&cmd->ramp, &plan);
+    cmd->ramp_time = STP_US_TO_TICKS(t);
+    cmd->ramp_steps = (s < plan.ramp_steps) ? s : plan.ramp_steps;
+    cmd->ramp_rpm = rpm_set;
+
+    ESP_LOGI("SYS", "Retarget to %d, peak duty %d", (int)cmd->target, (int)plan.v_peak);
+}
+
+// A retarget the isr found out of date, planned again from a fresh status.
+// A new target out of reach of a ramp by now becomes a plain move, the isr
+// brakes and the stepper task restarts. A speed change of the adaptive
+// cruise is dropped, the next samples ask again.
+static void _stp_retarget_replan(tmc2209_io_t *stp)
+{
+    stp_cmd_t cmd;
+    uint32_t seq = _stp_cmd_peek(stp, &cmd);
+    if (seq == 0 || seq != stp->cmd_stale || cmd.type != STP_CMD_RETARGET)
+        return;
+
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    cmd.type = STP_CMD_MOVE;
+    _stp_retarget(stp, &status, &cmd, cmd.ramp_rpm);
+
+    if (cmd.type == STP_CMD_RETARGET || cmd.report) {
+        _stp_cmd_replace(stp, seq, &cmd);
+        return;
+    }
+
+    // taken, unless the isr took a newer command meanwhile
+    uint32_t taken = stp->cmd_taken;
+    if (__atomic_load_n(&stp->cmd_seq, __ATOMIC_ACQUIRE) == seq)
+        __atomic_compare_exchange_n(&stp->cmd_taken, &taken, seq, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Adaptive cruise: SG_RESULT from the lost step samples steers the cruise
+// speed. Below adapt_sg the move slows in proportion as soon as a few
+// readings agree, with headroom left it speeds up a step at a time once the
+// last change had STP_ADAPT_MS to settle.
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_ADAPT_MS            250
+#define STP_ADAPT_SAMPLES       4
+#define STP_ADAPT_UP_PCT        10      // speed added per change
+#define STP_ADAPT_HYST_PCT      25      // headroom over adapt_sg to speed up
+
+// the highest SG_RESULT to hold that still leaves that headroom below the
+// top of its range, a higher adapt_sg would only ever slow down
+#define STP_ADAPT_SG_MAX        (STP_SG_RESULT_MAX * 100 / (100 + STP_ADAPT_HYST_PCT))
+
+static void _stp_adapt_reset(tmc2209_io_t *stp)
 {
-    tmc2209_io_t *stp = (tmc2209_io_t *) user_data;
+    stp->adapt_count = 0;
+    stp->adapt_time = esp_timer_get_time();
+}
 
-    if (stp->step_position != stp->step_target) {
-        gpio_set_level(stp->step, 1);
-        gpio_set_level(stp->step, 0);
-        
-        if (stp->dir_set == 0) {
-            stp->step_position++;
-        }
-        else {
-            stp->step_position--;
-        }
-    }
+// Eases the cruise down to rpm_set on a ramp of its own. Left a plain move
+// when the new ramp doesn't fit in what is left.
+static void _stp_adapt_slow(tmc2209_io_t *stp, const stp_status_t *status, stp_cmd_t *cmd, uint32_t rpm_set)
+{
+    int32_t remaining;
+    if (status->dir == 0)
+        remaining = cmd->target - status->position;
+    else
+        remaining = status->position - cmd->target;
 
-    return false;
+    // only the ramp of the plan is used, long enough to reach the speed
+    stp_plan_limits_t lim;
+    stp_plan_t plan;
+    _stp_limits(stp, rpm_set, status->dir, &lim);
+    stp_plan_move(&lim, status->ramp_steps + remaining, &plan);
+    if (plan.v_peak < lim.v_max || (int32_t)plan.ramp_steps >= remaining)
+        return;
+
+    cmd->type = STP_CMD_SLOW;
+    _stp_ramp_load(&cmd->ramp, &plan);
+    cmd->ramp_time = cmd->ramp.ticks;
+    cmd->ramp_steps = plan.ramp_steps;
 }
 
-static void CalculateSModelLine(uint16_t period[], float len, float fre_max, float fre_min, float flexible)
+// Changes the cruise of the move stp leads to rpm. Returns 0 when it is too
+// close to the target to change, a plain move would brake.
+static uint8_t _stp_adapt_set(tmc2209_io_t *stp, const stp_status_t *status, uint32_t rpm)
 {
-    float deno;
-    float melo;
-    float delt = fre_max - fre_min;
-    float fre = 0;
-    for (int i = 0; i < len; i++)
-    {
-        melo = flexible * (i - len / 2) / (len / 2);
-        deno = 1.0 / (1 + expf(-melo)); // expf is a library function of exponential(e)
-        fre = delt * deno + fre_min;
-        fre /= 60;
-        fre *= STP_STEP_PER_RPM;
-        period[i] = (uint16_t)fre;
+    stp_cmd_t cmd = {
+        .type = STP_CMD_MOVE,
+        .rpm = rpm,
+        .target = status->target,
+    };
+    if (rpm > stp->rpm_set)
+        _stp_retarget(stp, status, &cmd, rpm);
+    else
+        _stp_adapt_slow(stp, status, &cmd, rpm);
+
+    if (cmd.type == STP_CMD_MOVE)
+        return 0;
+
+    stp_group_t *grp = stp->group;
+    int count = grp ? grp->count : 1;
+    for (int i = 0; i < count; i++) {
+        tmc2209_io_t *a = grp ? grp->axis[i] : stp;
+        if (a != stp)
+            a->rpm_set = (uint64_t)rpm * grp->delta[i] / grp->lead_delta;
+        _stp_adapt_reset(a);
     }
+    stp->rpm_set = rpm;
+    _stp_cmd_post(stp, &cmd);
+
+    // speeding up again is a ramp, back to the cruise current on STP_NOTIFY_CRUISE
+    if (cmd.type == STP_CMD_RETARGET)
+        _stp_current_group(stp, STP_RAMP_ACCEL);
+
+    return 1;
 }
 
-static void stepper_handle(tmc2209_io_t *stp)
+// Runs on the axis with the ramp, the most loaded axis of a group paces it
+static void _stp_adapt(tmc2209_io_t *stp)
 {
-    // no movement?
-    if (stp->s_curve_steps == 0)
+    if (stp->adapt_sg == 0 || stp->stall_guard || _stp_cmd_pending(stp))
         return;
 
-    // time to do a step?
-    if (!(stp->tick - xTaskGetTickCount()))
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_CRUISE)
         return;
-    
-    // update timer
-    stp->tick = xTaskGetTickCount();
-    
-    // reached our end position?
-    if (stp->step_position == stp->step_target) {
-        // still active?
-        if (stp->duty_set) {
-            gptimer_stop(stp->gptimer);
-            stp->duty_set = 0;
-            stp->s_curve_steps = 0;
-            stp->s_cruve_index = 0;
-
-            ESP_LOGI("SYS", "Target position reached");
-        }
+
+    stp_group_t *grp = stp->group;
+    int count = grp ? grp->count : 1;
+    uint32_t sg = UINT32_MAX;
+    for (int i = 0; i < count; i++) {
+        tmc2209_io_t *a = grp ? grp->axis[i] : stp;
+        if (a->adapt_count >= STP_ADAPT_SAMPLES && a->adapt_avg < sg)
+            sg = a->adapt_avg;
     }
-    // we are moving
-    else {
-        // what is our position difference?
-        int step_target_offset = abs(stp->step_target - stp->step_position);
-
-        // nearing the end of our movement?
-        if (step_target_offset < (stp->rpm_set * 25)) {
-            // first time since start? Happens for small steps
-            if (stp->duty_set == 0) {
-                stp->duty_set = 800;
-                stp->alarm_config.alarm_count = 1000000 / stp->duty_set;
-                stp->alarm_config.flags.auto_reload_on_alarm = true;
-                gptimer_set_alarm_action(stp->gptimer, &stp->alarm_config);
-                gptimer_start(stp->gptimer);
-                ESP_LOGI("SYS", "Duty set to %d", (int)stp->duty_set);
-            }
+    if (sg == UINT32_MAX)
+        return;
+    uint8_t settled = esp_timer_get_time() - stp->adapt_time >= STP_ADAPT_MS * 1000;
 
-            // we are in an s-curve?
-            if (stp->s_cruve_index) {
-                // do the next step
-                stp->duty_set = stp->s_cruve_arr[stp->s_cruve_index] - 1;
-                stp->alarm_config.alarm_count = 1000000 / stp->duty_set;
-                stp->alarm_config.flags.auto_reload_on_alarm = true;
-                gptimer_set_alarm_action(stp->gptimer, &stp->alarm_config);
-                ESP_LOGI("SYS", "Duty set to %d", (int)stp->duty_set);
-                
-                // decrement
-                stp->s_cruve_index--;
-            }
-        }
-        // Starting movement?
-        else if (stp->s_cruve_index != stp->s_curve_steps)
-        {
-            // first time since start?
-            if (stp->duty_set == 0) {
-                // set dir
-                if (!stp->dir_invert)
-                    gpio_set_level(stp->dir, stp->dir_set);
-                else
-                    gpio_set_level(stp->dir, !stp->dir_set);
-
-                // direct start? (low rpm)
-                if (stp->s_curve_steps == 1) {
-                    stp->duty_set = stp->rpm_set * STP_STEP_PER_RPM / 60;
-                }
-                // not direct start
-                else {
-                    // calculate s cruve
-                    CalculateSModelLine(stp->s_cruve_arr, stp->s_curve_steps + 1, stp->rpm_set, 30, S_CURVE_FLEX);
-
-                    // set duty cycle
-                    stp->duty_set = stp->s_cruve_arr[stp->s_cruve_index] - 1;
-                }
-                
-                // start timer
-                stp->alarm_config.alarm_count = 1000000 / stp->duty_set;
-                stp->alarm_config.flags.auto_reload_on_alarm = true;
-                gptimer_set_alarm_action(stp->gptimer, &stp->alarm_config);
-                gptimer_start(stp->gptimer);
-                ESP_LOGI("SYS", "Duty set to %d", (int)stp->duty_set);
-
-                // increment start curve
-                stp->s_cruve_index++;
-            }       
-            // speeding up
-            else {
-                static uint8_t sub_counter = 0;
-                if (++sub_counter >= 2) {
-                    sub_counter = 0;
-
-                    stp->duty_set = stp->s_cruve_arr[stp->s_cruve_index] - 1;
-                    stp->alarm_config.alarm_count = 1000000 / stp->duty_set;
-                    stp->alarm_config.flags.auto_reload_on_alarm = true;
-                    gptimer_set_alarm_action(stp->gptimer, &stp->alarm_config);
-                    ESP_LOGI("SYS", "Duty set to %d", (int)stp->duty_set);
-
-                    stp->s_cruve_index++;
-                }
-            }
-        }
+    // SG_RESULT is read in the CoolStep band only, stay inside it
+    uint32_t rpm_min = stp->sg_rpm_min > STP_RPM_START ? stp->sg_rpm_min : STP_RPM_START;
+    uint32_t rpm_max = stp->adapt_rpm_max ? stp->adapt_rpm_max : STP_RPM_MAX;
+    if (rpm_max > STP_RPM_MAX)
+        rpm_max = STP_RPM_MAX;
+    if (stp->sg_rpm_max && rpm_max >= stp->sg_rpm_max)
+        rpm_max = stp->sg_rpm_max - 1;
+    if (stp->rpm_derate && rpm_max > stp->rpm_derate)
+        rpm_max = stp->rpm_derate;
+
+    uint32_t adapt_sg = stp->adapt_sg < STP_ADAPT_SG_MAX ? stp->adapt_sg : STP_ADAPT_SG_MAX;
+    uint32_t rpm = stp->rpm_set;
+    if (sg < adapt_sg)
+        rpm = rpm * sg / adapt_sg;
+    else if (settled && sg * 100 > adapt_sg * (100 + STP_ADAPT_HYST_PCT))
+        rpm += (rpm * STP_ADAPT_UP_PCT + 99) / 100;
+
+    if (rpm < rpm_min)
+        rpm = rpm_min;
+    if (rpm > rpm_max)
+        rpm = rpm_max;
+    if (rpm == stp->rpm_set)
+        return;
+
+    uint32_t rpm_was = stp->rpm_set;
+    if (_stp_adapt_set(stp, &status, rpm))
+        ESP_LOGI("SYS", "Adapt at %d: SG_RESULT %d, %d -> %d rpm", (int)status.position, (int)sg, (int)rpm_was, (int)rpm);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Driver health: DRV_STATUS and GSTAT every health_ms in the background,
+// moving or not. The overtemperature pre-warning derates speed and run
+// current until it clears, the app hears about every change.
+/////////////////////////////////////////////////////////////////////////////
+
+#define STP_HEALTH_MS_DEFAULT   1000
+#define STP_DERATE_PCT_DEFAULT  70
+
+static void _stp_health_read_done(const stp_uart_trans_t *trans)
+{
+    tmc2209_io_t *stp = (tmc2209_io_t *) trans->arg;
+
+    if (trans->ret != 0)
+        stp->health_ret = trans->ret;
+
+    if (trans->reg == TMC_REG_DRV_STATUS) {
+        stp->health_drv_status = trans->data;
+        return;
     }
+
+    // the last of the check
+    stp->health_gstat = trans->data;
+    stp->health_busy = 2;
+    _stp_notify(stp, STP_NOTIFY_VERIFY);
 }
 
-void _stp_task(void *param) {
-    tmc2209_io_t *stp = (tmc2209_io_t *)param;
-    while (1) {
-        vTaskDelay(1);
-        stepper_handle(stp);
+// queues the next check once it is due
+static void _stp_health_poll(tmc2209_io_t *stp)
+{
+    int64_t now = esp_timer_get_time();
+    if (stp->health_busy || now - stp->health_time < (int64_t)stp->health_ms * 1000)
+        return;
+
+    stp_uart_trans_t trans[2] = {
+        {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_DRV_STATUS, .done = _stp_health_read_done, .arg = stp},
+        {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_GSTAT, .done = _stp_health_read_done, .arg = stp},
+    };
+
+    stp->health_time = now;
+    stp->health_ret = 0;
+    stp->health_busy = 1;
+    if (stp_uart_submit(stp->bus, trans, 2) != 0)
+        stp->health_busy = 0;
+}
+
+// Eases the move stp is part of down to its derated cruise. Tried again with
+// every check until the move is at cruise and far enough from its target.
+static void _stp_health_slow(tmc2209_io_t *stp)
+{
+    tmc2209_io_t *lead = stp->group ? stp->group->leader : stp;
+
+    stp_status_t status;
+    stepper_get_status(lead, &status);
+    if (status.state == STP_RAMP_IDLE || lead->stall_guard)
+        return;
+
+    // the first warning of the move sets its cap
+    if (lead->rpm_derate == 0) {
+        lead->rpm_derate = lead->rpm_set * stp->derate / 100;
+        if (lead->rpm_derate == 0)
+            lead->rpm_derate = 1;
+    }
+
+    if (status.state != STP_RAMP_CRUISE || lead->rpm_set <= lead->rpm_derate || _stp_cmd_pending(lead))
+        return;
+
+    uint32_t rpm_was = lead->rpm_set;
+    if (_stp_adapt_set(lead, &status, lead->rpm_derate))
+        ESP_LOGI("SYS", "Derate at %d: %d -> %d rpm", (int)status.position, (int)rpm_was, (int)lead->rpm_derate);
+}
+
+// the check came back
+static void _stp_health_sample(tmc2209_io_t *stp)
+{
+    if (stp->health_busy != 2)
+        return;
+    stp->health_busy = 0;
+    if (stp->health_ret != 0)
+        return;
+    _stp_cs_sample(stp, stp->health_drv_status);
+
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+
+    // open load is only a hint while the motor turns, kept from the last move
+    uint32_t drv_status = stp->health_drv_status;
+    uint8_t health = drv_status & (TMC_DRV_STATUS_OTPW | TMC_DRV_STATUS_OT | TMC_DRV_STATUS_SHORT);
+    if (status.state != STP_RAMP_IDLE)
+        health |= drv_status & TMC_DRV_STATUS_OPEN;
+    else
+        health |= stp->health & TMC_DRV_STATUS_OPEN;
+
+    // raised since the last check, cleared to see the next one
+    uint8_t gstat = stp->health_gstat & TMC_GSTAT_ALL;
+    if (gstat)
+        stepper_write_reg_async(stp, TMC_REG_GSTAT, gstat, NULL, NULL);
+
+    uint8_t derate = (health & TMC_DRV_STATUS_OTPW) ? stp->derate_pct : 100;
+    if (derate != stp->derate) {
+        stp->derate = derate;
+        if (derate < 100)
+            ESP_LOGI("SYS", "Overtemperature warning, derated to %d%%", (int)derate);
+        else
+            ESP_LOGI("SYS", "Driver cooled down, full speed from the next move");
+
+        if (status.state != STP_RAMP_IDLE)
+            _stp_current(stp, status.state);
     }
+    if (stp->derate < 100)
+        _stp_health_slow(stp);
+
+    if (health == stp->health && gstat == 0)
+        return;
+
+    ESP_LOGI("SYS", "Driver health: DRV_STATUS %08x, GSTAT %02x", (unsigned int)drv_status, (unsigned int)gstat);
+    stp->health = health;
+    stp->gstat = gstat;
+    _stp_event(stp, STP_EVENT_HEALTH);
+    stp->gstat = 0;
 }
 
-void stepper_init(tmc2209_io_t *stp) {
-    // timer for pulse generation
-    {
-        gptimer_config_t timer_config = {
-            .clk_src = GPTIMER_CLK_SRC_DEFAULT,
-            .direction = GPTIMER_COUNT_UP,
-            .resolution_hz = 1000000, // 1MHz, 1 tick=1us
-        };
-        ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &stp->gptimer));
+static void stepper_handle(tmc2209_io_t *stp, uint32_t bits)
+{
+    if (bits & STP_NOTIFY_VACTUAL)
+        _stp_vactual_update(stp);
 
-        gptimer_event_callbacks_t cbs = {
-            .on_alarm = example_timer_on_alarm_cb_v1,
-        };
-        ESP_ERROR_CHECK(gptimer_register_event_callbacks(stp->gptimer, &cbs, stp));
+    if (bits & STP_NOTIFY_VERIFY) {
+        _stp_health_sample(stp);
+        _stp_verify_sample(stp);
+        _stp_adapt(stp->group ? stp->group->leader : stp);
+    }
+    _stp_health_poll(stp);
 
-        ESP_ERROR_CHECK(gptimer_enable(stp->gptimer));
+    // the pulse after the switch point waits for the new resolution
+    if (bits & STP_NOTIFY_MRES)
+        _stp_mres_switch(stp);
+
+    // a retarget the isr took starts the move to the new target, reported
+    // even when that move is over already
+    if (__atomic_exchange_n(&stp->cmd_started, 0, __ATOMIC_ACQUIRE))
+        _stp_event(stp, STP_EVENT_START);
+
+    if (bits & STP_NOTIFY_CRUISE) {
+        _stp_current_group(stp, STP_RAMP_CRUISE);
+        _stp_event(stp, STP_EVENT_CRUISE);
     }
 
-    // uart for communication
-    {
-        uart_config_t uart_config = {
-            .baud_rate = 115200,
-            .data_bits = UART_DATA_8_BITS,
-            .parity = UART_PARITY_DISABLE,
-            .stop_bits = UART_STOP_BITS_1,
-            .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
+    // CoolStep had the whole cruise to settle, before the braking current
+    if (bits & STP_NOTIFY_DECEL) {
+        _stp_current_group(stp, STP_RAMP_DECEL);
+        _stp_event(stp, STP_EVENT_DECEL);
+    }
+
+    // the backend runs the ramp on its own, new commands go to the isr.
+    // Publishing idle is the last thing the isr does with the motion state.
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_IDLE) {
+        if (bits & STP_NOTIFY_CMD)
+            _stp_retarget_replan(stp);
+        _stp_stall_check(stp, &status);
+        _stp_verify_poll(stp);
+        return;
+    }
+
+    // stall detection ends with the move, a coarse pulse or a halt can end it off the fine resolution
+    _stp_stall_guard(stp, 0);
+    _stp_mres_restore(stp);
+    if (bits & STP_NOTIFY_DONE)
+        _stp_verify_rest(stp);
 
-        // Configure UART parameters
-        uart_param_config(UART_NUM_2, &uart_config);
+    stp_cmd_t cmd;
+    uint32_t seq = _stp_cmd_peek(stp, &cmd);
 
-        // Configure UART parameters
-        uart_param_config(UART_NUM_2, &uart_config);
+    // a group move waits until all of its axes stand still, the task comes
+    // by again when the next one finishes
+    if (seq != 0 && cmd.type == STP_CMD_GROUP && !_stp_group_idle(cmd.group))
+        return;
+
+    if (seq != 0)
+        stp->cmd_taken = seq;
+
+    // a retarget that came after the last step starts from standstill,
+    // a move we braked for continues what the app sees as the same move
+    if (seq != 0 && (cmd.type == STP_CMD_MOVE || cmd.type == STP_CMD_RETARGET))
+        _stp_start(stp, cmd.rpm, cmd.target, cmd.stall, NULL);
+    else if (seq != 0 && cmd.type == STP_CMD_GROUP)
+        _stp_group_start(cmd.group, cmd.rpm, cmd.group_target);
+    else if (bits & STP_NOTIFY_DONE)
+        _stp_event(stp, STP_EVENT_DONE);
+}
+
+void _stp_task(void *param) {
+    stp_sched_t *sched = (stp_sched_t *)param;
+    while (1) {
+        uint32_t bits = 0;
+
+        // without DIAG a guarded move is checked for stalls every tick, a
+        // move samples MSCNT every verify_ms, the health check is due every
+        // health_ms unless in flight
+        TickType_t wait = portMAX_DELAY;
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < sched->count; i++) {
+            tmc2209_io_t *stp = sched->axis[i];
+            TickType_t ticks = portMAX_DELAY;
+            if (stp->stall_guard)
+                ticks = STP_STALL_POLL_TICKS;
+            else if (stp->ramp_state != STP_RAMP_IDLE && stp->verify_valid)
+                ticks = pdMS_TO_TICKS(stp->verify_ms) ? pdMS_TO_TICKS(stp->verify_ms) : 1;
+            if (!stp->health_busy) {
+                int64_t due = stp->health_time + (int64_t)stp->health_ms * 1000 - now;
+                TickType_t health = due > 0 ? pdMS_TO_TICKS(due / 1000) + 1 : 1;
+                if (health < ticks)
+                    ticks = health;
+            }
+            if (ticks < wait)
+                wait = ticks;
+        }
+
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+
+        for (int i = 0; i < sched->count; i++)
+            stepper_handle(sched->axis[i], (bits >> STP_NOTIFY_SHIFT(i)) & STP_NOTIFY_MASK);
+    }
+}
+
+void stepper_init(tmc2209_io_t *stp) {
+    // step timing
+    if (stp->step_pulse_ns == 0)
+        stp->step_pulse_ns = STP_PULSE_NS_DEFAULT;
+    if (stp->dir_setup_ns == 0)
+        stp->dir_setup_ns = STP_DIR_SETUP_NS_DEFAULT;
+    uint32_t cpu_mhz = esp_rom_get_cpu_ticks_per_us();
+    stp->pulse_cycles = (stp->step_pulse_ns * cpu_mhz + 999) / 1000;
+    stp->dir_setup_cycles = (stp->dir_setup_ns * cpu_mhz + 999) / 1000;
 
-        // configure pins
-        uart_set_pin(UART_NUM_2, stp->tx, stp->rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    // one axis of the scheduler, notifications are addressed by it
+    assert(_stp_sched.count < STP_AXES_MAX);
+    stp->axis = _stp_sched.count;
 
-        // install driver
-        uart_driver_install(UART_NUM_2, 512 * 2, 0, 0, NULL, 0);
+    // uart for communication, shared by every driver without a bus of its
+    // own and told apart by addr
+    if (stp->bus == NULL) {
+        static stp_uart_bus_t bus = {
+            .port = UART_NUM_2,
+        };
+        if (bus.queue == NULL) {
+            bus.tx = stp->tx;
+            bus.rx = stp->rx;
+            stp_uart_init(&bus);
+        }
+        stp->bus = &bus;
     }
+    _stp_reg_init(stp);
+    _stp_stall_init(stp);
+    stp->irun_base = 0xFF;
+    if (stp->verify_ms == 0)
+        stp->verify_ms = STP_VERIFY_MS_DEFAULT;
+    stp->verify_valid = 0;
+    stp->verify_busy = 0;
+    if (stp->health_ms == 0)
+        stp->health_ms = STP_HEALTH_MS_DEFAULT;
+    if (stp->derate_pct == 0 || stp->derate_pct > 100)
+        stp->derate_pct = STP_DERATE_PCT_DEFAULT;
+    stp->health_busy = 0;
+    stp->health_time = 0;
+    stp->health = 0;
+    stp->gstat = 0;
+    stp->derate = 100;
+    stp->rpm_derate = 0;
+
+    // settle on a rate the driver answers on, the first verified write
+    // takes IFCNT along with the writes queued ahead of it
+    uint32_t ifcnt = 0;
+    stp_uart_probe(stp->bus, stp->addr, TMC_REG_IFCNT, &ifcnt);
+    ESP_LOGI("SYS", "Driver uart at %d baud", (int)stp->bus->baud_node[stp->addr % STP_UART_NODES]);
+
+    // GSTAT shows our own reset until cleared, the health check reports the rest
+    stepper_write_reg(stp, TMC_REG_GSTAT, TMC_GSTAT_RESET);
+    _stp_mres_init(stp);
 
-    stp->alarm_config.alarm_count = 200;
-    stp->alarm_config.flags.auto_reload_on_alarm = true;
+    // pulse generation
+    if (stp->backend == NULL)
+        stp->backend = &stp_backend_isr;
+    stp->backend->init(stp);
+    ESP_LOGI("SYS", "Step backend: %s", stp->backend->name);
 
     stp->duty_set = 0;
+    stp->ramp_state = STP_RAMP_IDLE;
     stp->step_position = 0;
+    stp->ramp_position = 0;
     stp->step_target = 0;
     stp->dir_invert = 0;
+    stp->cmd_seq = 0;
+    stp->cmd_taken = 0;
+    _stp_status_publish(stp);
 
-    xTaskCreate(_stp_task, "_stp_task", 4096, stp, 0, NULL);
+    // handled from here on, the first axis starts the task for all of them
+    _stp_sched.axis[stp->axis] = stp;
+    __atomic_store_n(&_stp_sched.count, stp->axis + 1, __ATOMIC_RELEASE);
+    if (_stp_sched.task == NULL)
+        xTaskCreate(_stp_task, "_stp_task", 4096, &_stp_sched, 3, &_stp_sched.task);
 }
 
 void stepper_set_invert(tmc2209_io_t *stp, uint8_t inverted) {
-    if (stp->duty_set)
+    if (!stepper_ready(stp))
         return;
 
     stp->dir_invert = inverted;
+    stp->verify_valid = 0;
 }
 
 void stepper_set_position(tmc2209_io_t *stp, int32_t position) {
-    if (stp->duty_set)
+    if (!stepper_ready(stp))
         return;
     
+    // idle and nothing queued, the stepper task leaves the state alone
     stp->step_position = position;
+    stp->ramp_position = position;
     stp->step_target = position;
+    stp->verify_valid = 0;
+    _stp_status_publish(stp);
+}
+
+int32_t stepper_get_position(tmc2209_io_t *stp)
+{
+    return stp->backend->get_position(stp);
+}
+
+void stepper_get_status(tmc2209_io_t *stp, stp_status_t *status)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&stp->status_seq, __ATOMIC_ACQUIRE);
+        *status = stp->status;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&stp->status_seq, __ATOMIC_RELAXED));
+}
+
+void stepper_get_isr_stats(tmc2209_io_t *stp, stp_isr_stats_t *stats)
+{
+    *stats = stp->isr_stats;
 }
 
 void stepper_go_to_pos(tmc2209_io_t *stp, uint32_t rpm_set, int32_t position)
 {
-    // busy?
-    if (stp->duty_set)
-        return;
-    
-    // already there
-    if (position == stp->step_position)
+    // no speed?
+    if (rpm_set == 0)
         return;
 
     // higher rpm?
     if (rpm_set > STP_RPM_MAX)
         rpm_set = STP_RPM_MAX;
 
-    // start without curve?
-    if (rpm_set <= STP_RPM_DIRECT) {
-        stp->s_curve_steps = 1;
-    }
-    // start with cruve
-    else {
-        stp->s_curve_steps = rpm_set / 5;
-        if (stp->s_curve_steps > S_CURVE_ARR_LEN - 1)
-            stp->s_curve_steps = S_CURVE_ARR_LEN - 1;
-        if (stp->s_curve_steps < 2)
-            stp->s_curve_steps = 2;
-    }
+    stp_cmd_t cmd = {
+        .type = STP_CMD_MOVE,
+        .rpm = rpm_set,
+        .target = position,
+        .report = 1,
+    };
 
-    // set start variables
-    stp->step_target = position;
-    stp->rpm_set = rpm_set;
-    stp->s_cruve_index = 0;
-    stp->duty_set = 0;
+    // busy? Change the active move instead
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+    if (status.state != STP_RAMP_IDLE && stp->group == NULL)
+        _stp_retarget(stp, &status, &cmd, _stp_derate_rpm(stp, NULL, _stp_profile_rpm(stp, status.dir, rpm_set)));
 
-    // which direction?
-    if (stp->step_position < stp->step_target) 
-        stp->dir_set = 0;
-    else
-        stp->dir_set = 1;
+    _stp_cmd_post(stp, &cmd);
+
+    // a retarget ramps from where we are
+    if (cmd.type == STP_CMD_RETARGET)
+        _stp_current(stp, STP_RAMP_ACCEL);
 }
 
-void stepper_stop(tmc2209_io_t *stp)
+void stepper_home(tmc2209_io_t *stp, uint32_t rpm_set, int32_t position)
 {
-    // not active?
-    if (!stp->duty_set)
+    // no speed?
+    if (rpm_set == 0)
         return;
 
-    // low rpm?
-    if (stp->rpm_set < STP_RPM_DIRECT) {
-        if (stp->dir_set)
-            stp->step_target = stp->step_position - 1;
-        else
-            stp->step_target = stp->step_position + 1;
+    // higher rpm?
+    if (rpm_set > STP_RPM_MAX)
+        rpm_set = STP_RPM_MAX;
+
+    // never turned into a retarget, the guard is set up from standstill
+    stp_cmd_t cmd = {
+        .type = STP_CMD_MOVE,
+        .stall = 1,
+        .rpm = rpm_set,
+        .target = position,
+    };
+    _stp_cmd_post(stp, &cmd);
+}
+
+void stepper_stop(tmc2209_io_t *stp)
+{
+    // also drops a move that did not start yet
+    stp_cmd_t cmd = {
+        .type = STP_CMD_STOP,
+    };
+    _stp_cmd_post(stp, &cmd);
+}
+
+int stepper_group_go_to_pos(stp_group_t *grp, uint32_t rpm_set, const int32_t *position)
+{
+    // no speed?
+    if (rpm_set == 0 || grp->count == 0)
+        return 0;
+
+    // higher rpm?
+    if (rpm_set > STP_RPM_MAX)
+        rpm_set = STP_RPM_MAX;
+
+    // a group of one is a plain move, retargeted while it runs
+    if (grp->count == 1) {
+        stepper_go_to_pos(grp->axis[0], rpm_set, position[0]);
+        return 0;
     }
-    // not low rpm
-    else {
-        if (stp->dir_set)
-            stp->step_target = stp->step_position - (stp->rpm_set * 25);
-        else
-            stp->step_target = stp->step_position + (stp->rpm_set * 25);
+
+    // followers are stepped from the leader's step interrupt, the RMT and
+    // the driver's own VACTUAL steps never run it
+    for (int i = 0; i < grp->count; i++) {
+        if (grp->axis[i]->backend != &stp_backend_isr) {
+            ESP_LOGI("SYS", "Group move refused, axis %d is not on the isr backend", i);
+            return -1;
+        }
     }
+
+    stp_cmd_t cmd = {
+        .type = STP_CMD_GROUP,
+        .rpm = rpm_set,
+        .group = grp,
+    };
+    for (int i = 0; i < grp->count; i++)
+        cmd.group_target[i] = position[i];
+
+    // never retargeted, the first axis brakes and starts it once all stand
+    // still. The others brake on their own, a follower of a group move only
+    // stops with its leader.
+    for (int i = 1; i < grp->count; i++) {
+        if (!stepper_ready(grp->axis[i]))
+            stepper_stop(grp->axis[i]);
+    }
+    _stp_cmd_post(grp->axis[0], &cmd);
+
+    return 0;
 }
 
 uint8_t stepper_ready(tmc2209_io_t *stp)
 {
-    if (stp->step_target == stp->step_position)
+    if (_stp_cmd_pending(stp))
+        return 0;
+
+    stp_status_t status;
+    stepper_get_status(stp, &status);
+
+    if (status.state == STP_RAMP_IDLE)
         return 1;
     else
         return 0;
 }
 
-static void swuart_calcCRC(uint8_t *datagram, uint8_t datagramLength)
+void stepper_group_stop(stp_group_t *grp)
 {
-    int i, j;
-    uint8_t *crc = datagram + (datagramLength - 1); // CRC located in last byte of message
-    uint8_t currentByte;
-    *crc = 0;
-    for (i = 0; i < (datagramLength - 1); i++)
-    {                              // Execute for all bytes of a message
-        currentByte = datagram[i]; // Retrieve a byte to be sent from Array
-        for (j = 0; j < 8; j++)
-        {
-            if ((*crc >> 7) ^ (currentByte & 0x01)) // update CRC based result of XOR operation
-            {
-                *crc = (*crc << 1) ^ 0x07;
-            }
-            else
-            {
-                *crc = (*crc << 1);
-            }
-            currentByte = currentByte >> 1;
-        } // for CRC bit
-    } // for message byte
+    // the leader brakes the group, the followers drop what they had queued
+    for (int i = 0; i < grp->count; i++)
+        stepper_stop(grp->axis[i]);
 }
 
-int stepper_read_reg(tmc2209_io_t *stp, uint8_t reg, uint32_t *data)
+uint8_t stepper_group_ready(stp_group_t *grp)
 {
-    int ret = -3;
+    for (int i = 0; i < grp->count; i++) {
+        if (!stepper_ready(grp->axis[i]))
+            return 0;
+    }
 
-    for (uint8_t retry = 0; retry < 2; retry++)
-    {
-        uint8_t tmc_packet[4] = {0x55, 0x00, reg, 0x00};
-        swuart_calcCRC(tmc_packet, 4);
+    return 1;
+}
 
-        uart_write_bytes(UART_NUM_2, tmc_packet, 4);
+void stepper_set_profile(tmc2209_io_t *stp, uint8_t dir, const stp_profile_t *profile)
+{
+    // read by the stepper task when a move starts
+    stp->profile[dir ? STP_DIR_REV : STP_DIR_FWD] = *profile;
 
-        uint8_t buffer[8];
+    ESP_LOGI("SYS", "Profile %s: speed %d%%, accel %d%%, irun %d", dir ? "rev" : "fwd", (int)profile->speed_pct, (int)profile->accel_pct, (int)profile->irun);
+}
 
-        if (uart_read_bytes(UART_NUM_2, (uint8_t *)buffer, 4, 10) != 4)
-        {
-            ret = -1;
-            ESP_LOGI("RD", "retry %d", ret);
-            continue;
-        }
+int stepper_set_current(tmc2209_io_t *stp, const stp_current_t *cfg)
+{
+    stp->current = *cfg;
 
-        if (uart_read_bytes(UART_NUM_2, (uint8_t *)buffer, 8, 10) != 8)
-        {
-            ret = -2;
-            ESP_LOGI("RD", "retry %d", ret);
-            continue;
-        }
+    // IRUN stays until the next phase of a move
+    uint32_t ihold_irun;
+    if (stepper_read_reg(stp, TMC_REG_IHOLD_IRUN, &ihold_irun) != 0)
+        return -1;
+    ihold_irun = TMC_IHOLD_IRUN(cfg->hold, TMC_IHOLD_IRUN_IRUN(ihold_irun), cfg->hold_delay);
 
-        uint8_t crc_recv = buffer[7];
-        swuart_calcCRC(buffer, 8);
+    ESP_LOGI("SYS", "Current: run %d, boost %d, hold %d, hold delay %d", (int)cfg->run, (int)cfg->boost, (int)cfg->hold, (int)cfg->hold_delay);
 
-        if (crc_recv != buffer[7])
-        {
-            ret = -3;
-            ESP_LOGI("RD", "retry %d", ret);
-            ESP_LOG_BUFFER_HEX("RD", buffer, 8);
-            continue;
-        }
-        else
-        {
-            *data = buffer[6] | (buffer[5] << 8) | (buffer[4] << 16) | (buffer[3] << 24);
-            ret = 0;
-            break;
-        }
+    return stepper_write_reg_async(stp, TMC_REG_IHOLD_IRUN, ihold_irun, NULL, NULL);
+}
+
+// TSTEP is the time between 1/256 microsteps in fCLK cycles, whatever MRES is
+static uint32_t _stp_rpm_to_tstep(uint32_t rpm)
+{
+    if (rpm == 0)
+        return 0;
+
+    uint32_t tstep = (uint64_t)STP_VACTUAL_FCLK * 60 / ((uint64_t)rpm * 200 * 256);
+    return tstep > STP_TCOOLTHRS_MAX ? STP_TCOOLTHRS_MAX : tstep;
+}
+
+int stepper_set_chopper(tmc2209_io_t *stp, const stp_chopper_t *cfg)
+{
+    int ret = 0;
+
+    // StealthChop while TSTEP >= TPWMTHRS, so below spread_rpm
+    uint32_t tpwmthrs = _stp_rpm_to_tstep(cfg->spread_rpm);
+
+    // CoolStep while TCOOLTHRS >= TSTEP, so above coolstep_rpm
+    uint32_t tcoolthrs = _stp_rpm_to_tstep(cfg->coolstep_rpm);
+
+    // SEMIN 0..3, SEMAX 8..11, current steps up by 2 and down by one per 32 readings
+    uint32_t coolconf = 0;
+    if (cfg->semin && tcoolthrs)
+        coolconf = (cfg->semin & 0x0F) | (1 << 5) | ((cfg->semax & 0x0F) << 8);
+
+    // lost step detection trusts SG_RESULT where CoolStep runs
+    stp->sg_rpm_min = tcoolthrs ? cfg->coolstep_rpm : 0;
+    stp->sg_rpm_max = cfg->spread_rpm;
+    stp->sg_lost = cfg->sg_lost;
+
+    // a guarded move puts these back when it ends
+    if (stp->stall_guard) {
+        stp->stall_tpwmthrs = tpwmthrs;
+        stp->stall_tcoolthrs = tcoolthrs;
+    }
+    else {
+        ret |= stepper_write_reg(stp, TMC_REG_TPWMTHRS, tpwmthrs);
+        ret |= stepper_write_reg(stp, TMC_REG_TCOOLTHRS, tcoolthrs);
+    }
+    ret |= stepper_write_reg(stp, TMC_REG_COOLCONF, coolconf);
+
+    ESP_LOGI("SYS", "Chopper: spreadcycle from TSTEP %d, coolstep from TSTEP %d, COOLCONF %04x", (int)tpwmthrs, (int)tcoolthrs, (unsigned int)coolconf);
+
+    return ret ? -1 : 0;
+}
+
+int stepper_read_reg(tmc2209_io_t *stp, uint8_t reg, uint32_t *data)
+{
+    uint8_t cacheable = _stp_reg_cacheable(reg);
+
+    // from the shadow without waiting for a round trip in flight
+    portENTER_CRITICAL(&stp->reg_mux);
+    uint8_t known = cacheable && STP_REG_BIT(stp->reg_known, reg);
+    if (known)
+        *data = stp->reg_shadow[reg];
+    portEXIT_CRITICAL(&stp->reg_mux);
+    if (known)
+        return 0;
+
+    xSemaphoreTake(stp->reg_lock, portMAX_DELAY);
+
+    int ret = stp_uart_read(stp->bus, stp->addr, reg, data);
+    if (ret == 0 && cacheable) {
+        portENTER_CRITICAL(&stp->reg_mux);
+        stp->reg_shadow[reg] = *data;
+        STP_REG_SET(stp->reg_known, reg);
+        STP_REG_SET(stp->reg_synced, reg);
+        portEXIT_CRITICAL(&stp->reg_mux);
     }
 
+    xSemaphoreGive(stp->reg_lock);
+
     return ret;
 }
 
@@ -372,42 +2793,123 @@ int stepper_write_reg(tmc2209_io_t *stp, uint8_t reg, uint32_t data)
 {
     int ret = -3;
 
-    for (uint8_t retry = 0; retry < 2; retry++)
-    {
-        uint8_t tmc_packet[8] = {0x55, 0x00, reg | 0x80, (data >> 24), (data >> 16), (data >> 8), data & 0xFF, 0x00};
-        swuart_calcCRC(tmc_packet, 8);
-
-        uart_write_bytes(UART_NUM_2, tmc_packet, 8);
+    xSemaphoreTake(stp->reg_lock, portMAX_DELAY);
 
-        uint8_t buffer[8];
+    // nothing to do?
+    portENTER_CRITICAL(&stp->reg_mux);
+    uint8_t synced = STP_REG_BIT(stp->reg_synced, reg) && stp->reg_shadow[reg] == data;
+    portEXIT_CRITICAL(&stp->reg_mux);
+    if (synced) {
+        xSemaphoreGive(stp->reg_lock);
+        return 0;
+    }
 
-        if (uart_read_bytes(UART_NUM_2, (uint8_t *)buffer, 8, 10) != 8)
+    for (uint8_t retry = 0; retry < 2; retry++)
+    {
+        // counter to check the write against
+        if (!stp->ifcnt_valid)
         {
-            ret = -1;
-            ESP_LOGI("WR", "retry %d", ret);
-            continue;
+            stp_uart_trans_t read = {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_IFCNT};
+            ret = stp_uart_transfer(stp->bus, &read, 1);
+            if (ret != 0)
+            {
+                ESP_LOGI("WR", "retry %d", ret);
+                continue;
+            }
+            stp->ifcnt = read.data;
+            stp->ifcnt_writes = read.writes;
+            stp->ifcnt_valid = 1;
         }
 
-        vTaskDelay(1);
-
-        uint32_t reg_read = 0;
-        if (stepper_read_reg(stp, reg, &reg_read) != 0)
+        // the chip counts every write it accepted, write and check go out in
+        // one round trip. Async writes queued in between count too.
+        stp_uart_trans_t trans[2] = {
+            {.op = STP_UART_WRITE, .addr = stp->addr, .reg = reg, .data = data},
+            {.op = STP_UART_READ, .addr = stp->addr, .reg = TMC_REG_IFCNT},
+        };
+        ret = stp_uart_transfer(stp->bus, trans, 2);
+        if (ret != 0)
         {
-            ret = -2;
+            stp->ifcnt_valid = 0;
             ESP_LOGI("WR", "retry %d", ret);
             continue;
         }
 
-        if (reg_read != data)
+        uint8_t expect = stp->ifcnt + (uint8_t)(trans[1].writes - stp->ifcnt_writes);
+        stp->ifcnt = trans[1].data;
+        stp->ifcnt_writes = trans[1].writes;
+        if (stp->ifcnt != expect)
         {
             ret = -3;
             ESP_LOGI("WR", "retry %d", ret);
             continue;
         }
 
+        portENTER_CRITICAL(&stp->reg_mux);
+        stp->reg_shadow[reg] = data;
+        STP_REG_SET(stp->reg_known, reg);
+        STP_REG_SET(stp->reg_synced, reg);
+        portEXIT_CRITICAL(&stp->reg_mux);
         ret = 0;
         break;
     }
 
+    xSemaphoreGive(stp->reg_lock);
+
+    return ret;
+}
+
+int stepper_read_reg_async(tmc2209_io_t *stp, uint8_t reg, stp_uart_cb_t done, void *arg)
+{
+    stp_uart_trans_t trans = {
+        .op = STP_UART_READ,
+        .addr = stp->addr,
+        .reg = reg,
+        .done = done,
+        .arg = arg,
+    };
+
+    return stp_uart_submit(stp->bus, &trans, 1);
+}
+
+int stepper_write_reg_async(tmc2209_io_t *stp, uint8_t reg, uint32_t data, stp_uart_cb_t done, void *arg)
+{
+    stp_uart_trans_t trans = {
+        .op = STP_UART_WRITE,
+        .addr = stp->addr,
+        .reg = reg,
+        .data = data,
+        .done = done,
+        .arg = arg,
+    };
+
+    // not verified, the next blocking write of this register goes out again.
+    // The bus counts it for the IFCNT check of the next one. The shadow goes
+    // first, a write queued behind ours must not be overwritten by it.
+    portENTER_CRITICAL(&stp->reg_mux);
+    uint32_t shadow = stp->reg_shadow[reg];
+    uint8_t known = STP_REG_BIT(stp->reg_known, reg) != 0;
+    uint8_t synced = STP_REG_BIT(stp->reg_synced, reg) != 0;
+    stp->reg_shadow[reg] = data;
+    STP_REG_SET(stp->reg_known, reg);
+    STP_REG_CLR(stp->reg_synced, reg);
+    portEXIT_CRITICAL(&stp->reg_mux);
+
+    int ret = stp_uart_submit(stp->bus, &trans, 1);
+    if (ret == 0)
+        return 0;
+
+    // never queued, the chip still holds what the shadow had. Unless another
+    // write of the register came in meanwhile, that one stands.
+    portENTER_CRITICAL(&stp->reg_mux);
+    if (stp->reg_shadow[reg] == data && !STP_REG_BIT(stp->reg_synced, reg)) {
+        stp->reg_shadow[reg] = shadow;
+        if (!known)
+            STP_REG_CLR(stp->reg_known, reg);
+        if (synced)
+            STP_REG_SET(stp->reg_synced, reg);
+    }
+    portEXIT_CRITICAL(&stp->reg_mux);
+
     return ret;
-}
\ No newline at end of file
+}
@@ -2,15 +2,239 @@
 #define __STP_DRV__H__
 
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "driver/gptimer.h"
+#include "driver/rmt_tx.h"
+#include "driver/pulse_cnt.h"
+#include "stp_plan.h"
+#include "stp_uart.h"
 
 #define MICROSTEPS          8
 #define STP_RPM_MAX         300
 #define STP_RPM_DIRECT      30
 #define STP_STEP_PER_RPM    (200 * MICROSTEPS)
 
-#define S_CURVE_ARR_LEN     (STP_RPM_MAX / 5)
+// drivers on one bus, the TMC2209 has four node addresses
+#define STP_AXES_MAX        4
+
+// directions as in dir_set
+#define STP_DIR_FWD         0   // towards higher positions
+#define STP_DIR_REV         1
+
+// Resolution above mres_rpm. Positions and velocities stay in MICROSTEPS,
+// one coarse pulse moves STP_MRES_RATIO of them.
+#define STP_MICROSTEPS_COARSE   2
+#define STP_MRES_RATIO          (MICROSTEPS / STP_MICROSTEPS_COARSE)
+
+// default motion limits, in steps/s^2 and steps/s^3
+#define STP_ACCEL_DEFAULT   10000
+#define STP_JERK_DEFAULT    40000
+
+// TMC2209 step high time and dir to step setup time, in ns
+#define STP_PULSE_NS_DEFAULT        100
+#define STP_DIR_SETUP_NS_DEFAULT    20
+
+// StallGuard4: a stall is SG_RESULT <= 2 * SGTHRS, only in StealthChop.
+// SG_RESULT reads 0..510.
+#define STP_SGTHRS_DEFAULT  60
+#define STP_SG_RESULT_MAX   510
+#define STP_TCOOLTHRS_MAX   0xFFFFF
+
+// GCONF: microstep resolution from MRES instead of the MS1/MS2 pins
+#define TMC_GCONF_MSTEP_REG_SELECT  (1 << 7)
+
+// CHOPCONF: MRES 0 is 256 microsteps, each step up halves that, 8 is full steps
+#define TMC_CHOPCONF_MRES_MASK      (0xFUL << 24)
+#define TMC_CHOPCONF_MRES(n)        ((uint32_t)(8 - __builtin_ctz(n)) << 24)
+
+// IHOLD_IRUN: standstill and run current scale 0..31, IHOLDDELAY 0..15
+// steps of 2^18 clocks each down from IRUN to IHOLD
+#define TMC_IHOLD_IRUN_IRUN_MASK    (0x1FUL << 8)
+#define TMC_IHOLD_IRUN_IRUN(v)      (((v) >> 8) & 0x1F)
+#define TMC_IHOLD_IRUN(ihold, irun, delay) \
+    (((uint32_t)(ihold) & 0x1F) | (((uint32_t)(irun) & 0x1F) << 8) | (((uint32_t)(delay) & 0x0F) << 16))
+
+// DRV_STATUS: current scale CoolStep settled on, 0..31
+#define TMC_DRV_STATUS_CS_ACTUAL(v) (((v) >> 16) & 0x1F)
+
+// DRV_STATUS: ot, s2ga, s2gb, s2vsa, s2vsb, the bridges are switched off
+#define TMC_DRV_STATUS_FAULT        0x3E
+
+// DRV_STATUS: overtemperature pre-warning and shutdown, shorts to ground or
+// across the low side, open load of phase A or B
+#define TMC_DRV_STATUS_OTPW         0x01
+#define TMC_DRV_STATUS_OT           0x02
+#define TMC_DRV_STATUS_SHORT        0x3C
+#define TMC_DRV_STATUS_OPEN         0xC0
+
+// GSTAT: reset, driver shut down by a fault, charge pump undervoltage. Write
+// 1 to clear.
+#define TMC_GSTAT_RESET             0x01
+#define TMC_GSTAT_DRV_ERR           0x02
+#define TMC_GSTAT_UV_CP             0x04
+#define TMC_GSTAT_ALL               0x07
+
+// TMC2209 registers
+#define TMC_REG_GCONF       0x00
+#define TMC_REG_GSTAT       0x01
+#define TMC_REG_IFCNT       0x02
+#define TMC_REG_IOIN        0x06
+#define TMC_REG_IHOLD_IRUN  0x10
+#define TMC_REG_TPOWERDOWN  0x11
+#define TMC_REG_TSTEP       0x12
+#define TMC_REG_TPWMTHRS    0x13
+#define TMC_REG_TCOOLTHRS   0x14
+#define TMC_REG_VACTUAL     0x22
+#define TMC_REG_SGTHRS      0x40
+#define TMC_REG_SG_RESULT   0x41
+#define TMC_REG_COOLCONF    0x42
+#define TMC_REG_MSCNT       0x6A
+#define TMC_REG_MSCURACT    0x6B
+#define TMC_REG_CHOPCONF    0x6C
+#define TMC_REG_DRV_STATUS  0x6F
+#define TMC_REG_PWMCONF     0x70
+#define TMC_REG_PWM_SCALE   0x71
+#define TMC_REG_PWM_AUTO    0x72
+#define TMC_REG_COUNT       0x80
+
+typedef enum
+{
+    STP_RAMP_IDLE,
+    STP_RAMP_ACCEL,
+    STP_RAMP_CRUISE,
+    STP_RAMP_DECEL,
+    STP_RAMP_SLOW,          // down the ramp to a lower cruise speed
+} stp_ramp_state_t;
+
+typedef struct stp_backend_s stp_backend_t;
+typedef struct stp_group_s stp_group_t;
+
+// one ramp up from v_start to v_cruise, braking runs it backwards
+typedef struct
+{
+    uint32_t tj;
+    uint32_t ta;
+    uint32_t ticks;
+    uint32_t accel;
+    uint16_t v_start;
+    uint16_t v_cruise;
+    uint16_t v_jerk;
+    uint8_t shift;          // jerk phases looked up at 1 / 2^shift of the ticks, keeps the math in 32 bits
+} stp_ramp_t;
+
+typedef enum
+{
+    STP_CMD_MOVE,
+    STP_CMD_RETARGET,
+    STP_CMD_STOP,
+    STP_CMD_HALT,
+    STP_CMD_GROUP,
+    STP_CMD_SLOW,
+} stp_cmd_type_t;
+
+// Command from the api to the motion core. A newer command replaces one that
+// was not picked up yet.
+typedef struct
+{
+    uint8_t type;
+    uint8_t stall;          // STP_CMD_MOVE: stop as soon as the motor stalls
+    uint8_t report;         // STP_CMD_RETARGET: a new target, STP_EVENT_START once taken
+    uint16_t rpm;
+    int32_t target;
+
+    // STP_CMD_RETARGET: ramp to continue the active move on. STP_CMD_SLOW:
+    // the same, once the active one came down to its cruise speed.
+    stp_ramp_t ramp;
+    uint32_t ramp_time;
+    uint32_t ramp_steps;
+    uint16_t ramp_rpm;      // the ramp's rpm_set, with the profile applied
+
+    // STP_CMD_GROUP: every axis of the group to its own target
+    stp_group_t *group;
+    int32_t group_target[STP_AXES_MAX];
+} stp_cmd_t;
+
+typedef enum
+{
+    STP_EVENT_START,
+    STP_EVENT_CRUISE,
+    STP_EVENT_DECEL,
+    STP_EVENT_DONE,
+    STP_EVENT_STALL,
+    STP_EVENT_LOST,
+    STP_EVENT_HEALTH,
+} stp_event_type_t;
+
+// Reported from the stepper task, once per transition of the move
+typedef struct
+{
+    stp_event_type_t type;
+    int32_t position;       // final position on STP_EVENT_DONE, stall point on STP_EVENT_STALL
+    int32_t target;
+    uint32_t duration_ms;   // since STP_EVENT_START
+    uint8_t cs_actual;      // current scale at the end of cruise, from STP_EVENT_DECEL on
+    uint8_t cs_irun;        // IRUN CoolStep scaled it down from, 0..31
+    uint8_t axis;           // driver it came from, in the order they were set up
+    int16_t lost;           // STP_EVENT_LOST: microsteps MSCNT was off by, 0 for a stall or fault
+    uint16_t sg_min;        // lowest SG_RESULT at cruise where StallGuard4 is good, 0 without a reading
+    uint8_t health;         // STP_EVENT_HEALTH on: TMC_DRV_STATUS_ bits 0..7 of the last check
+    uint8_t gstat;          // TMC_GSTAT_ bits raised since the check before
+    uint8_t derate_pct;     // speed and run current while too warm, 100 at full
+} stp_event_t;
+
+// Chopper mode and CoolStep by velocity. StallGuard4, and so CoolStep, only
+// runs in StealthChop: CoolStep works from coolstep_rpm up to spread_rpm.
+typedef struct
+{
+    uint16_t spread_rpm;    // SpreadCycle above, StealthChop below, 0 never switches
+    uint16_t coolstep_rpm;  // CoolStep from this speed up, 0 disables it
+    uint8_t semin;          // lower SG_RESULT band / 32, 1..15, 0 disables CoolStep
+    uint8_t semax;          // upper band above semin / 32, 0..15
+    uint8_t sg_lost;        // a stall level SG_RESULT in the band is lost steps, needs a calibrated SGTHRS
+} stp_chopper_t;
+
+// Motion profile of one direction, a load that differs by direction gets its
+// own speed and torque. Zero fields keep rpm_set, the motion limits and IRUN.
+typedef struct
+{
+    uint16_t speed_pct;     // of rpm_set, up to STP_RPM_MAX
+    uint16_t accel_pct;     // of accel_max
+    uint8_t irun;           // IRUN at cruise, over stp_current_t run
+} stp_profile_t;
+
+// Motor current by phase of the move, current scales 0..31. IHOLD applies
+// at standstill after TPOWERDOWN, with IHOLD 0 the PWMCONF freewheel mode.
+typedef struct
+{
+    uint8_t run;            // IRUN at cruise, 0 keeps the IRUN set up before the first move
+    uint8_t boost;          // added to it while speeding up and braking
+    uint8_t hold;           // IHOLD
+    uint8_t hold_delay;     // IHOLDDELAY
+} stp_current_t;
+
+// Time spent in the step interrupt, in cpu cycles
+typedef struct
+{
+    uint32_t count;
+    uint32_t last;
+    uint32_t max;
+    uint32_t avg;           // running average over the last ~16 steps
+} stp_isr_stats_t;
+
+// Motion state as published by the motion core after every step
+typedef struct
+{
+    int32_t position;       // last step handed to the backend
+    int32_t target;
+    uint32_t ramp_steps;    // steps needed to brake
+    uint16_t velocity;      // steps/s, 0 when idle
+    uint8_t state;
+    uint8_t dir;
+} stp_status_t;
 
 typedef struct
 {
@@ -21,42 +245,312 @@ typedef struct
     gpio_num_t dir;
     gpio_num_t step;
     gpio_num_t spread;
+    gpio_num_t diag;        // optional stall output, 0 polls SG_RESULT over uart
+
+    // uart bus and node address 0..3. NULL shares one bus on UART_NUM_2 set
+    // up from the tx/rx of the first driver.
+    stp_uart_bus_t *bus;
+    uint8_t addr;
+
+    // pulse backend, NULL selects stp_backend_isr
+    const stp_backend_t *backend;
 
-    // "private" variables
+    // motion limits, 0 selects the defaults
+    uint32_t accel_max;
+    uint32_t jerk_max;
+
+    // switch to STP_MICROSTEPS_COARSE above this speed, 0 always runs
+    // MICROSTEPS. Only the isr backend switches, on a full step and with the
+    // CHOPCONF write going out between two pulses.
+    uint16_t mres_rpm;
+
+    // stall sensitivity for stepper_home and lost step detection, 0 selects
+    // STP_SGTHRS_DEFAULT
+    uint8_t sg_threshold;
+
+    // lost step check interval while moving, 0 selects STP_VERIFY_MS_DEFAULT
+    uint16_t verify_ms;
+
+    // DRV_STATUS and GSTAT check interval, moving or not, 0 selects
+    // STP_HEALTH_MS_DEFAULT. On the overtemperature pre-warning new moves
+    // and the cruise of the current one run at derate_pct of their speed
+    // and run current, 0 selects STP_DERATE_PCT_DEFAULT.
+    uint16_t health_ms;
+    uint8_t derate_pct;
+
+    // per direction, STP_DIR_FWD and STP_DIR_REV, see stepper_set_profile
+    stp_profile_t profile[2];
+
+    // see stepper_set_current
+    stp_current_t current;
+
+    // Adaptive cruise: the speed follows the load to hold SG_RESULT around
+    // adapt_sg, up to adapt_rpm_max and within the CoolStep band where
+    // SG_RESULT can be read. 0 cruises at rpm_set as asked, above 408 it
+    // holds 408 to keep room to speed up below the top of SG_RESULT.
+    uint16_t adapt_sg;
+    uint16_t adapt_rpm_max;     // 0 selects STP_RPM_MAX
+
+    // step timing, 0 selects the defaults
+    uint16_t step_pulse_ns;
+    uint16_t dir_setup_ns;
+
+    // motion events, called from the stepper task. A move that brakes to
+    // reverse reports a single STP_EVENT_DONE at its final target, a stall
+    // reports STP_EVENT_STALL followed by STP_EVENT_DONE where it halted.
+    // A retarget of the active move reports STP_EVENT_START once the isr
+    // took it.
+    // Lost steps halt the move with STP_EVENT_LOST, the position is off
+    // until it is set again.
+    void (*on_event)(const stp_event_t *event);
+
+    // "private" variables, owned by the isr while moving and by the stepper task when idle
     uint8_t dir_set;
     uint16_t rpm_set;
     uint16_t duty_set;
     uint8_t dir_invert;
 
-    //
-    uint16_t s_cruve_arr[S_CURVE_ARR_LEN];
-    uint16_t s_curve_steps;
-    uint16_t s_cruve_index;
-    uint32_t tick;
+    // plan of the current move
+    stp_plan_t plan;
+
+    // ramp generator, advanced on every step by the timer isr
+    volatile uint8_t ramp_state;
+    stp_ramp_t ramp;
+    uint32_t ramp_time;
+    uint32_t ramp_steps;
+    uint16_t ramp_rpm;      // the ramp's rpm_set, with the profile applied
+    uint32_t step_period;
+    uint32_t step_frac;         // remainder of the last period, in 1/duty_set ticks
 
     // counters
     int32_t step_position;
     int32_t step_target;
+    int32_t ramp_position;
+    int32_t move_start;
+
+    // api -> motion core, odd sequence while a command is written
+    volatile uint32_t cmd_seq;
+    volatile uint32_t cmd_taken;
+    stp_cmd_t cmd;
+    volatile uint8_t cmd_started;   // the isr took a retarget, the task reports it
+    volatile uint32_t cmd_stale;    // retarget the isr left to the task to plan again
+
+    // motion core -> api, seqlock
+    volatile uint32_t status_seq;
+    stp_status_t status;
+
+    // index in the step scheduler, its task sleeps until notified by the api or the isr
+    uint8_t axis;
+
+    // group of the last move, NULL when it ran on its own
+    stp_group_t *group;
+    int64_t move_start_us;
+
+    // stall detection of the current move, thresholds to restore after it.
+    // Without DIAG one SG_RESULT read in flight at a time, 2 once it came
+    // back.
+    uint8_t stall_guard;
+    uint32_t stall_tcoolthrs;
+    uint32_t stall_tpwmthrs;
+    volatile uint8_t stall_busy;
+    int64_t stall_time;
+    uint32_t stall_sg;
+
+    // CS_ACTUAL of the last background sample at cruise, and its IRUN
+    uint8_t cs_actual;
+    uint8_t cs_irun;
+
+    // StallGuard4 is only good in StealthChop at speed, the CoolStep band
+    uint16_t sg_rpm_min;
+    uint16_t sg_rpm_max;
+    uint8_t sg_lost;            // and stalls in there count as lost steps
+
+    // lost step detection: MSCNT at position 0, one background sample in
+    // flight at a time with the positions it was taken between
+    uint8_t verify_valid;
+    volatile uint8_t verify_busy;
+    int32_t verify_phase;
+    int64_t verify_time;
+    int32_t verify_pos[2];
+    uint32_t verify_mscnt;
+    uint32_t verify_drv_status;
+    uint32_t verify_sg;
+    int verify_ret;
+    int16_t verify_lost;
+    uint16_t sg_min;            // of the cruise so far
+
+    // IRUN the app set up, without a run current of the direction or the
+    // current settings
+    uint8_t irun_base;
+
+    // driver health, one background check in flight at a time, 2 once it
+    // came back. derate is 100 while the driver is cool, rpm_derate the
+    // cruise cap of the move once it had to slow.
+    volatile uint8_t health_busy;
+    int64_t health_time;
+    uint32_t health_drv_status;
+    uint32_t health_gstat;
+    int health_ret;
+    uint8_t health;
+    uint8_t gstat;
+    uint8_t derate;
+    uint16_t rpm_derate;
+
+    // adaptive cruise, SG_RESULT averaged since the last speed change
+    uint16_t adapt_avg;
+    uint16_t adapt_count;
+    int64_t adapt_time;
+
+    // microstep switching: steps per pulse, the isr holds the next pulse
+    // while the stepper task changes MRES to mres_pending
+    uint8_t mres_k;
+    uint8_t mres_pending;
+    volatile uint8_t mres_state;
+    uint8_t mres_on;            // switching allowed in this move
+    uint16_t mres_up;           // steps/s to go coarse at
+    uint16_t mres_down;         // and back
+    int32_t mres_align;         // (position + mres_align) % MICROSTEPS == 0 on a full step
+
+    // isr backend, next step in ticks of the shared timer. Starts are
+    // posted in step_start and taken by the isr once step_start_seq moved.
+    volatile uint8_t step_active;
+    uint64_t step_deadline;
+    uint64_t step_start;
+    uint32_t step_start_seq;
+    uint32_t step_start_taken;
+    volatile uint32_t *step_set_reg;
+    volatile uint32_t *step_clr_reg;
+    uint32_t step_mask;
+    uint32_t pulse_cycles;
+    uint32_t dir_setup_cycles;
+    stp_isr_stats_t isr_stats;
+
+    // rmt backend
+    rmt_channel_handle_t rmt_chan;
+    rmt_encoder_handle_t rmt_enc;
+    pcnt_unit_handle_t pcnt_unit;
+    uint32_t rmt_pulse_ticks;
+    uint32_t rmt_frac;          // timer ticks not handed to the rmt yet
+
+    // last known register values. Known: the shadow holds a usable value,
+    // synced: the chip confirmed it.
+    uint32_t reg_shadow[TMC_REG_COUNT];
+    uint32_t reg_known[TMC_REG_COUNT / 32];
+    uint32_t reg_synced[TMC_REG_COUNT / 32];
+    // IFCNT as last read, with the writes the bus had queued for us by then.
+    // reg_lock keeps blocking accesses apart for their round trip, reg_mux
+    // only guards the shadow so async writes never wait on the uart.
+    uint8_t ifcnt;
+    uint8_t ifcnt_writes;
+    uint8_t ifcnt_valid;
+    SemaphoreHandle_t reg_lock;
+    portMUX_TYPE reg_mux;
+
+    // vactual backend. MSCNT at the start and where the move stopped, read
+    // in the background, busy 2 once the one at the stop came back. The
+    // driver clock as measured so far, good to vactual_tol ppm.
+    esp_timer_handle_t vactual_timer;
+    int64_t vactual_time;
+    uint64_t vactual_acc;
+    uint32_t vactual_mscnt;
+    uint32_t vactual_mscnt_end;
+    uint8_t vactual_ok;
+    volatile uint8_t vactual_busy;
+    uint8_t vactual_lost;
+    uint32_t vactual_fclk;
+    uint32_t vactual_tol;
 
-    //
-    gptimer_handle_t gptimer;
-    gptimer_alarm_config_t alarm_config;
 } tmc2209_io_t;
 
+// Generates the step train for the ramp generator and reports the position
+// the motor is really at. Both backends pull their periods from the same ramp.
+struct stp_backend_s
+{
+    const char *name;
+    void (*init)(tmc2209_io_t *stp);
+    void (*start)(tmc2209_io_t *stp);
+    int32_t (*get_position)(tmc2209_io_t *stp);
+};
+
+// Axes that move as one: the group starts, ramps and arrives together however
+// far each axis goes. The one going furthest leads at the full speed, the
+// others step from its pulses in proportion. An axis is in one group at most.
+struct stp_group_s
+{
+    tmc2209_io_t *axis[STP_AXES_MAX];
+    uint8_t count;
+
+    // "private" variables, the move that runs
+    tmc2209_io_t *leader;
+    uint32_t lead_delta;
+    uint32_t delta[STP_AXES_MAX];
+    uint32_t acc[STP_AXES_MAX];
+};
+
+// one gptimer shared by all axes, an interrupt per step due
+extern const stp_backend_t stp_backend_isr;
+
+// RMT generates the pulses, PCNT counts them back, one interrupt per 32 steps
+extern const stp_backend_t stp_backend_rmt;
+
+// the driver steps itself from VACTUAL written over uart, no step pin or interrupt
+extern const stp_backend_t stp_backend_vactual;
+
 void stepper_init(tmc2209_io_t *stp);
 
 void stepper_set_invert(tmc2209_io_t *stp, uint8_t inverted);
 
 void stepper_set_position(tmc2209_io_t *stp, int32_t position);
 
+int32_t stepper_get_position(tmc2209_io_t *stp);
+
+// consistent copy of the motion state, safe from any task at any rate
+void stepper_get_status(tmc2209_io_t *stp, stp_status_t *status);
+
+// isr timing of the step backend
+void stepper_get_isr_stats(tmc2209_io_t *stp, stp_isr_stats_t *stats);
+
 void stepper_go_to_pos(tmc2209_io_t *stp, uint32_t rpm_set, int32_t position);
 
+// Moves towards position until the motor stalls against an end stop, or
+// arrives. Runs from standstill, an active move is braked first.
+void stepper_home(tmc2209_io_t *stp, uint32_t rpm_set, int32_t position);
+
 void stepper_stop(tmc2209_io_t *stp);
 
 uint8_t stepper_ready(tmc2209_io_t *stp);
 
+// Moves every axis of the group to its target, synchronised on the isr
+// backend. A running move of any of them is braked first, members only take
+// commands of their own once the group move ended. Only the isr backend
+// steps followers from the leader's interrupt: a group of two or more with
+// an axis on stp_backend_rmt or stp_backend_vactual is refused with -1 and
+// nothing moves, those axes have to be moved one by one.
+int stepper_group_go_to_pos(stp_group_t *grp, uint32_t rpm_set, const int32_t *position);
+
+void stepper_group_stop(stp_group_t *grp);
+
+uint8_t stepper_group_ready(stp_group_t *grp);
+
+// profile of the moves in dir, STP_DIR_FWD or STP_DIR_REV, from the next move on
+void stepper_set_profile(tmc2209_io_t *stp, uint8_t dir, const stp_profile_t *profile);
+
+// Current of every phase of the moves from here on. Writes the standstill
+// current right away, IRUN follows the phase of the move.
+int stepper_set_current(tmc2209_io_t *stp, const stp_current_t *cfg);
+
+// writes TPWMTHRS, TCOOLTHRS and COOLCONF
+int stepper_set_chopper(tmc2209_io_t *stp, const stp_chopper_t *cfg);
+
+// configuration registers come from the shadow once known, status registers from the chip
 int stepper_read_reg(tmc2209_io_t *stp, uint8_t reg, uint32_t *data);
 
+// skipped when the chip already has the value, verified through IFCNT otherwise
 int stepper_write_reg(tmc2209_io_t *stp, uint8_t reg, uint32_t data);
 
+// queue the access and return right away, done is called from the uart task
+int stepper_read_reg_async(tmc2209_io_t *stp, uint8_t reg, stp_uart_cb_t done, void *arg);
+
+int stepper_write_reg_async(tmc2209_io_t *stp, uint8_t reg, uint32_t data, stp_uart_cb_t done, void *arg);
+
 #endif
\ No newline at end of file
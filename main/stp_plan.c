@@ -0,0 +1,186 @@
+#include "stp_plan.h"
+
+#define US_PER_S    1000000ULL
+
+static uint64_t _isqrt64(uint64_t v)
+{
+    uint64_t res = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > v)
+        bit >>= 2;
+
+    while (bit) {
+        if (v >= res + bit) {
+            v -= res + bit;
+            res = (res >> 1) + bit;
+        }
+        else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return res;
+}
+
+// time needed to gain dv, returns the steps covered on the way
+static uint32_t _stp_plan_ramp(const stp_plan_limits_t *lim, uint32_t v_peak, uint32_t *t_jerk, uint32_t *t_accel)
+{
+    uint32_t dv = v_peak - lim->v_start;
+
+    // acceleration never reaches a_max, the ramp is jerk only
+    if ((uint64_t)lim->a_max * lim->a_max >= (uint64_t)dv * lim->j_max) {
+        *t_jerk = _isqrt64((uint64_t)dv * US_PER_S * US_PER_S / lim->j_max);
+        *t_accel = 0;
+    }
+    // jerk up to a_max, hold it, jerk back down
+    else {
+        *t_jerk = (uint64_t)lim->a_max * US_PER_S / lim->j_max;
+        *t_accel = (uint64_t)dv * US_PER_S / lim->a_max - *t_jerk;
+    }
+
+    // the ramp is point symmetric, so the mean speed is halfway
+    uint64_t t_ramp = 2ULL * *t_jerk + *t_accel;
+    return (uint64_t)(lim->v_start + v_peak) * t_ramp / (2 * US_PER_S);
+}
+
+void stp_plan_move(const stp_plan_limits_t *lim, uint32_t distance, stp_plan_t *plan)
+{
+    uint32_t v_peak = lim->v_max;
+    uint32_t t_jerk = 0;
+    uint32_t t_accel = 0;
+    uint32_t ramp_steps = 0;
+
+    // slow enough to start right away?
+    if (v_peak > lim->v_start) {
+        ramp_steps = _stp_plan_ramp(lim, v_peak, &t_jerk, &t_accel);
+
+        // too short to reach v_max, look for the highest peak where both ramps still fit
+        if (2 * ramp_steps > distance) {
+            uint32_t lo = lim->v_start;
+            uint32_t hi = v_peak;
+
+            while (hi - lo > 1) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (2 * _stp_plan_ramp(lim, mid, &t_jerk, &t_accel) <= distance)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+
+            v_peak = lo;
+            ramp_steps = _stp_plan_ramp(lim, v_peak, &t_jerk, &t_accel);
+        }
+    }
+    else {
+        v_peak = lim->v_max;
+    }
+
+    plan->v_start = (v_peak < lim->v_start) ? v_peak : lim->v_start;
+    plan->v_peak = v_peak;
+    plan->t_jerk = t_jerk;
+    plan->t_accel = t_accel;
+    plan->a_peak = t_accel ? lim->a_max : (uint64_t)lim->j_max * t_jerk / US_PER_S;
+    plan->ramp_steps = ramp_steps;
+    plan->cruise_steps = distance - 2 * ramp_steps;
+
+    uint64_t t_ramp = 2ULL * t_jerk + t_accel;
+    uint64_t t_cruise = (uint64_t)plan->cruise_steps * US_PER_S / v_peak;
+    plan->duration_ms = (2 * t_ramp + t_cruise) / 1000;
+}
+
+// the ramp split in its phases, in seconds
+typedef struct
+{
+    float tj, ta;
+    float j, a;
+    float v0, v1, v2;
+    float s1, s2;
+} stp_plan_phases_t;
+
+static void _stp_plan_phases(const stp_plan_t *plan, stp_plan_phases_t *ph)
+{
+    ph->tj = plan->t_jerk / (float)US_PER_S;
+    ph->ta = plan->t_accel / (float)US_PER_S;
+    ph->a = plan->a_peak;
+    ph->j = (ph->tj > 0) ? ph->a / ph->tj : 0;
+
+    // velocity and distance at the start of each phase
+    ph->v0 = plan->v_start;
+    ph->v1 = ph->v0 + ph->a * ph->tj / 2;
+    ph->v2 = ph->v1 + ph->a * ph->ta;
+    ph->s1 = ph->v0 * ph->tj + ph->j * ph->tj * ph->tj * ph->tj / 6;
+    ph->s2 = ph->s1 + ph->v1 * ph->ta + ph->a * ph->ta * ph->ta / 2;
+}
+
+uint32_t stp_plan_ramp_velocity(const stp_plan_t *plan, uint32_t t)
+{
+    stp_plan_phases_t ph;
+    _stp_plan_phases(plan, &ph);
+
+    float ts = t / (float)US_PER_S;
+    float v;
+
+    if (ts >= 2 * ph.tj + ph.ta) {
+        v = plan->v_peak;
+    }
+    else if (ts < ph.tj) {
+        v = ph.v0 + ph.j * ts * ts / 2;
+    }
+    else if (ts < ph.tj + ph.ta) {
+        v = ph.v1 + ph.a * (ts - ph.tj);
+    }
+    else {
+        float tau = ts - ph.tj - ph.ta;
+        v = ph.v2 + ph.a * tau - ph.j * tau * tau / 2;
+    }
+
+    return (uint32_t)(v + 0.5f);
+}
+
+uint32_t stp_plan_ramp_distance(const stp_plan_t *plan, uint32_t t)
+{
+    stp_plan_phases_t ph;
+    _stp_plan_phases(plan, &ph);
+
+    float ts = t / (float)US_PER_S;
+    float s;
+
+    if (ts >= 2 * ph.tj + ph.ta) {
+        s = plan->ramp_steps + plan->v_peak * (ts - 2 * ph.tj - ph.ta);
+    }
+    else if (ts < ph.tj) {
+        s = ph.v0 * ts + ph.j * ts * ts * ts / 6;
+    }
+    else if (ts < ph.tj + ph.ta) {
+        float tau = ts - ph.tj;
+        s = ph.s1 + ph.v1 * tau + ph.a * tau * tau / 2;
+    }
+    else {
+        float tau = ts - ph.tj - ph.ta;
+        s = ph.s2 + ph.v2 * tau + ph.a * tau * tau / 2 - ph.j * tau * tau * tau / 6;
+    }
+
+    return (uint32_t)(s + 0.5f);
+}
+
+uint32_t stp_plan_ramp_time(const stp_plan_t *plan, uint32_t v)
+{
+    uint32_t lo = 0;
+    uint32_t hi = 2 * plan->t_jerk + plan->t_accel;
+
+    if (v >= plan->v_peak)
+        return hi;
+
+    // velocity rises monotonically over the ramp
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (stp_plan_ramp_velocity(plan, mid) < v)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return hi;
+}
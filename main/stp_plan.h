@@ -0,0 +1,39 @@
+#ifndef __STP_PLAN__H__
+#define __STP_PLAN__H__
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t v_start;   // steps/s, speed the motor can start and stop at directly
+    uint32_t v_max;     // steps/s
+    uint32_t a_max;     // steps/s^2
+    uint32_t j_max;     // steps/s^3
+} stp_plan_limits_t;
+
+// One rest to rest move: an s-shaped ramp up (jerk, constant acceleration,
+// jerk), a cruise and the same ramp mirrored down.
+typedef struct
+{
+    uint32_t v_start;       // steps/s
+    uint32_t v_peak;        // steps/s, below v_max when the move is too short to reach it
+    uint32_t t_jerk;        // us, length of each of the two jerk phases of a ramp
+    uint32_t t_accel;       // us, constant acceleration phase between them
+    uint32_t a_peak;        // steps/s^2 reached during the ramp
+    uint32_t ramp_steps;    // steps covered by one ramp
+    uint32_t cruise_steps;
+    uint32_t duration_ms;   // whole move
+} stp_plan_t;
+
+void stp_plan_move(const stp_plan_limits_t *lim, uint32_t distance, stp_plan_t *plan);
+
+// velocity t us into the ramp up
+uint32_t stp_plan_ramp_velocity(const stp_plan_t *plan, uint32_t t);
+
+// steps covered in the first t us of the ramp up
+uint32_t stp_plan_ramp_distance(const stp_plan_t *plan, uint32_t t);
+
+// time into the ramp up at which it reaches velocity v
+uint32_t stp_plan_ramp_time(const stp_plan_t *plan, uint32_t v);
+
+#endif
@@ -0,0 +1,391 @@
+#include "stp_uart.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include <string.h>
+
+#define STP_UART_SYNC       0x55
+#define STP_UART_MASTER     0xFF
+#define STP_UART_QUEUE_LEN  16
+#define STP_UART_RETRIES    2
+
+// a node that fell back tries the next faster rate again after this long
+#define STP_UART_RECOVER_MS 60000
+
+// fallback rates, fastest first
+static const uint32_t _stp_uart_bauds[] = {500000, 250000, 115200, 57600, 19200, 9600};
+
+// The TMC crc8 (poly 0x07) shifts the crc left but feeds the message bits
+// lsb first. Run it mirrored instead: reflected poly 0xE0 takes whole bytes
+// through the table, the result is mirrored back once at the end.
+static const uint8_t _stp_uart_crc_table[256] = {
+    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+    0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+    0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+    0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+    0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+    0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+    0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+    0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+    0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+    0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+    0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+    0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+    0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+    0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+    0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+    0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+    0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF,
+};
+
+static const uint8_t _stp_uart_nibble_rev[16] = {
+    0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+    0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF,
+};
+
+static void swuart_calcCRC(uint8_t *datagram, uint8_t datagramLength)
+{
+    uint8_t crc = 0;
+
+    for (uint8_t i = 0; i < datagramLength - 1; i++)
+        crc = _stp_uart_crc_table[crc ^ datagram[i]];
+
+    // CRC located in last byte of message
+    datagram[datagramLength - 1] = (_stp_uart_nibble_rev[crc & 0x0F] << 4) | _stp_uart_nibble_rev[crc >> 4];
+}
+
+static uint8_t _stp_uart_encode(const stp_uart_trans_t *trans, uint8_t *buf)
+{
+    buf[0] = STP_UART_SYNC;
+    buf[1] = trans->addr;
+
+    if (trans->op == STP_UART_READ) {
+        buf[2] = trans->reg;
+        swuart_calcCRC(buf, 4);
+        return 4;
+    }
+
+    buf[2] = trans->reg | 0x80;
+    buf[3] = trans->data >> 24;
+    buf[4] = trans->data >> 16;
+    buf[5] = trans->data >> 8;
+    buf[6] = trans->data & 0xFF;
+    swuart_calcCRC(buf, 8);
+    return 8;
+}
+
+// time for count bytes on the wire at 10 bits each, plus the reply delay and
+// a tick of slack
+static TickType_t _stp_uart_ticks(stp_uart_bus_t *bus, size_t count)
+{
+    return pdMS_TO_TICKS(count * 10 * 1000 / bus->baud_now) + 2;
+}
+
+// The node answered but its reply came back garbled, it doesn't keep up
+// with this rate. Go one step slower, returns 0 if there is none left.
+static uint8_t _stp_uart_fallback(stp_uart_bus_t *bus, uint8_t addr)
+{
+    uint8_t node = addr % STP_UART_NODES;
+
+    for (size_t i = 0; i < sizeof(_stp_uart_bauds) / sizeof(_stp_uart_bauds[0]); i++) {
+        if (_stp_uart_bauds[i] < bus->baud_node[node]) {
+            bus->baud_node[node] = _stp_uart_bauds[i];
+            bus->baud_time[node] = xTaskGetTickCount();
+            ESP_LOGI("UART", "node %d falling back to %d baud", (int)node, (int)bus->baud_node[node]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A node that fell back a while ago tries one step faster again, the next
+// garbled reply takes it back down
+static void _stp_uart_recover(stp_uart_bus_t *bus, uint8_t node)
+{
+    if (bus->baud_node[node] >= bus->baud || xTaskGetTickCount() - bus->baud_time[node] < pdMS_TO_TICKS(STP_UART_RECOVER_MS))
+        return;
+
+    uint32_t baud = bus->baud;
+    for (size_t i = 0; i < sizeof(_stp_uart_bauds) / sizeof(_stp_uart_bauds[0]); i++) {
+        if (_stp_uart_bauds[i] > bus->baud_node[node] && _stp_uart_bauds[i] < baud)
+            baud = _stp_uart_bauds[i];
+    }
+
+    bus->baud_node[node] = baud;
+    bus->baud_time[node] = xTaskGetTickCount();
+    ESP_LOGI("UART", "node %d trying %d baud again", (int)node, (int)baud);
+}
+
+// every datagram of the batch goes out at the rate of its slowest node
+static void _stp_uart_baud(stp_uart_bus_t *bus, const stp_uart_trans_t *batch, int count)
+{
+    uint32_t baud = bus->baud;
+    for (int i = 0; i < count; i++) {
+        uint8_t node = batch[i].addr % STP_UART_NODES;
+        _stp_uart_recover(bus, node);
+        if (bus->baud_node[node] < baud)
+            baud = bus->baud_node[node];
+    }
+
+    if (baud != bus->baud_now) {
+        bus->baud_now = baud;
+        uart_set_baudrate(bus->port, bus->baud_now);
+    }
+}
+
+// Sends the batch in one go and checks the echo of every datagram. Only the
+// last one can be a read, its reply needs the bus to itself.
+static void _stp_uart_run(stp_uart_bus_t *bus, stp_uart_trans_t *batch, int count)
+{
+    uint8_t tx[STP_UART_BATCH_MAX * 8];
+    uint8_t rx[STP_UART_BATCH_MAX * 8];
+    uint8_t len[STP_UART_BATCH_MAX];
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        len[i] = _stp_uart_encode(&batch[i], tx + total);
+        total += len[i];
+    }
+
+    for (uint8_t retry = 0; retry < STP_UART_RETRIES; retry++) {
+        uart_flush_input(bus->port);
+        uart_write_bytes(bus->port, tx, total);
+
+        // single wire, everything we sent comes back first
+        if (uart_read_bytes(bus->port, rx, total, _stp_uart_ticks(bus, total)) != (int)total) {
+            for (int i = 0; i < count; i++)
+                batch[i].ret = -1;
+            ESP_LOGI("UART", "retry %d", -1);
+            continue;
+        }
+
+        // a different echo means someone else drove the line
+        uint8_t collision = 0;
+        size_t offset = 0;
+        for (int i = 0; i < count; i++) {
+            batch[i].ret = memcmp(tx + offset, rx + offset, len[i]) ? -4 : 0;
+            collision |= (batch[i].ret != 0);
+            offset += len[i];
+        }
+        if (collision) {
+            ESP_LOGI("UART", "retry %d", -4);
+            continue;
+        }
+
+        stp_uart_trans_t *last = &batch[count - 1];
+        if (last->op != STP_UART_READ)
+            break;
+
+        uint8_t reply[8];
+        if (uart_read_bytes(bus->port, reply, 8, _stp_uart_ticks(bus, 8)) != 8) {
+            last->ret = -2;
+            ESP_LOGI("UART", "retry %d", last->ret);
+            continue;
+        }
+
+        uint8_t crc_recv = reply[7];
+        swuart_calcCRC(reply, 8);
+        if (crc_recv != reply[7] || reply[1] != STP_UART_MASTER || reply[2] != last->reg) {
+            last->ret = -3;
+            ESP_LOGI("UART", "retry %d", last->ret);
+            ESP_LOG_BUFFER_HEX("UART", reply, 8);
+            continue;
+        }
+
+        last->data = reply[6] | (reply[5] << 8) | (reply[4] << 16) | ((uint32_t)reply[3] << 24);
+        last->ret = 0;
+        break;
+    }
+}
+
+static void _stp_uart_task(void *param)
+{
+    stp_uart_bus_t *bus = (stp_uart_bus_t *)param;
+    stp_uart_trans_t batch[STP_UART_BATCH_MAX];
+
+    while (1) {
+        xQueueReceive(bus->queue, &batch[0], portMAX_DELAY);
+
+        // let a group that is being queued complete, writes queued behind go
+        // along, a read closes the batch. Only a matter of batching, don't
+        // wait on a producer that is stuck on a full queue.
+        int count = 1;
+        uint8_t locked = (xSemaphoreTake(bus->lock, 1) == pdTRUE);
+        while (count < STP_UART_BATCH_MAX && batch[count - 1].op == STP_UART_WRITE &&
+               xQueueReceive(bus->queue, &batch[count], 0) == pdTRUE)
+            count++;
+        if (locked)
+            xSemaphoreGive(bus->lock);
+
+        _stp_uart_baud(bus, batch, count);
+        _stp_uart_run(bus, batch, count);
+
+        // no reply at all says nothing about the rate, the node may not be there
+        if (batch[count - 1].ret == -3)
+            _stp_uart_fallback(bus, batch[count - 1].addr);
+
+        for (int i = 0; i < count; i++) {
+            if (batch[i].done)
+                batch[i].done(&batch[i]);
+        }
+    }
+}
+
+void stp_uart_init(stp_uart_bus_t *bus)
+{
+    if (bus->baud == 0)
+        bus->baud = STP_UART_BAUD_DEFAULT;
+    bus->baud_now = bus->baud;
+    for (int i = 0; i < STP_UART_NODES; i++)
+        bus->baud_node[i] = bus->baud;
+
+    uart_config_t uart_config = {
+        .baud_rate = bus->baud_now,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
+
+    // Configure UART parameters
+    uart_param_config(bus->port, &uart_config);
+
+    // configure pins
+    uart_set_pin(bus->port, bus->tx, bus->rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+
+    // install driver
+    uart_driver_install(bus->port, 512 * 2, 0, 0, NULL, 0);
+
+    bus->queue = xQueueCreate(STP_UART_QUEUE_LEN, sizeof(stp_uart_trans_t));
+    bus->lock = xSemaphoreCreateMutex();
+    xTaskCreate(_stp_uart_task, "_stp_uart", 4096, bus, 4, &bus->task);
+}
+
+int stp_uart_submit(stp_uart_bus_t *bus, const stp_uart_trans_t *trans, int count)
+{
+    int ret = 0;
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    for (int i = 0; i < count; i++) {
+        // counted in queue order, what IFCNT should have moved by
+        stp_uart_trans_t queued = trans[i];
+        uint8_t node = queued.addr % STP_UART_NODES;
+        if (queued.op == STP_UART_WRITE)
+            bus->writes[node]++;
+        queued.writes = bus->writes[node];
+
+        if (xQueueSend(bus->queue, &queued, portMAX_DELAY) != pdTRUE) {
+            // never reaches the chip, IFCNT won't count it
+            if (queued.op == STP_UART_WRITE)
+                bus->writes[node]--;
+            ret = -1;
+        }
+    }
+    xSemaphoreGive(bus->lock);
+
+    return ret;
+}
+
+typedef struct
+{
+    SemaphoreHandle_t done;
+    stp_uart_trans_t *trans;
+    int count;
+    int index;
+} stp_uart_wait_t;
+
+// results come back in queue order
+static void _stp_uart_wake(const stp_uart_trans_t *trans)
+{
+    stp_uart_wait_t *wait = (stp_uart_wait_t *)trans->arg;
+    stp_uart_trans_t *orig = &wait->trans[wait->index++];
+
+    orig->data = trans->data;
+    orig->ret = trans->ret;
+    orig->writes = trans->writes;
+
+    if (wait->index == wait->count)
+        xSemaphoreGive(wait->done);
+}
+
+int stp_uart_transfer(stp_uart_bus_t *bus, stp_uart_trans_t *trans, int count)
+{
+    StaticSemaphore_t sem;
+    stp_uart_wait_t wait = {
+        .done = xSemaphoreCreateBinaryStatic(&sem),
+        .trans = trans,
+        .count = count,
+    };
+
+    stp_uart_trans_t queued[count];
+    for (int i = 0; i < count; i++) {
+        queued[i] = trans[i];
+        queued[i].done = _stp_uart_wake;
+        queued[i].arg = &wait;
+    }
+
+    if (stp_uart_submit(bus, queued, count) != 0)
+        return -1;
+
+    xSemaphoreTake(wait.done, portMAX_DELAY);
+
+    for (int i = 0; i < count; i++) {
+        if (trans[i].ret != 0)
+            return trans[i].ret;
+    }
+    return 0;
+}
+
+int stp_uart_probe(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t *data)
+{
+    uint8_t node = addr % STP_UART_NODES;
+    uint32_t baud;
+    int ret;
+
+    // a garbled reply already made the uart task fall back, try again unless
+    // it had nowhere left to go
+    do {
+        baud = bus->baud_node[node];
+        ret = stp_uart_read(bus, addr, reg, data);
+    } while (ret == -3 && bus->baud_node[node] != baud);
+
+    return ret;
+}
+
+int stp_uart_read(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t *data)
+{
+    stp_uart_trans_t trans = {
+        .op = STP_UART_READ,
+        .addr = addr,
+        .reg = reg,
+    };
+
+    int ret = stp_uart_transfer(bus, &trans, 1);
+    *data = trans.data;
+    return ret;
+}
+
+int stp_uart_write(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t data)
+{
+    stp_uart_trans_t trans = {
+        .op = STP_UART_WRITE,
+        .addr = addr,
+        .reg = reg,
+        .data = data,
+    };
+
+    return stp_uart_transfer(bus, &trans, 1);
+}
@@ -0,0 +1,84 @@
+#ifndef __STP_UART__H__
+#define __STP_UART__H__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+
+// datagrams sent back to back in one round trip
+#define STP_UART_BATCH_MAX  8
+
+// the TMC2209 detects the baud rate from every sync byte, this is the
+// fastest we try. Garbled replies step the rate of that node down.
+#define STP_UART_BAUD_DEFAULT   500000
+
+// a TMC2209 takes addresses 0..3 from its MS1/MS2 pins
+#define STP_UART_NODES      4
+
+typedef enum
+{
+    STP_UART_READ,
+    STP_UART_WRITE,
+} stp_uart_op_t;
+
+typedef struct stp_uart_trans_s stp_uart_trans_t;
+
+// called from the uart task once the transaction is done
+typedef void (*stp_uart_cb_t)(const stp_uart_trans_t *trans);
+
+struct stp_uart_trans_s
+{
+    uint8_t op;
+    uint8_t addr;
+    uint8_t reg;
+    uint32_t data;          // value to write, or the value read
+    int ret;                // 0 ok, -1 no echo, -2 no reply, -3 crc error, -4 collision
+    uint8_t writes;         // writes queued for addr up to this one, set on submit
+
+    stp_uart_cb_t done;
+    void *arg;
+};
+
+// One single wire uart shared by the drivers on it. A task owns the port,
+// transactions are queued and run in order.
+typedef struct
+{
+    uart_port_t port;
+    gpio_num_t tx;
+    gpio_num_t rx;
+    uint32_t baud;          // highest baud rate to use, 0 for the default
+
+    // "private" variables, the port runs at baud_now, each node at the
+    // rate it last answered cleanly on since baud_time
+    uint32_t baud_now;
+    uint32_t baud_node[STP_UART_NODES];
+    TickType_t baud_time[STP_UART_NODES];
+    uint8_t writes[STP_UART_NODES];
+    QueueHandle_t queue;
+    TaskHandle_t task;
+    SemaphoreHandle_t lock;
+} stp_uart_bus_t;
+
+void stp_uart_init(stp_uart_bus_t *bus);
+
+// Queues copies of the transactions, done of each gets its result. They are
+// kept together and go out in as few round trips as the reads allow.
+int stp_uart_submit(stp_uart_bus_t *bus, const stp_uart_trans_t *trans, int count);
+
+// same, but waits for them and writes the results back, returns the first error
+int stp_uart_transfer(stp_uart_bus_t *bus, stp_uart_trans_t *trans, int count);
+
+// Reads reg until the node answers cleanly, stepping its baud rate down while
+// the replies are garbled. A node that doesn't answer at all keeps its rate.
+// Returns the last error once the lowest rate fails too.
+int stp_uart_probe(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t *data);
+
+int stp_uart_read(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t *data);
+
+int stp_uart_write(stp_uart_bus_t *bus, uint8_t addr, uint8_t reg, uint32_t data);
+
+#endif
@@ -17,8 +17,22 @@ device_settings_t settings = {
     .dhcp_enable = true,
     .dir_invert = false,
     .roller_limit = 1600,
+    .blind_limit = {1600, 1600, 1600},
     .roller_pos = 0,
     .max_speed = 150,
+    .spread_rpm = 0,
+    .coolstep_rpm = 0,
+    .coolstep_semin = 0,
+    .coolstep_semax = 0,
+    .stall_lost = false,
+    .profile_speed = {100, 100},
+    .profile_accel = {100, 100},
+    .profile_irun = {0, 0},
+    .current_run = 0,
+    .current_boost = 0,
+    .current_hold = 0,
+    .current_hold_delay = 1,
+    .adapt_margin = 0,
     .mqtt_uri = "mqtt://broker.hivemq.com",
     .mqtt_user = "user",
     .mqtt_pass = "pass",
@@ -39,8 +53,22 @@ esp_err_t save_settings(const device_settings_t *settings) {
     cJSON_AddBoolToObject(root, "dhcp_enable", settings->dhcp_enable);
     cJSON_AddBoolToObject(root, "dir_invert", settings->dir_invert);
     cJSON_AddNumberToObject(root, "roller_limit", settings->roller_limit);
+    cJSON_AddItemToObject(root, "blind_limit", cJSON_CreateIntArray(settings->blind_limit, SETTINGS_BLINDS_MAX - 1));
     cJSON_AddNumberToObject(root, "roller_pos", settings->roller_pos);
     cJSON_AddNumberToObject(root, "max_speed", settings->max_speed);
+    cJSON_AddNumberToObject(root, "spread_rpm", settings->spread_rpm);
+    cJSON_AddNumberToObject(root, "coolstep_rpm", settings->coolstep_rpm);
+    cJSON_AddNumberToObject(root, "coolstep_semin", settings->coolstep_semin);
+    cJSON_AddNumberToObject(root, "coolstep_semax", settings->coolstep_semax);
+    cJSON_AddBoolToObject(root, "stall_lost", settings->stall_lost);
+    cJSON_AddItemToObject(root, "profile_speed", cJSON_CreateIntArray(settings->profile_speed, 2));
+    cJSON_AddItemToObject(root, "profile_accel", cJSON_CreateIntArray(settings->profile_accel, 2));
+    cJSON_AddItemToObject(root, "profile_irun", cJSON_CreateIntArray(settings->profile_irun, 2));
+    cJSON_AddNumberToObject(root, "current_run", settings->current_run);
+    cJSON_AddNumberToObject(root, "current_boost", settings->current_boost);
+    cJSON_AddNumberToObject(root, "current_hold", settings->current_hold);
+    cJSON_AddNumberToObject(root, "current_hold_delay", settings->current_hold_delay);
+    cJSON_AddNumberToObject(root, "adapt_margin", settings->adapt_margin);
     cJSON_AddStringToObject(root, "mqtt_uri", settings->mqtt_uri);
     cJSON_AddStringToObject(root, "mqtt_user", settings->mqtt_user);
     cJSON_AddStringToObject(root, "mqtt_pass", settings->mqtt_pass);
@@ -130,6 +158,16 @@ esp_err_t load_settings(device_settings_t *settings) {
         settings->roller_limit = temp->valueint;
     }
 
+    temp = cJSON_GetObjectItemCaseSensitive(root, "blind_limit");
+    if (cJSON_IsArray(temp)) {
+        for (int i = 0; i < SETTINGS_BLINDS_MAX - 1 && i < cJSON_GetArraySize(temp); i++) {
+            cJSON *item = cJSON_GetArrayItem(temp, i);
+            if (cJSON_IsNumber(item)) {
+                settings->blind_limit[i] = item->valueint;
+            }
+        }
+    }
+
     temp = cJSON_GetObjectItemCaseSensitive(root, "roller_pos");
     if (cJSON_IsNumber(temp)) {
         settings->roller_pos = temp->valueint;
@@ -140,6 +178,91 @@ esp_err_t load_settings(device_settings_t *settings) {
         settings->max_speed = temp->valueint;
     }
 
+    temp = cJSON_GetObjectItemCaseSensitive(root, "spread_rpm");
+    if (cJSON_IsNumber(temp)) {
+        settings->spread_rpm = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "coolstep_rpm");
+    if (cJSON_IsNumber(temp)) {
+        settings->coolstep_rpm = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "coolstep_semin");
+    if (cJSON_IsNumber(temp)) {
+        settings->coolstep_semin = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "coolstep_semax");
+    if (cJSON_IsNumber(temp)) {
+        settings->coolstep_semax = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "stall_lost");
+    if (cJSON_IsBool(temp)) {
+        settings->stall_lost = cJSON_IsTrue(temp);
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "profile_speed");
+    if (cJSON_IsArray(temp)) {
+        for (int i = 0; i < 2 && i < cJSON_GetArraySize(temp); i++) {
+            cJSON *item = cJSON_GetArrayItem(temp, i);
+            if (cJSON_IsNumber(item)) {
+                settings->profile_speed[i] = item->valueint;
+            }
+        }
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "profile_accel");
+    if (cJSON_IsArray(temp)) {
+        for (int i = 0; i < 2 && i < cJSON_GetArraySize(temp); i++) {
+            cJSON *item = cJSON_GetArrayItem(temp, i);
+            if (cJSON_IsNumber(item)) {
+                settings->profile_accel[i] = item->valueint;
+            }
+        }
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "profile_irun");
+    if (cJSON_IsArray(temp)) {
+        for (int i = 0; i < 2 && i < cJSON_GetArraySize(temp); i++) {
+            cJSON *item = cJSON_GetArrayItem(temp, i);
+            if (cJSON_IsNumber(item)) {
+                settings->profile_irun[i] = item->valueint;
+            }
+        }
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "current_run");
+    if (cJSON_IsNumber(temp)) {
+        settings->current_run = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "current_boost");
+    if (cJSON_IsNumber(temp)) {
+        settings->current_boost = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "current_hold");
+    if (cJSON_IsNumber(temp)) {
+        settings->current_hold = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "current_hold_delay");
+    if (cJSON_IsNumber(temp)) {
+        settings->current_hold_delay = temp->valueint;
+    }
+
+    temp = cJSON_GetObjectItemCaseSensitive(root, "adapt_margin");
+    if (cJSON_IsNumber(temp)) {
+        settings->adapt_margin = temp->valueint;
+        // saved before the bound, up to 800
+        if (settings->adapt_margin < 0)
+            settings->adapt_margin = 0;
+        if (settings->adapt_margin > SETTINGS_ADAPT_MARGIN_MAX)
+            settings->adapt_margin = SETTINGS_ADAPT_MARGIN_MAX;
+    }
+
     temp = cJSON_GetObjectItemCaseSensitive(root, "mqtt_uri");
     if (cJSON_IsString(temp) && (temp->valuestring != NULL)) {
         strncpy(settings->mqtt_uri, temp->valuestring, sizeof(settings->mqtt_uri));
@@ -173,8 +296,17 @@ void print_settings(const device_settings_t *settings) {
     ESP_LOGI("Settings", "  DHCP Enable  : %s", settings->dhcp_enable ? "true" : "false");
     ESP_LOGI("Settings", "  Dir Invert   : %s", settings->dir_invert ? "true" : "false");
     ESP_LOGI("Settings", "  Roller Limit : %d", settings->roller_limit);
+    ESP_LOGI("Settings", "  Blind Limits : %d %d %d", settings->blind_limit[0], settings->blind_limit[1], settings->blind_limit[2]);
     ESP_LOGI("Settings", "  Roller Pos   : %d", settings->roller_pos);
     ESP_LOGI("Settings", "  Max Speed    : %d", settings->max_speed);
+    ESP_LOGI("Settings", "  Spread RPM   : %d", settings->spread_rpm);
+    ESP_LOGI("Settings", "  CoolStep RPM : %d", settings->coolstep_rpm);
+    ESP_LOGI("Settings", "  CoolStep Band: %d %d", settings->coolstep_semin, settings->coolstep_semax);
+    ESP_LOGI("Settings", "  Stall Lost   : %s", settings->stall_lost ? "true" : "false");
+    ESP_LOGI("Settings", "  Close Profile: %d%% %d%% %d", settings->profile_speed[0], settings->profile_accel[0], settings->profile_irun[0]);
+    ESP_LOGI("Settings", "  Open Profile : %d%% %d%% %d", settings->profile_speed[1], settings->profile_accel[1], settings->profile_irun[1]);
+    ESP_LOGI("Settings", "  Current      : run %d boost %d hold %d delay %d", settings->current_run, settings->current_boost, settings->current_hold, settings->current_hold_delay);
+    ESP_LOGI("Settings", "  Adapt Margin : %d%%", settings->adapt_margin);
     ESP_LOGI("Settings", "  MQTT URI     : %s", settings->mqtt_uri);
     ESP_LOGI("Settings", "  MQTT User    : %s", settings->mqtt_user);
     ESP_LOGI("Settings", "  MQTT Pass    : %s", settings->mqtt_pass);
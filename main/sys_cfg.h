@@ -3,6 +3,13 @@
 #include <stdbool.h>
 #include "esp_system.h"
 
+// blinds driven as one cover
+#define SETTINGS_BLINDS_MAX 4
+
+// adapt_margin in percent of the stall level of 120. SG_RESULT tops out at
+// 510, adaptive cruise holds at most 408 to have room to speed up.
+#define SETTINGS_ADAPT_MARGIN_MAX 340
+
 // Define your settings structure
 typedef struct {
     char ip_address[16];   // e.g., "192.168.1.100"
@@ -11,8 +18,22 @@ typedef struct {
     bool dhcp_enable;
     bool dir_invert;
     int roller_limit;
+    int blind_limit[SETTINGS_BLINDS_MAX - 1]; // roller_limit of the blinds after the first
     int roller_pos;
     int max_speed;
+    int spread_rpm;        // SpreadCycle above, 0 stays in StealthChop
+    int coolstep_rpm;      // CoolStep above, 0 disables it
+    int coolstep_semin;
+    int coolstep_semax;
+    bool stall_lost;       // a stall at cruise in the CoolStep band homes again, SGTHRS has to fit the blind
+    int profile_speed[2];  // percent of max_speed closing and opening, learned by the setup
+    int profile_accel[2];  // percent of the default acceleration
+    int profile_irun[2];   // run current 1..31, 0 keeps IRUN
+    int current_run;       // IRUN at cruise 0..31, 0 keeps the driver's
+    int current_boost;     // added while speeding up and braking
+    int current_hold;      // IHOLD at standstill, 0 freewheels
+    int current_hold_delay;
+    int adapt_margin;      // adaptive cruise holds SG_RESULT at this percent of the stall level, 0 off
     char mqtt_uri[128];     // e.g., "mqtt://broker.hivemq.com"
     char mqtt_user[64];
     char mqtt_pass[64];
@@ -0,0 +1,110 @@
+// Cost of starting a move and of one ramp step, before and after the s-curve
+// table moved to build time. The "old" functions are the code the table
+// replaced: a sigmoid of up to 60 entries computed with expf at every move
+// start, then one entry interpolated per step. The "new" ones are what
+// stepper_go_to_pos and the isr run now: the jerk-limited plan, loading it
+// into the ramp, and the integer table lookup.
+//
+// Host numbers only give the ratio. The ESP32 has no double precision unit
+// and expf is a library call, so the old move start costs more there.
+#include "stp_drv.c"
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#define OLD_CURVE_LEN   (STP_RPM_MAX / 5)
+#define OLD_CURVE_FLEX  3
+#define OLD_SEG_TICKS   (STP_TIMER_HZ / 50)
+
+#define MOVES           200000
+#define STEPS           2000000
+
+static volatile uint32_t sink;
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _old_curve(uint16_t period[], float len, float fre_max, float fre_min, float flexible)
+{
+    float deno;
+    float melo;
+    float delt = fre_max - fre_min;
+    float fre = 0;
+    for (int i = 0; i < len; i++)
+    {
+        melo = flexible * (i - len / 2) / (len / 2);
+        deno = 1.0 / (1 + expf(-melo));
+        fre = delt * deno + fre_min;
+        fre /= 60;
+        fre *= STP_STEP_PER_RPM;
+        period[i] = (uint16_t)fre;
+    }
+}
+
+static uint32_t _old_velocity(const uint16_t *curve, uint32_t curve_steps, uint32_t t)
+{
+    uint32_t seg = t / OLD_SEG_TICKS;
+
+    if (seg >= curve_steps)
+        return curve[curve_steps];
+
+    int32_t v0 = curve[seg];
+    int32_t v1 = curve[seg + 1];
+    int32_t frac = t % OLD_SEG_TICKS;
+
+    return v0 + (v1 - v0) * frac / OLD_SEG_TICKS;
+}
+
+int main(void)
+{
+    static tmc2209_io_t stp;
+    static uint16_t curve[OLD_CURVE_LEN + 1];
+    stp_plan_limits_t lim;
+    stp_plan_t plan;
+    stp_ramp_t ramp;
+    double t0, t_old_move, t_new_move, t_old_step, t_new_step;
+
+    // move starts, at every speed with a ramp
+    t0 = _now();
+    for (uint32_t i = 0; i < MOVES; i++) {
+        uint32_t rpm = 35 + i % (STP_RPM_MAX - 35);
+        uint32_t steps = rpm / 5;
+        _old_curve(curve, steps + 1, rpm, 30, OLD_CURVE_FLEX);
+        sink += curve[steps / 2];
+    }
+    t_old_move = (_now() - t0) / MOVES;
+
+    t0 = _now();
+    for (uint32_t i = 0; i < MOVES; i++) {
+        uint32_t rpm = 35 + i % (STP_RPM_MAX - 35);
+        _stp_limits(&stp, rpm, STP_DIR_FWD, &lim);
+        stp_plan_move(&lim, 20000 + i % 1000, &plan);
+        _stp_ramp_load(&ramp, &plan);
+        sink += ramp.ticks;
+    }
+    t_new_move = (_now() - t0) / MOVES;
+
+    // ramp steps, a 300 rpm ramp sampled all along
+    _old_curve(curve, OLD_CURVE_LEN, STP_RPM_MAX, 30, OLD_CURVE_FLEX);
+    uint32_t old_ticks = (OLD_CURVE_LEN - 1) * OLD_SEG_TICKS;
+    t0 = _now();
+    for (uint32_t i = 0; i < STEPS; i++)
+        sink += _old_velocity(curve, OLD_CURVE_LEN - 1, (uint64_t)i * old_ticks / STEPS);
+    t_old_step = (_now() - t0) / STEPS;
+
+    _stp_limits(&stp, STP_RPM_MAX, STP_DIR_FWD, &lim);
+    stp_plan_move(&lim, 40000, &plan);
+    _stp_ramp_load(&ramp, &plan);
+    t0 = _now();
+    for (uint32_t i = 0; i < STEPS; i++)
+        sink += _stp_ramp_velocity(&ramp, (uint64_t)i * ramp.ticks / STEPS);
+    t_new_step = (_now() - t0) / STEPS;
+
+    printf("move start: old %.1f ns, new %.1f ns\n", t_old_move * 1e9, t_new_move * 1e9);
+    printf("ramp step:  old %.1f ns, new %.1f ns\n", t_old_step * 1e9, t_new_step * 1e9);
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Cost of encoding a datagram and of checking and decoding a reply, with the
+// bit by bit crc the table replaced ("old") and with stp_uart.c as it is now.
+// The reply is decoded the way _stp_uart_run() does it.
+#include "stp_uart.c"
+#include <stdio.h>
+#include <time.h>
+
+#define DATAGRAMS       5000000
+
+static volatile uint32_t sink;
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _old_calcCRC(uint8_t *datagram, uint8_t datagramLength)
+{
+    int i, j;
+    uint8_t *crc = datagram + (datagramLength - 1); // CRC located in last byte of message
+    uint8_t currentByte;
+    *crc = 0;
+    for (i = 0; i < (datagramLength - 1); i++)
+    {                              // Execute for all bytes of a message
+        currentByte = datagram[i]; // Retrieve a byte to be sent from Array
+        for (j = 0; j < 8; j++)
+        {
+            if ((*crc >> 7) ^ (currentByte & 0x01)) // update CRC based result of XOR operation
+            {
+                *crc = (*crc << 1) ^ 0x07;
+            }
+            else
+            {
+                *crc = (*crc << 1);
+            }
+            currentByte = currentByte >> 1;
+        } // for CRC bit
+    } // for message byte
+}
+
+static uint8_t _old_encode(const stp_uart_trans_t *trans, uint8_t *buf)
+{
+    buf[0] = STP_UART_SYNC;
+    buf[1] = trans->addr;
+
+    if (trans->op == STP_UART_READ) {
+        buf[2] = trans->reg;
+        _old_calcCRC(buf, 4);
+        return 4;
+    }
+
+    buf[2] = trans->reg | 0x80;
+    buf[3] = trans->data >> 24;
+    buf[4] = trans->data >> 16;
+    buf[5] = trans->data >> 8;
+    buf[6] = trans->data & 0xFF;
+    _old_calcCRC(buf, 8);
+    return 8;
+}
+
+static int _decode(uint8_t *reply, void (*crc)(uint8_t *, uint8_t), uint32_t *data)
+{
+    uint8_t crc_recv = reply[7];
+    crc(reply, 8);
+    if (crc_recv != reply[7] || reply[1] != STP_UART_MASTER)
+        return -3;
+
+    *data = reply[6] | (reply[5] << 8) | (reply[4] << 16) | ((uint32_t)reply[3] << 24);
+    return 0;
+}
+
+// datagrams per second, half reads and half writes
+static double _encode_rate(uint8_t (*encode)(const stp_uart_trans_t *, uint8_t *))
+{
+    uint8_t buf[8];
+    stp_uart_trans_t trans = { .addr = 0, .reg = 0x22 };
+
+    double t0 = _now();
+    for (uint32_t i = 0; i < DATAGRAMS; i++) {
+        trans.op = i & 1 ? STP_UART_WRITE : STP_UART_READ;
+        trans.data = i;
+        sink += encode(&trans, buf) + buf[7];
+    }
+    return DATAGRAMS / (_now() - t0);
+}
+
+static double _decode_rate(void (*crc)(uint8_t *, uint8_t))
+{
+    uint8_t reply[8] = {0x05, STP_UART_MASTER, 0x6A, 0, 0, 0, 0, 0};
+    uint32_t data;
+
+    double t0 = _now();
+    for (uint32_t i = 0; i < DATAGRAMS; i++) {
+        reply[6] = i;
+        sink += _decode(reply, crc, &data) + data;
+    }
+    return DATAGRAMS / (_now() - t0);
+}
+
+int main(void)
+{
+    double old_encode = _encode_rate(_old_encode);
+    double new_encode = _encode_rate(_stp_uart_encode);
+    double old_decode = _decode_rate(_old_calcCRC);
+    double new_decode = _decode_rate(swuart_calcCRC);
+
+    printf("encode: old %.1f M/s, new %.1f M/s\n", old_encode / 1e6, new_encode / 1e6);
+    printf("decode: old %.1f M/s, new %.1f M/s\n", old_decode / 1e6, new_decode / 1e6);
+    return 0;
+}
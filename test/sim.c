@@ -0,0 +1,745 @@
+#include "sim.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "driver/pulse_cnt.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "soc/gpio_struct.h"
+#include "freertos/semphr.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+// Host side of the esp-idf calls made by stp_drv.c. The step timer and the
+// RMT channel run in virtual time, PCNT counts the rising edges RMT puts on
+// its pin, the set/clear registers are looked at whenever the cpu cycle
+// counter is read. A TMC2209 answers on the uart, esp_timer alarms go off in
+// sim_esp_timer_fire(). Tasks only run in sim_run(), a test that never calls
+// it drives stepper_handle() itself.
+
+#define SIM_TIMER_HZ    40000000
+#define SIM_RMT_HZ      1000000
+
+struct gptimer_t sim_timer;
+struct rmt_channel_t sim_rmt;
+uint32_t sim_pulses[SIM_GPIO_MAX];
+uint32_t sim_pulse_cycles[SIM_GPIO_MAX];
+uint32_t sim_queue_fails;
+int64_t sim_now;
+gpio_dev_t GPIO;
+
+struct sim_tmc_t sim_tmc = { .step_pin = -1, .dir_pin = -1 };
+
+static uint8_t _level[SIM_GPIO_MAX];
+
+// set/clear registers of pins a test gave their own
+static struct
+{
+    volatile uint32_t w1ts;
+    volatile uint32_t w1tc;
+} _own_regs[SIM_GPIO_MAX];
+static gpio_num_t _own[SIM_GPIO_MAX];
+static int _own_count;
+static uint32_t _high_at[SIM_GPIO_MAX];
+static uint32_t _cycles;
+
+static struct pcnt_unit_t
+{
+    gpio_num_t gpio;
+    uint8_t running;
+    int count;
+} _pcnt;
+
+static void _sim_tmc_step(void);
+
+static void _sim_edge(gpio_num_t gpio, uint32_t level)
+{
+    if (gpio < 0 || gpio >= SIM_GPIO_MAX)
+        return;
+
+    if (level && !_level[gpio]) {
+        sim_pulses[gpio]++;
+        if (gpio == sim_tmc.step_pin)
+            _sim_tmc_step();
+        if (_pcnt.running && _pcnt.gpio == gpio)
+            _pcnt.count++;
+    }
+    _level[gpio] = level;
+}
+
+// the writes to the set/clear registers since the last look
+static void _sim_gpio_regs(void)
+{
+    uint32_t set[2] = {GPIO.out_w1ts, GPIO.out1_w1ts.val};
+    uint32_t clr[2] = {GPIO.out_w1tc, GPIO.out1_w1tc.val};
+
+    for (int i = 0; i < _own_count; i++) {
+        gpio_num_t pin = _own[i];
+        if (_own_regs[pin].w1ts)
+            set[pin / 32] |= 1UL << (pin % 32);
+        if (_own_regs[pin].w1tc)
+            clr[pin / 32] |= 1UL << (pin % 32);
+        _own_regs[pin].w1ts = _own_regs[pin].w1tc = 0;
+    }
+    if (!(set[0] | set[1] | clr[0] | clr[1]))
+        return;
+
+    for (int reg = 0; reg < 2; reg++) {
+        for (uint32_t bits = set[reg]; bits; bits &= bits - 1) {
+            int pin = reg * 32 + __builtin_ctz(bits);
+            if (!_level[pin])
+                _high_at[pin] = _cycles;
+            _sim_edge(pin, 1);
+        }
+        for (uint32_t bits = clr[reg]; bits; bits &= bits - 1) {
+            int pin = reg * 32 + __builtin_ctz(bits);
+            uint32_t high = _cycles - _high_at[pin];
+            if (_level[pin] && (!sim_pulse_cycles[pin] || high < sim_pulse_cycles[pin]))
+                sim_pulse_cycles[pin] = high;
+            _sim_edge(pin, 0);
+        }
+    }
+
+    GPIO.out_w1ts = GPIO.out_w1tc = 0;
+    GPIO.out1_w1ts.val = GPIO.out1_w1tc.val = 0;
+}
+
+void sim_own_regs(gpio_num_t pin, volatile uint32_t **set, volatile uint32_t **clr, uint32_t *mask)
+{
+    int i = 0;
+    while (i < _own_count && _own[i] != pin)
+        i++;
+    if (i == _own_count)
+        _own[_own_count++] = pin;
+
+    *set = &_own_regs[pin].w1ts;
+    *clr = &_own_regs[pin].w1tc;
+    *mask = 1;
+}
+
+double sim_fire(void)
+{
+    gptimer_alarm_event_data_t event;
+
+    if (sim_timer.alarm > sim_timer.now)
+        sim_timer.now = sim_timer.alarm;
+    sim_timer.running = 0;
+
+    // esp_timer_get_time() and task timeouts go along
+    int64_t us = sim_timer.now * 1000000 / SIM_TIMER_HZ;
+    if (us > sim_now)
+        sim_now = us;
+
+    event.count_value = sim_timer.now;
+    event.alarm_value = sim_timer.alarm;
+    sim_timer.cb(&sim_timer, &event, sim_timer.arg);
+
+    return (double)sim_timer.now / SIM_TIMER_HZ;
+}
+
+double sim_rmt_fire(void)
+{
+    rmt_encode_state_t state;
+
+    // refill once half of the memory went out, like the ping-pong interrupt
+    if (!sim_rmt.encoded && sim_rmt.mem_len <= sim_rmt.mem_size / 2) {
+        sim_rmt.encoder->encode(sim_rmt.encoder, &sim_rmt, NULL, 0, &state);
+        if (state & RMT_ENCODING_COMPLETE)
+            sim_rmt.encoded = 1;
+    }
+
+    if (sim_rmt.mem_len) {
+        rmt_symbol_word_t sym = sim_rmt.mem[0];
+        memmove(sim_rmt.mem, sim_rmt.mem + 1, --sim_rmt.mem_len * sizeof(sym));
+        _sim_edge(sim_rmt.gpio, sym.level0);
+        _sim_edge(sim_rmt.gpio, sym.level1);
+        sim_rmt.now += sym.duration0 + sym.duration1;
+    }
+
+    if (sim_rmt.encoded && sim_rmt.mem_len == 0) {
+        rmt_tx_done_event_data_t event = { .num_symbols = 0 };
+        sim_rmt.running = 0;
+        sim_rmt.cb(&sim_rmt, &event, sim_rmt.arg);
+    }
+
+    return (double)sim_rmt.now / SIM_RMT_HZ;
+}
+
+// The TMC2209 behind the uart: it echoes what was sent like the single wire
+// does, answers reads and takes writes. With VACTUAL set it turns on its own
+// clock, MSCNT follows the microsteps it made.
+
+#define SIM_TMC_REG_GCONF       0x00
+#define SIM_TMC_REG_IFCNT       0x02
+#define SIM_TMC_REG_VACTUAL     0x22
+#define SIM_TMC_REG_MSCNT       0x6A
+#define SIM_TMC_REG_CHOPCONF    0x6C
+
+static uint8_t _rx[256];
+static size_t _rx_len;
+
+uint8_t sim_tmc_crc(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        for (int j = 0; j < 8; j++) {
+            if ((crc >> 7) ^ (byte & 0x01))
+                crc = (crc << 1) ^ 0x07;
+            else
+                crc = crc << 1;
+            byte >>= 1;
+        }
+    }
+
+    return crc;
+}
+
+void sim_tmc_reset(uint32_t fclk)
+{
+    memset(&sim_tmc, 0, sizeof(sim_tmc));
+    sim_tmc.on = 1;
+    sim_tmc.fclk = fclk;
+    sim_tmc.step_pin = sim_tmc.dir_pin = -1;
+    sim_tmc.mscnt0 = 176;
+    sim_tmc.t = sim_now;
+    _rx_len = 0;
+}
+
+// microsteps per full step, from the MS pins (both low) unless GCONF hands it to MRES
+static uint32_t _sim_tmc_microsteps(void)
+{
+    if (!(sim_tmc.regs[SIM_TMC_REG_GCONF] & (1 << 7)))
+        return 8;
+    return 256 >> ((sim_tmc.regs[SIM_TMC_REG_CHOPCONF] >> 24) & 0x0F);
+}
+
+double sim_tmc_position(void)
+{
+    // VACTUAL is in microsteps per 2^24 clocks
+    double usteps = (double)sim_tmc.vactual * sim_tmc.fclk / (1 << 24) * (sim_now - sim_tmc.t) / 1e6;
+    sim_tmc.angle += usteps * (256 / _sim_tmc_microsteps());
+    sim_tmc.t = sim_now;
+    return sim_tmc.angle;
+}
+
+// the STEP input only counts while VACTUAL is 0
+static void _sim_tmc_step(void)
+{
+    if (!sim_tmc.on || sim_tmc.vactual)
+        return;
+    if (sim_tmc.skip) {
+        sim_tmc.skip--;
+        return;
+    }
+
+    uint32_t step = 256 / _sim_tmc_microsteps();
+    if (sim_tmc.dir_pin >= 0 && _level[sim_tmc.dir_pin])
+        sim_tmc.angle -= step;
+    else
+        sim_tmc.angle += step;
+}
+
+static uint32_t _sim_tmc_read(uint8_t reg)
+{
+    if (reg == SIM_TMC_REG_MSCNT) {
+        uint32_t step = 256 / _sim_tmc_microsteps();
+        int64_t made = (int64_t)trunc(sim_tmc_position() / step);
+        return (uint32_t)(sim_tmc.mscnt0 + made * step) & 1023;
+    }
+    return sim_tmc.regs[reg];
+}
+
+static void _sim_tmc_write(uint8_t reg, uint32_t data)
+{
+    if (reg == SIM_TMC_REG_VACTUAL) {
+        sim_tmc_position();
+        sim_tmc.vactual = (int32_t)(data << 8) >> 8;
+    }
+    sim_tmc.regs[reg] = data;
+    sim_tmc.regs[SIM_TMC_REG_IFCNT] = (sim_tmc.regs[SIM_TMC_REG_IFCNT] + 1) & 0xFF;
+}
+
+// datagrams sent back to back are taken one after the other
+static void _sim_tmc_datagrams(const uint8_t *data, size_t len)
+{
+    while (len >= 4) {
+        size_t size = (data[2] & 0x80) ? 8 : 4;
+        if (size > len || (data[0] & 0x0F) != 0x05 || data[size - 1] != sim_tmc_crc(data, size - 1)) {
+            sim_tmc.crc_errors++;
+            return;
+        }
+
+        uint8_t reg = data[2] & 0x7F;
+        if (data[1] != sim_tmc.addr) {
+            // another driver on the bus
+        }
+        else if (size == 8) {
+            _sim_tmc_write(reg, (uint32_t)data[3] << 24 | data[4] << 16 | data[5] << 8 | data[6]);
+        }
+        else {
+            uint32_t value = _sim_tmc_read(reg);
+            uint8_t reply[8] = {0x05, 0xFF, reg, value >> 24, value >> 16, value >> 8, value, 0};
+            reply[7] = sim_tmc_crc(reply, 7);
+            if (_rx_len + sizeof(reply) <= sizeof(_rx)) {
+                memcpy(_rx + _rx_len, reply, sizeof(reply));
+                _rx_len += sizeof(reply);
+            }
+        }
+
+        data += size;
+        len -= size;
+    }
+}
+
+// one shot and periodic esp_timers, in sim_now
+struct esp_timer
+{
+    esp_timer_cb_t cb;
+    void *arg;
+    int64_t at;
+    uint64_t period;
+    uint8_t armed;
+};
+
+#define SIM_ESP_TIMER_MAX   32
+
+static struct esp_timer _esp_timers[SIM_ESP_TIMER_MAX];
+static int _esp_timer_count;
+
+int sim_esp_timer_fire(void)
+{
+    struct esp_timer *next = NULL;
+
+    for (int i = 0; i < _esp_timer_count; i++)
+        if (_esp_timers[i].armed && (next == NULL || _esp_timers[i].at < next->at))
+            next = &_esp_timers[i];
+    if (next == NULL)
+        return 0;
+
+    if (next->at > sim_now)
+        sim_now = next->at;
+    if (next->period)
+        next->at += next->period;
+    else
+        next->armed = 0;
+    next->cb(next->arg);
+    return 1;
+}
+
+// Tasks are coroutines on the test's thread. A blocking call that cannot go
+// on switches back to sim_run(), which goes round the tasks until a whole
+// round went by without any of them getting what it waited for.
+
+#define SIM_TASK_MAX    32
+#define SIM_TASK_STACK  (256 * 1024)
+
+typedef struct
+{
+    ucontext_t ctx;
+    TaskFunction_t fn;
+    void *arg;
+    uint32_t bits;          // xTaskNotify
+    uint32_t given;         // xTaskNotifyGive
+    uint8_t started;
+} sim_task_t;
+
+typedef struct
+{
+    uint32_t count;
+} sim_sem_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t item;
+    uint32_t size;
+    uint32_t head;
+    uint32_t count;
+} sim_queue_t;
+
+static sim_task_t _tasks[SIM_TASK_MAX];
+static int _task_count;
+static sim_task_t *_current;
+static ucontext_t _main_ctx;
+static uint32_t _progress;
+
+static void _sim_task_entry(void)
+{
+    _current->fn(_current->arg);
+}
+
+static void _sim_wait(void)
+{
+    swapcontext(&_current->ctx, &_main_ctx);
+}
+
+void sim_run(void)
+{
+    uint32_t progress;
+
+    do {
+        progress = _progress;
+        for (int i = 0; i < _task_count; i++) {
+            sim_task_t *task = &_tasks[i];
+            if (!task->started) {
+                getcontext(&task->ctx);
+                task->ctx.uc_stack.ss_sp = malloc(SIM_TASK_STACK);
+                task->ctx.uc_stack.ss_size = SIM_TASK_STACK;
+                task->ctx.uc_link = NULL;
+                makecontext(&task->ctx, _sim_task_entry, 0);
+                task->started = 1;
+                _progress++;
+            }
+            _current = task;
+            swapcontext(&_main_ctx, &task->ctx);
+            _current = NULL;
+        }
+    } while (progress != _progress);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+esp_err_t gptimer_new_timer(const gptimer_config_t *config, gptimer_handle_t *timer) { *timer = &sim_timer; return ESP_OK; }
+esp_err_t gptimer_enable(gptimer_handle_t timer) { return ESP_OK; }
+esp_err_t gptimer_start(gptimer_handle_t timer) { return ESP_OK; }
+esp_err_t gptimer_stop(gptimer_handle_t timer) { return ESP_OK; }
+esp_err_t gptimer_set_raw_count(gptimer_handle_t timer, uint64_t value) { return ESP_OK; }
+esp_err_t gptimer_get_raw_count(gptimer_handle_t timer, uint64_t *value) { *value = timer->now; return ESP_OK; }
+
+esp_err_t gptimer_register_event_callbacks(gptimer_handle_t timer, const gptimer_event_callbacks_t *cbs, void *arg)
+{
+    timer->cb = cbs->on_alarm;
+    timer->arg = arg;
+    return ESP_OK;
+}
+
+esp_err_t gptimer_set_alarm_action(gptimer_handle_t timer, const gptimer_alarm_config_t *config)
+{
+    timer->alarm = config->alarm_count;
+    timer->running = 1;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void) { return sim_now; }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+    if (_esp_timer_count == SIM_ESP_TIMER_MAX)
+        return ESP_FAIL;
+    struct esp_timer *timer = &_esp_timers[_esp_timer_count++];
+    timer->cb = args->callback;
+    timer->arg = args->arg;
+    *out = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t us)
+{
+    timer->at = sim_now + us;
+    timer->period = 0;
+    timer->armed = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t us)
+{
+    timer->at = sim_now + us;
+    timer->period = us;
+    timer->armed = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) { timer->armed = 0; return ESP_OK; }
+
+esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void)
+{
+    _sim_gpio_regs();
+    return _cycles += 7;
+}
+
+uint32_t esp_rom_get_cpu_ticks_per_us(void) { return 240; }
+
+esp_err_t gpio_config(const gpio_config_t *config) { return ESP_OK; }
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level) { _sim_edge(gpio, level); return ESP_OK; }
+int gpio_get_level(gpio_num_t gpio) { return gpio >= 0 && gpio < SIM_GPIO_MAX ? _level[gpio] : 0; }
+esp_err_t gpio_install_isr_service(int flags) { return ESP_OK; }
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio, gpio_isr_t isr, void *arg) { return ESP_OK; }
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config) { return ESP_OK; }
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts) { return ESP_OK; }
+esp_err_t uart_driver_install(uart_port_t port, int rx_size, int tx_size, int queue_size, QueueHandle_t *queue, int flags) { return ESP_OK; }
+
+int uart_write_bytes(uart_port_t port, const void *data, size_t len)
+{
+    if (_rx_len + len <= sizeof(_rx)) {
+        memcpy(_rx + _rx_len, data, len);
+        _rx_len += len;
+    }
+    if (sim_tmc.on)
+        _sim_tmc_datagrams(data, len);
+    return len;
+}
+
+esp_err_t uart_flush_input(uart_port_t port) { _rx_len = 0; return ESP_OK; }
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud) { return ESP_OK; }
+
+int uart_read_bytes(uart_port_t port, void *data, uint32_t len, TickType_t wait)
+{
+    if (len > _rx_len)
+        len = _rx_len;
+    memcpy(data, _rx, len);
+    memmove(_rx, _rx + len, _rx_len - len);
+    _rx_len -= len;
+    return len;
+}
+
+// the copy encoder moves symbols into the channel memory until it is full
+typedef struct
+{
+    rmt_encoder_t base;
+    size_t done;
+} sim_copy_encoder_t;
+
+static size_t _sim_copy_encode(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *data, size_t size, rmt_encode_state_t *ret_state)
+{
+    sim_copy_encoder_t *enc = __containerof(encoder, sim_copy_encoder_t, base);
+    const rmt_symbol_word_t *sym = data;
+    size_t len = size / sizeof(rmt_symbol_word_t);
+    size_t encoded = 0;
+    int state = RMT_ENCODING_RESET;
+
+    while (enc->done < len && channel->mem_len < channel->mem_size) {
+        channel->mem[channel->mem_len++] = sym[enc->done++];
+        encoded++;
+    }
+
+    if (enc->done == len) {
+        enc->done = 0;
+        state |= RMT_ENCODING_COMPLETE;
+    }
+    if (channel->mem_len == channel->mem_size)
+        state |= RMT_ENCODING_MEM_FULL;
+
+    *ret_state = (rmt_encode_state_t)state;
+    return encoded;
+}
+
+static esp_err_t _sim_copy_reset(rmt_encoder_t *encoder)
+{
+    __containerof(encoder, sim_copy_encoder_t, base)->done = 0;
+    return ESP_OK;
+}
+
+static esp_err_t _sim_copy_del(rmt_encoder_t *encoder)
+{
+    free(__containerof(encoder, sim_copy_encoder_t, base));
+    return ESP_OK;
+}
+
+esp_err_t rmt_new_copy_encoder(const rmt_copy_encoder_config_t *config, rmt_encoder_handle_t *encoder)
+{
+    sim_copy_encoder_t *enc = calloc(1, sizeof(sim_copy_encoder_t));
+    enc->base.encode = _sim_copy_encode;
+    enc->base.reset = _sim_copy_reset;
+    enc->base.del = _sim_copy_del;
+    *encoder = &enc->base;
+    return ESP_OK;
+}
+
+esp_err_t rmt_encoder_reset(rmt_encoder_handle_t encoder) { return encoder->reset(encoder); }
+esp_err_t rmt_del_encoder(rmt_encoder_handle_t encoder) { return encoder->del(encoder); }
+
+esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *channel)
+{
+    sim_rmt.gpio = config->gpio_num;
+    sim_rmt.mem_size = config->mem_block_symbols;
+    if (sim_rmt.mem_size > sizeof(sim_rmt.mem) / sizeof(sim_rmt.mem[0]))
+        return ESP_FAIL;
+    *channel = &sim_rmt;
+    return ESP_OK;
+}
+
+esp_err_t rmt_enable(rmt_channel_handle_t channel) { return ESP_OK; }
+
+esp_err_t rmt_tx_register_event_callbacks(rmt_channel_handle_t channel, const rmt_tx_event_callbacks_t *cbs, void *arg)
+{
+    channel->cb = cbs->on_trans_done;
+    channel->arg = arg;
+    return ESP_OK;
+}
+
+esp_err_t rmt_transmit(rmt_channel_handle_t channel, rmt_encoder_handle_t encoder, const void *data, size_t size, const rmt_transmit_config_t *config)
+{
+    encoder->reset(encoder);
+    channel->encoder = encoder;
+    channel->encoded = 0;
+    channel->mem_len = 0;
+    channel->running = 1;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_new_unit(const pcnt_unit_config_t *config, pcnt_unit_handle_t *unit) { *unit = &_pcnt; return ESP_OK; }
+
+esp_err_t pcnt_new_channel(pcnt_unit_handle_t unit, const pcnt_chan_config_t *config, pcnt_channel_handle_t *channel)
+{
+    unit->gpio = config->edge_gpio_num;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_channel_set_edge_action(pcnt_channel_handle_t channel, pcnt_channel_edge_action_t pos, pcnt_channel_edge_action_t neg) { return ESP_OK; }
+esp_err_t pcnt_unit_add_watch_point(pcnt_unit_handle_t unit, int value) { return ESP_OK; }
+esp_err_t pcnt_unit_enable(pcnt_unit_handle_t unit) { return ESP_OK; }
+esp_err_t pcnt_unit_start(pcnt_unit_handle_t unit) { unit->running = 1; return ESP_OK; }
+esp_err_t pcnt_unit_clear_count(pcnt_unit_handle_t unit) { unit->count = 0; return ESP_OK; }
+esp_err_t pcnt_unit_get_count(pcnt_unit_handle_t unit, int *count) { *count = unit->count; return ESP_OK; }
+
+BaseType_t xPortInIsrContext(void) { return pdTRUE; }
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *task)
+{
+    if (_task_count == SIM_TASK_MAX)
+        return pdFALSE;
+    sim_task_t *t = &_tasks[_task_count++];
+    t->fn = fn;
+    t->arg = arg;
+    if (task)
+        *task = t;
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return _current; }
+void vTaskDelay(TickType_t ticks) { }
+TickType_t xTaskGetTickCount(void) { return sim_now / 1000 / portTICK_PERIOD_MS; }
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t bits, eNotifyAction action)
+{
+    __atomic_fetch_or(&((sim_task_t *)task)->bits, bits, __ATOMIC_RELAXED);
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t bits, eNotifyAction action, BaseType_t *woken)
+{
+    return xTaskNotify(task, bits, action);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    __atomic_fetch_add(&((sim_task_t *)task)->given, 1, __ATOMIC_RELAXED);
+    return pdPASS;
+}
+
+// a timeout runs out once sim_now got there
+BaseType_t xTaskNotifyWait(uint32_t clear_in, uint32_t clear_out, uint32_t *bits, TickType_t wait)
+{
+    if (_current == NULL)
+        return pdFALSE;
+
+    int64_t until = wait == portMAX_DELAY ? INT64_MAX : sim_now + (int64_t)wait * portTICK_PERIOD_MS * 1000;
+    while (_current->bits == 0 && sim_now < until)
+        _sim_wait();
+    _progress++;
+
+    *bits = __atomic_fetch_and(&_current->bits, ~clear_out, __ATOMIC_RELAXED);
+    return *bits ? pdTRUE : pdFALSE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    if (_current == NULL)
+        return 0;
+    while (_current->given == 0)
+        _sim_wait();
+    _progress++;
+
+    uint32_t given = _current->given;
+    _current->given = clear ? 0 : given - 1;
+    return given;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    sim_sem_t *sem = calloc(1, sizeof(sim_sem_t));
+    sem->count = 1;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer)
+{
+    sim_sem_t *sem = (sim_sem_t *)buffer;
+    sem->count = 0;
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t wait)
+{
+    sim_sem_t *sem = handle;
+
+    // the test itself cannot wait, the tasks get one go at giving it
+    if (sem->count == 0 && _current == NULL)
+        sim_run();
+    if (_current == NULL && sem->count == 0)
+        return pdFALSE;
+    while (sem->count == 0)
+        _sim_wait();
+    _progress++;
+
+    sem->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    ((sim_sem_t *)handle)->count++;
+    return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t size, UBaseType_t item)
+{
+    sim_queue_t *queue = calloc(1, sizeof(sim_queue_t));
+    queue->buf = calloc(size, item);
+    queue->item = item;
+    queue->size = size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t wait)
+{
+    sim_queue_t *queue = handle;
+
+    if (sim_queue_fails) {
+        sim_queue_fails--;
+        return pdFALSE;
+    }
+    if (queue->count == queue->size && _current == NULL && wait)
+        sim_run();
+    if (queue->count == queue->size && (_current == NULL || wait == 0))
+        return pdFALSE;
+    while (queue->count == queue->size)
+        _sim_wait();
+    _progress++;
+
+    memcpy(queue->buf + (queue->head + queue->count) % queue->size * queue->item, item, queue->item);
+    queue->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t wait)
+{
+    sim_queue_t *queue = handle;
+
+    if (queue->count == 0 && _current == NULL && wait)
+        sim_run();
+    if (queue->count == 0 && (_current == NULL || wait == 0))
+        return pdFALSE;
+    while (queue->count == 0)
+        _sim_wait();
+    _progress++;
+
+    memcpy(item, queue->buf + queue->head * queue->item, queue->item);
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    return pdTRUE;
+}
@@ -0,0 +1,90 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include "driver/gptimer.h"
+#include "driver/rmt_tx.h"
+
+#define SIM_GPIO_MAX    40
+
+// The step timer as seen by the host tests: it runs free, an alarm is
+// pending while running is set and nothing runs until sim_fire() is called.
+struct gptimer_t
+{
+    uint8_t running;
+    gptimer_alarm_cb_t cb;
+    void *arg;
+    uint64_t alarm;
+    uint64_t now;           // ticks since the start of the test
+};
+
+// The RMT channel: symbols the encoder wrote go into a memory of
+// mem_block_symbols and are played one per sim_rmt_fire().
+struct rmt_channel_t
+{
+    uint8_t running;
+    uint8_t encoded;        // the encoder reported RMT_ENCODING_COMPLETE
+    gpio_num_t gpio;
+    rmt_tx_done_callback_t cb;
+    void *arg;
+    rmt_encoder_t *encoder;
+    rmt_symbol_word_t mem[64];
+    size_t mem_size;
+    size_t mem_len;
+    uint64_t now;           // 1MHz symbol ticks since the start of the test
+};
+
+extern struct gptimer_t sim_timer;
+extern struct rmt_channel_t sim_rmt;
+extern int64_t sim_now;         // esp_timer_get_time()
+extern uint32_t sim_pulses[SIM_GPIO_MAX];   // rising edges per pin
+extern uint32_t sim_pulse_cycles[SIM_GPIO_MAX]; // shortest high time through the set/clear registers
+extern uint32_t sim_queue_fails;    // xQueueSend calls to fail from now on
+
+// The TMC2209 on the uart, silent until sim_tmc_reset() powered it up
+struct sim_tmc_t
+{
+    uint8_t on;
+    uint32_t regs[128];
+    uint8_t addr;           // set by its MS pins
+    gpio_num_t step_pin;    // wired to STEP and DIR, -1 when not
+    gpio_num_t dir_pin;
+    uint32_t skip;          // STEP pulses to miss, like a stalled motor
+    uint32_t fclk;          // its clock, VACTUAL counts in fclk / 2^24 microsteps/s
+    int32_t vactual;
+    double angle;           // turned so far, in MSCNT counts
+    int64_t t;              // sim_now the angle is up to date for
+    uint32_t mscnt0;        // MSCNT at angle 0
+    uint32_t crc_errors;    // datagrams it dropped
+};
+
+extern struct sim_tmc_t sim_tmc;
+
+// Points a driver at set/clear registers of its step pin alone. Stores to
+// the shared GPIO ones overwrite each other until the sim looks again, a
+// test pulsing several pins at once gives each its own.
+void sim_own_regs(gpio_num_t pin, volatile uint32_t **set, volatile uint32_t **clr, uint32_t *mask);
+
+// Runs the pending alarm, returns the virtual time in seconds
+double sim_fire(void);
+
+// Plays the next RMT symbol, returns the virtual time in seconds
+double sim_rmt_fire(void);
+
+// Powers the TMC2209 up with the given clock, STEP and DIR not wired
+void sim_tmc_reset(uint32_t fclk);
+
+// Angle the motor turned since the reset, in MSCNT counts (256 per full
+// step). DIR low counts up.
+double sim_tmc_position(void);
+
+// CRC8 of a datagram, bit by bit as in the datasheet
+uint8_t sim_tmc_crc(const uint8_t *data, size_t len);
+
+// Runs the next esp_timer alarm, 0 when none is armed
+int sim_esp_timer_fire(void);
+
+// Runs the tasks until all of them wait
+void sim_run(void);
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+// host stand-in for the esp-idf header, only what the stepper code uses
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+typedef int uart_port_t;
+#define UART_NUM_0 0
+#define UART_NUM_1 1
+#define UART_NUM_2 2
+#define UART_PIN_NO_CHANGE (-1)
+typedef enum {UART_DATA_8_BITS=3} uart_word_length_t;
+typedef enum {UART_PARITY_DISABLE=0} uart_parity_t;
+typedef enum {UART_STOP_BITS_1=1} uart_stop_bits_t;
+typedef enum {UART_HW_FLOWCTRL_DISABLE=0} uart_hw_flowcontrol_t;
+typedef struct { int baud_rate; uart_word_length_t data_bits; uart_parity_t parity; uart_stop_bits_t stop_bits; uart_hw_flowcontrol_t flow_ctrl; } uart_config_t;
+esp_err_t uart_param_config(uart_port_t, const uart_config_t *);
+esp_err_t uart_set_pin(uart_port_t, int, int, int, int);
+esp_err_t uart_driver_install(uart_port_t, int, int, int, QueueHandle_t *, int);
+int uart_write_bytes(uart_port_t, const void *, size_t);
+int uart_read_bytes(uart_port_t, void *, uint32_t, TickType_t);
+esp_err_t uart_flush_input(uart_port_t);
+esp_err_t uart_set_baudrate(uart_port_t, uint32_t);
+esp_err_t uart_get_baudrate(uart_port_t, uint32_t *);
+esp_err_t uart_wait_tx_done(uart_port_t, TickType_t);
@@ -0,0 +1,4 @@
+#pragma once
+// host stand-in for the esp-idf header, only what the stepper code uses
+#define IRAM_ATTR
+#define DRAM_ATTR
@@ -0,0 +1,12 @@
+#pragma once
+// host stand-in for the esp-idf header, only what the stepper code uses
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_CRC 0x109
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERROR_CHECK(x) (void)(x)
+const char *esp_err_to_name(esp_err_t);
@@ -0,0 +1,16 @@
+#pragma once
+// host stand-in for the esp-idf header, only what the stepper code uses
+#include <stdio.h>
+#include <inttypes.h>
+// quiet, build the tests with -DSIM_LOG to see the firmware log
+#ifdef SIM_LOG
+#define SIM_LOG_ON 1
+#else
+#define SIM_LOG_ON 0
+#endif
+#define _SIM_LOG(tag, fmt, ...) do { if (SIM_LOG_ON) printf("%s: " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI _SIM_LOG
+#define ESP_LOGW _SIM_LOG
+#define ESP_LOGE _SIM_LOG
+#define ESP_LOGD _SIM_LOG
+#define ESP_LOG_BUFFER_HEX(tag, b, l) (void)(b)
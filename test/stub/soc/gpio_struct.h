@@ -0,0 +1,5 @@
+#pragma once
+// host stand-in for the esp-idf header, only what the stepper code uses
+#include <stdint.h>
+typedef struct { volatile uint32_t out; volatile uint32_t out_w1ts; volatile uint32_t out_w1tc; union { struct { uint32_t data:8; }; uint32_t val; } out1, out1_w1ts, out1_w1tc; } gpio_dev_t;
+extern gpio_dev_t GPIO;
@@ -0,0 +1,135 @@
+// Adaptive cruise against a simulated load, with the stepper task running:
+// motor torque falls off with speed and the load gets heavier over the
+// middle of the travel. The simulated TMC2209 reports the SG_RESULT of that
+// load to the lost step sampler. A fixed speed runs close to the stall level
+// in the heavy part, the adaptive one has to speed up where the load allows,
+// ease down through the heavy part and keep its margin. A margin past what
+// SG_RESULT can show still has to speed up.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <string.h>
+
+#define STEP_PIN        23
+#define DIR_PIN         22
+#define TRAVEL          20000
+#define STALL_SG        120         // 2 * SGTHRS
+#define ADAPT_SG        300
+
+typedef struct
+{
+    uint32_t sg_min;        // lowest SG_RESULT at cruise
+    uint32_t rpm_max;
+    int32_t position;
+    uint32_t losts;
+} run_t;
+
+static tmc2209_io_t stp;
+static run_t *run;
+
+static void _on_event(const stp_event_t *event)
+{
+    if (event->type == STP_EVENT_LOST)
+        run->losts++;
+}
+
+static uint32_t _load_sg(int32_t pos, uint32_t velocity)
+{
+    double rpm = velocity * 60.0 / STP_STEP_PER_RPM;
+    double torque = 1.0 - rpm / 400.0;
+    double load = 0.3;
+
+    if (pos > 6000 && pos < 9000)
+        load += 0.25 * (pos - 6000) / 3000.0;
+    else if (pos >= 9000 && pos < 12000)
+        load = 0.55;
+    else if (pos >= 12000 && pos < 14000)
+        load = 0.55 - 0.25 * (pos - 12000) / 2000.0;
+
+    double sg = 1023.0 * (1.0 - load / torque);
+    return sg < 0 ? 0 : (uint32_t)sg;
+}
+
+static void _run(uint32_t rpm, uint16_t adapt_sg, run_t *r)
+{
+    run = r;
+    memset(&stp, 0, sizeof(stp));
+    memset(run, 0, sizeof(*run));
+    run->sg_min = UINT32_MAX;
+
+    sim_tmc_reset(STP_VACTUAL_FCLK);
+    sim_tmc.step_pin = STEP_PIN;
+    sim_tmc.dir_pin = DIR_PIN;
+    stp.step = STEP_PIN;
+    stp.dir = DIR_PIN;
+    stp.on_event = _on_event;
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    stp.sg_threshold = STALL_SG / 2;
+    stp.sg_rpm_min = 60;
+    stp.sg_rpm_max = 250;
+    stp.adapt_sg = adapt_sg;
+    stepper_set_position(&stp, 0);
+    sim_run();
+
+    stepper_go_to_pos(&stp, rpm, TRAVEL);
+    sim_run();
+    while (sim_timer.running || !stepper_ready(&stp)) {
+        if (sim_timer.running)
+            sim_fire();
+
+        // what the driver reads right now, for the next sample
+        uint32_t sg = _load_sg(stp.step_position, stp.duty_set);
+        sim_tmc.regs[TMC_REG_SG_RESULT] = sg;
+        if (stp.ramp_state == STP_RAMP_CRUISE && sg < run->sg_min)
+            run->sg_min = sg;
+        uint32_t rpm_now = stp.duty_set * 60 / STP_STEP_PER_RPM;
+        if (rpm_now > run->rpm_max)
+            run->rpm_max = rpm_now;
+
+        sim_run();
+    }
+    sim_run();
+
+    run->position = stepper_get_position(&stp);
+}
+
+int main(void)
+{
+    run_t fixed, adapt, high;
+    uint32_t errors = 0;
+
+    _run(150, 0, &fixed);
+    printf("fixed 150rpm:  SG min %u, %u rpm max, at %d\n", fixed.sg_min, fixed.rpm_max, fixed.position);
+    _run(150, ADAPT_SG, &adapt);
+    printf("adapt SG %u: SG min %u, %u rpm max, at %d\n", ADAPT_SG, adapt.sg_min, adapt.rpm_max, adapt.position);
+    _run(150, 8 * STALL_SG, &high);
+    printf("adapt SG %u: SG min %u, %u rpm max, at %d\n", 8 * STALL_SG, high.sg_min, high.rpm_max, high.position);
+
+    // the fixed speed gets close to a stall, the point of the exercise
+    if (fixed.sg_min > STALL_SG + 20)
+        errors++, printf("load model too light for a fixed 150rpm\n");
+
+    // adaptive keeps clear of the stall level, and uses the light parts. The
+    // minimum is taken on every pulse, between two samples it reacts late
+    if (adapt.sg_min < STALL_SG + 30)
+        errors++, printf("adaptive cruise came within %u of the stall level\n", adapt.sg_min - STALL_SG);
+    if (adapt.rpm_max <= 150)
+        errors++, printf("adaptive cruise never sped up\n");
+    if (adapt.rpm_max > stp.sg_rpm_max)
+        errors++, printf("adaptive cruise left the CoolStep band\n");
+    if (high.rpm_max <= 150)
+        errors++, printf("adaptive cruise above the SG_RESULT range never sped up\n");
+
+    if (fixed.position != TRAVEL || adapt.position != TRAVEL || high.position != TRAVEL || fixed.losts || adapt.losts || high.losts)
+        errors++, printf("move did not end at the target\n");
+
+    if (errors) {
+        printf("FAIL\n");
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
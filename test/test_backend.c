@@ -0,0 +1,134 @@
+// The same moves through both pulse backends: every pulse on the step pin is
+// counted, the position the backend reports has to follow the pulses all
+// along the move and end on the target, and both backends take about the
+// same time since they run the same ramp. The isr pulses have to stay high
+// for the configured minimum. Two axes sharing the step timer each take the
+// time they take alone.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STEP_PIN        23
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+// runs one move, returns its duration in seconds
+static double _move(const stp_backend_t *backend, uint32_t rpm, int32_t from, int32_t to)
+{
+    const char *name = backend->name;
+    uint8_t *running = backend == &stp_backend_rmt ? &sim_rmt.running : &sim_timer.running;
+    uint32_t lag = 0;
+
+    memset(&stp, 0, sizeof(stp));
+    memset(&sim_rmt, 0, sizeof(sim_rmt));
+    stp.step = STEP_PIN;
+    stp.backend = backend;
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    stepper_set_position(&stp, from);
+
+    double t0 = backend == &stp_backend_rmt ? (double)sim_rmt.now / STP_RMT_HZ : (double)sim_timer.now / STP_TIMER_HZ;
+    double t = t0;
+    stepper_go_to_pos(&stp, rpm, to);
+    stepper_handle(&stp, 0);
+
+    uint32_t pulses = sim_pulses[STEP_PIN];
+    while (*running) {
+        t = backend == &stp_backend_rmt ? sim_rmt_fire() : sim_fire();
+
+        // the position follows the pulses given so far
+        int32_t given = sim_pulses[STEP_PIN] - pulses;
+        int32_t expect = to > from ? from + given : from - given;
+        if (stepper_get_position(&stp) != expect)
+            lag++;
+    }
+
+    pulses = sim_pulses[STEP_PIN] - pulses;
+    printf("%s %urpm %d to %d: %u pulses in %.3f s, at %d\n", name, rpm, from, to, pulses, t - t0, stepper_get_position(&stp));
+
+    CHECK(pulses == (uint32_t)abs(to - from), "%s: %u pulses for %d steps", name, pulses, abs(to - from));
+    CHECK(stepper_get_position(&stp) == to, "%s: ended at %d", name, stepper_get_position(&stp));
+    CHECK(stepper_ready(&stp) && stp.ramp_state == STP_RAMP_IDLE, "%s: not idle after the move", name);
+    CHECK(lag == 0, "%s: position off the pulses %u times", name, lag);
+    if (backend == &stp_backend_isr)
+        CHECK(sim_pulse_cycles[STEP_PIN] >= stp.pulse_cycles, "%s: pulses %u cycles high", name, sim_pulse_cycles[STEP_PIN]);
+
+    return t - t0;
+}
+
+static void _check(uint32_t rpm, int32_t from, int32_t to)
+{
+    double t_isr = _move(&stp_backend_isr, rpm, from, to);
+    double t_rmt = _move(&stp_backend_rmt, rpm, from, to);
+
+    // same ramp, rmt pulses at the start of a period and the isr at its end
+    CHECK(t_rmt > 0.98 * t_isr && t_rmt < 1.02 * t_isr, "%urpm: isr %.3f s, rmt %.3f s", rpm, t_isr, t_rmt);
+}
+
+// Two axes on the one step timer at different speeds, each has to come out
+// as if it ran alone
+static void _two_axes(void)
+{
+    static tmc2209_io_t axis[2];
+    const uint32_t rpm[2] = {300, 70};
+    const int32_t target[2] = {20000, -3000};
+    const gpio_num_t pin[2] = {STEP_PIN, STEP_PIN + 2};
+    double t_alone[2], t_done[2] = {0, 0};
+    uint32_t pulses[2];
+
+    for (int i = 0; i < 2; i++)
+        t_alone[i] = _move(&stp_backend_isr, rpm[i], 0, target[i]);
+
+    _stp_sched.count = 0;
+    for (int i = 0; i < 2; i++) {
+        memset(&axis[i], 0, sizeof(axis[i]));
+        axis[i].step = pin[i];
+        stepper_init(&axis[i]);
+        pulses[i] = sim_pulses[pin[i]];
+    }
+
+    double t0 = (double)sim_timer.now / STP_TIMER_HZ;
+    for (int i = 0; i < 2; i++) {
+        stepper_go_to_pos(&axis[i], rpm[i], target[i]);
+        stepper_handle(&axis[i], 0);
+    }
+
+    while (sim_timer.running) {
+        double t = sim_fire() - t0;
+        for (int i = 0; i < 2; i++) {
+            if (!t_done[i] && stepper_ready(&axis[i]))
+                t_done[i] = t;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        pulses[i] = sim_pulses[pin[i]] - pulses[i];
+        printf("axis %d %urpm to %d: %u pulses in %.3f s, alone %.3f s\n", i, rpm[i], target[i], pulses[i], t_done[i], t_alone[i]);
+        CHECK(pulses[i] == (uint32_t)abs(target[i]), "axis %d: %u pulses", i, pulses[i]);
+        CHECK(stepper_get_position(&axis[i]) == target[i], "axis %d: ended at %d", i, stepper_get_position(&axis[i]));
+        CHECK(t_done[i] > 0.999 * t_alone[i] && t_done[i] < 1.001 * t_alone[i], "axis %d: %.3f s, alone %.3f s", i, t_done[i], t_alone[i]);
+    }
+}
+
+int main(void)
+{
+    _check(300, 0, 40000);      // full ramp and cruise
+    _check(200, 5000, 1000);    // backwards
+    _check(20, 0, 500);         // direct start, no ramp
+    _check(150, 0, 3);          // shorter than one rmt chunk
+    _two_axes();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Group moves on the isr backend, with the stepper task running: three axes
+// going different distances have to give their last pulse on the same
+// interrupt, and a stop in the middle brakes every axis in proportion to
+// its distance. A group with an axis on another backend is refused.
+#include "stp_drv.c"
+#include "sim.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AXES            3
+
+static tmc2209_io_t axis[AXES];
+static stp_group_t grp;
+static const gpio_num_t pins[AXES] = {23, 25, 27};
+static uint32_t errors;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _begin(void)
+{
+    memset(&grp, 0, sizeof(grp));
+    _stp_sched.count = 0;
+    for (int i = 0; i < AXES; i++) {
+        memset(&axis[i], 0, sizeof(axis[i]));
+        axis[i].step = pins[i];
+        stepper_init(&axis[i]);
+        sim_own_regs(pins[i], &axis[i].step_set_reg, &axis[i].step_clr_reg, &axis[i].step_mask);
+        grp.axis[i] = &axis[i];
+    }
+    grp.count = AXES;
+    sim_run();
+}
+
+// runs the group until it stands, the time of the last pulse of every axis
+// goes to last[]
+static void _run(uint64_t last[AXES], uint32_t stop_after)
+{
+    uint32_t pulses[AXES];
+    uint32_t fires = 0;
+
+    for (int i = 0; i < AXES; i++) {
+        pulses[i] = sim_pulses[pins[i]];
+        last[i] = 0;
+    }
+
+    sim_run();
+    while (sim_timer.running) {
+        sim_fire();
+        sim_run();
+
+        for (int i = 0; i < AXES; i++) {
+            if (sim_pulses[pins[i]] != pulses[i]) {
+                pulses[i] = sim_pulses[pins[i]];
+                last[i] = sim_timer.now;
+            }
+        }
+
+        if (++fires == stop_after) {
+            stepper_group_stop(&grp);
+            sim_run();
+        }
+    }
+}
+
+static void _check_arrive(void)
+{
+    const int32_t target[AXES] = {20000, 5000, -8000};
+    uint32_t pulses[AXES];
+    uint64_t last[AXES];
+
+    _begin();
+    for (int i = 0; i < AXES; i++)
+        pulses[i] = sim_pulses[pins[i]];
+
+    stepper_group_go_to_pos(&grp, 250, target);
+    _run(last, 0);
+
+    for (int i = 0; i < AXES; i++) {
+        pulses[i] = sim_pulses[pins[i]] - pulses[i];
+        printf("axis %d to %d: %u pulses, last at %.6f s\n", i, target[i], pulses[i], (double)last[i] / STP_TIMER_HZ);
+        CHECK(pulses[i] == (uint32_t)abs(target[i]), "axis %d: %u pulses", i, pulses[i]);
+        CHECK(stepper_get_position(&axis[i]) == target[i], "axis %d: ended at %d", i, stepper_get_position(&axis[i]));
+        CHECK(last[i] == last[0], "axis %d: last pulse %.6f s after the leader", i, (double)(last[i] - last[0]) / STP_TIMER_HZ);
+    }
+    CHECK(stepper_group_ready(&grp), "group not ready after the move");
+}
+
+static void _check_stop(void)
+{
+    const int32_t target[AXES] = {20000, 5000, -8000};
+    uint64_t last[AXES];
+
+    _begin();
+    stepper_group_go_to_pos(&grp, 250, target);
+    _run(last, 6000);
+
+    // the leader braked somewhere short of its target, the others have to
+    // have gone the same share of their way
+    double share = (double)stepper_get_position(&axis[0]) / target[0];
+    printf("stopped at %.3f of the way:", share);
+    for (int i = 0; i < AXES; i++)
+        printf(" %d", stepper_get_position(&axis[i]));
+    printf("\n");
+
+    CHECK(share > 0.1 && share < 0.9, "leader stopped at %.3f of the way", share);
+    for (int i = 1; i < AXES; i++) {
+        double expect = share * target[i];
+        CHECK(fabs(stepper_get_position(&axis[i]) - expect) <= 1, "axis %d: at %d, expected %.1f", i, stepper_get_position(&axis[i]), expect);
+    }
+    CHECK(stepper_group_ready(&grp), "group not ready after the stop");
+}
+
+// the followers step from the leader's isr, the VACTUAL backend has none
+static void _check_refused(void)
+{
+    const int32_t target[AXES] = {20000, 5000, -8000};
+
+    _begin();
+    axis[2].backend = &stp_backend_vactual;
+    CHECK(stepper_group_go_to_pos(&grp, 250, target) != 0, "refused: group move on vactual taken");
+    sim_run();
+    CHECK(!sim_timer.running && stepper_group_ready(&grp), "refused: group moves");
+    axis[2].backend = &stp_backend_isr;
+}
+
+int main(void)
+{
+    _check_arrive();
+    _check_stop();
+    _check_refused();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
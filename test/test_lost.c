@@ -0,0 +1,126 @@
+// Lost step detection against a TMC2209 that counts the STEP pulses into
+// MSCNT, with the stepper task running. A clean move ends without a word,
+// pulses the motor missed are found while it moves or once it stands, and a
+// driver fault halts the move.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STEP_PIN        23
+#define DIR_PIN         22
+#define TARGET          8000
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+static uint32_t losts, dones;
+static int16_t lost;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _on_event(const stp_event_t *event)
+{
+    if (event->type == STP_EVENT_LOST) {
+        losts++;
+        lost = event->lost;
+    }
+    else if (event->type == STP_EVENT_DONE) {
+        dones++;
+    }
+}
+
+static void _begin(uint16_t verify_ms)
+{
+    memset(&stp, 0, sizeof(stp));
+    sim_tmc_reset(STP_VACTUAL_FCLK);
+    sim_tmc.step_pin = STEP_PIN;
+    sim_tmc.dir_pin = DIR_PIN;
+    stp.step = STEP_PIN;
+    stp.dir = DIR_PIN;
+    stp.verify_ms = verify_ms;
+    stp.on_event = _on_event;
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    stepper_set_position(&stp, 0);
+    sim_run();
+    losts = dones = 0;
+    lost = 0;
+
+    stepper_go_to_pos(&stp, 200, TARGET);
+    sim_run();
+}
+
+// runs the move out, the motor misses skip pulses once it got to at
+static void _run(int32_t at, uint32_t skip)
+{
+    while (sim_timer.running || !stepper_ready(&stp)) {
+        if (at >= 0 && stepper_get_position(&stp) >= at) {
+            sim_tmc.skip = skip;
+            at = -1;
+        }
+        if (sim_timer.running)
+            sim_fire();
+        sim_run();
+    }
+    sim_run();
+}
+
+static void _check_clean(void)
+{
+    _begin(0);
+    _run(-1, 0);
+
+    printf("clean: at %d, %u lost, %u done\n", stepper_get_position(&stp), losts, dones);
+    CHECK(stepper_get_position(&stp) == TARGET, "clean: ended at %d", stepper_get_position(&stp));
+    CHECK(losts == 0 && dones == 1, "clean: %u lost, %u done", losts, dones);
+}
+
+// sampled every 10 ms, the move is halted long before its end
+static void _check_moving(void)
+{
+    _begin(0);
+    _run(2000, 6);
+
+    printf("moving: at %d, %u lost by %d, %u done\n", stepper_get_position(&stp), losts, lost, dones);
+    CHECK(losts == 1 && lost == -6, "moving: %u lost by %d", losts, lost);
+    CHECK(stepper_get_position(&stp) < TARGET - 1000, "moving: only halted at %d", stepper_get_position(&stp));
+}
+
+// not sampled while moving, the check at standstill finds it
+static void _check_rest(void)
+{
+    _begin(60000);
+    _run(7990, 3);
+
+    printf("rest: at %d, %u lost by %d, %u done\n", stepper_get_position(&stp), losts, lost, dones);
+    CHECK(losts == 1 && lost == -3, "rest: %u lost by %d", losts, lost);
+}
+
+static void _check_fault(void)
+{
+    _begin(0);
+    sim_tmc.regs[TMC_REG_DRV_STATUS] = 1 << 1;     // ot
+    _run(-1, 0);
+
+    printf("fault: at %d, %u lost by %d, %u done\n", stepper_get_position(&stp), losts, lost, dones);
+    CHECK(losts == 1 && lost == 0, "fault: %u lost by %d", losts, lost);
+    CHECK(stepper_get_position(&stp) < TARGET / 2, "fault: only halted at %d", stepper_get_position(&stp));
+}
+
+int main(void)
+{
+    _check_clean();
+    _check_moving();
+    _check_rest();
+    _check_fault();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Stress of the lock-free paths between the api, the step isr and the
+// readers of the motion state: two threads post commands, one takes them the
+// way the isr does and publishes the status after every look, one more reads
+// the status. Every command and status carries redundant copies of a counter,
+// a torn copy shows up as a mismatch.
+#include "stp_drv.c"
+#include <pthread.h>
+#include <stdio.h>
+
+#define POSTERS     2
+#define POSTS       2000000
+
+static tmc2209_io_t stp;
+static volatile uint8_t posting = POSTERS;
+static volatile uint8_t taking = 1;
+static uint32_t errors;
+
+static void _fail(const char *what, uint32_t a, uint32_t b)
+{
+    if (__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED) < 10)
+        printf("%s: %08x != %08x\n", what, a, b);
+}
+
+static void *_poster(void *arg)
+{
+    uint32_t id = (uintptr_t)arg;
+    stp_cmd_t cmd = {.type = STP_CMD_RETARGET};
+
+    for (uint32_t i = 1; i <= POSTS; i++) {
+        uint32_t tag = id << 24 | i;
+
+        cmd.target = tag;
+        cmd.ramp_time = ~tag;
+        cmd.ramp_steps = tag * 3;
+        for (int n = 0; n < STP_AXES_MAX; n++)
+            cmd.group_target[n] = tag + n;
+        _stp_cmd_post(&stp, &cmd);
+    }
+
+    __atomic_fetch_sub(&posting, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// the isr side: takes every command it sees and owns the motion state
+static void *_taker(void *arg)
+{
+    uint32_t last[POSTERS] = {0};
+    uint32_t taken = 0, step = 0, final = 0;
+    stp_cmd_t cmd;
+
+    while (__atomic_load_n(&posting, __ATOMIC_ACQUIRE) || _stp_cmd_pending(&stp)) {
+        uint32_t seq = _stp_cmd_peek(&stp, &cmd);
+        if (seq) {
+            uint32_t tag = cmd.target;
+            uint32_t id = tag >> 24;
+
+            if (cmd.ramp_time != ~tag)
+                _fail("cmd ramp_time", cmd.ramp_time, ~tag);
+            if (cmd.ramp_steps != tag * 3)
+                _fail("cmd ramp_steps", cmd.ramp_steps, tag * 3);
+            for (int n = 0; n < STP_AXES_MAX; n++)
+                if ((uint32_t)cmd.group_target[n] != tag + n)
+                    _fail("cmd group_target", cmd.group_target[n], tag + n);
+
+            // a newer command may replace an older one, never the other way
+            if (id >= POSTERS || (tag & 0xffffff) <= last[id])
+                _fail("cmd order", tag, last[id]);
+            else
+                last[id] = tag & 0xffffff;
+            final = tag;
+
+            stp.cmd_taken = seq;
+            taken++;
+        }
+
+        step++;
+        stp.ramp_position = step;
+        stp.step_target = -step;
+        stp.ramp_steps = step * 7;
+        stp.duty_set = step;
+        stp.ramp_state = step % 5;
+        stp.dir_set = step & 1;
+        _stp_status_publish(&stp);
+    }
+
+    // the command posted last is never lost
+    if (final != (uint32_t)stp.cmd.target || (final & 0xffffff) != POSTS)
+        _fail("last cmd", final, stp.cmd.target);
+
+    printf("taken %u of %u commands, %u status updates\n", taken, POSTERS * POSTS, step);
+    __atomic_store_n(&taking, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *_reader(void *arg)
+{
+    uint32_t reads = 0, last = 0;
+    stp_status_t status;
+
+    while (__atomic_load_n(&taking, __ATOMIC_ACQUIRE)) {
+        stepper_get_status(&stp, &status);
+        uint32_t step = status.position;
+
+        if ((uint32_t)-status.target != step)
+            _fail("status target", -status.target, step);
+        if (status.ramp_steps != step * 7)
+            _fail("status ramp_steps", status.ramp_steps, step * 7);
+        if (status.velocity != (uint16_t)step)
+            _fail("status velocity", status.velocity, step);
+        if (status.state != step % 5 || status.dir != (step & 1))
+            _fail("status state", status.state, step % 5);
+        if (step < last)
+            _fail("status order", step, last);
+        last = step;
+        reads++;
+    }
+
+    printf("%u status reads\n", reads);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t thread[POSTERS + 2];
+
+    pthread_create(&thread[0], NULL, _taker, NULL);
+    pthread_create(&thread[1], NULL, _reader, NULL);
+    for (int n = 0; n < POSTERS; n++)
+        pthread_create(&thread[n + 2], NULL, _poster, (void *)(uintptr_t)n);
+
+    for (int n = 0; n < POSTERS + 2; n++)
+        pthread_join(thread[n], NULL);
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
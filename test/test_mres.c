@@ -0,0 +1,133 @@
+// Microstep switching against a TMC2209 that takes MRES from CHOPCONF, with
+// the stepper task running. The step timer has to run through every switch,
+// the driver has to go coarse on a full step and the motor has to end up
+// where the position says, after a full move and after a stop while coarse.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STEP_PIN        23
+#define DIR_PIN         22
+#define TARGET          20000
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+static uint32_t losts;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _on_event(const stp_event_t *event)
+{
+    if (event->type == STP_EVENT_LOST)
+        losts++;
+}
+
+// what the driver runs at, GCONF hands it to MRES
+static uint32_t _tmc_microsteps(void)
+{
+    return 256 >> ((sim_tmc.regs[TMC_REG_CHOPCONF] >> 24) & 0x0F);
+}
+
+static void _begin(void)
+{
+    memset(&stp, 0, sizeof(stp));
+    sim_tmc_reset(STP_VACTUAL_FCLK);
+    sim_tmc.step_pin = STEP_PIN;
+    sim_tmc.dir_pin = DIR_PIN;
+    // three steps past a full step, on the fine grid
+    sim_tmc.mscnt0 = 3 * STP_MSCNT_PER_STEP;
+    stp.step = STEP_PIN;
+    stp.dir = DIR_PIN;
+    stp.mres_rpm = 150;
+    stp.on_event = _on_event;
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    stepper_set_position(&stp, 0);
+    sim_run();
+    losts = 0;
+}
+
+// runs the move out, stops it after stop_after pulses. Returns the pulses.
+static uint32_t _run(const char *name, uint32_t stop_after)
+{
+    uint32_t pulses = sim_pulses[STEP_PIN];
+    uint32_t coarse = 0;
+    uint32_t paused = 0;
+
+    stepper_go_to_pos(&stp, 250, TARGET);
+    sim_run();
+
+    while (sim_timer.running || !stepper_ready(&stp)) {
+        if (!sim_timer.running) {
+            sim_run();
+            continue;
+        }
+
+        double angle = sim_tmc.angle;
+        sim_fire();
+
+        // the alarm stays armed until the last pulse
+        if (!sim_timer.running && stp.ramp_state != STP_RAMP_IDLE)
+            paused++;
+
+        // the first coarse pulse starts from a full step
+        if (sim_tmc.angle - angle > STP_MSCNT_PER_STEP && coarse++ == 0) {
+            uint32_t mscnt = (uint32_t)(sim_tmc.mscnt0 + angle) % 1024;
+            CHECK(mscnt % 256 == 0, "%s: went coarse at MSCNT %u", name, mscnt);
+        }
+
+        sim_run();
+        if (stop_after && sim_pulses[STEP_PIN] - pulses == stop_after) {
+            stepper_stop(&stp);
+            sim_run();
+        }
+    }
+    sim_run();
+
+    pulses = sim_pulses[STEP_PIN] - pulses;
+    int32_t motor = (int32_t)(sim_tmc.angle / STP_MSCNT_PER_STEP);
+    printf("%s: at %d, motor at %d, %u pulses, %u coarse, %u pauses, %u lost\n",
+           name, stepper_get_position(&stp), motor, pulses, coarse, paused, losts);
+
+    CHECK(coarse > 0, "%s: never went coarse", name);
+    CHECK(paused == 0, "%s: the pulses stopped %u times", name, paused);
+    CHECK(stepper_get_position(&stp) == motor, "%s: at %d, the motor at %d", name, stepper_get_position(&stp), motor);
+    CHECK(stp.mres_k == 1 && _tmc_microsteps() == MICROSTEPS, "%s: left at %u microsteps", name, _tmc_microsteps());
+    CHECK(losts == 0, "%s: %u lost", name, losts);
+
+    return pulses;
+}
+
+static void _check_move(void)
+{
+    _begin();
+    uint32_t pulses = _run("move", 0);
+
+    CHECK(stepper_get_position(&stp) == TARGET, "move: ended at %d", stepper_get_position(&stp));
+    CHECK(pulses < TARGET / 2, "move: %u pulses", pulses);
+}
+
+static void _check_stop(void)
+{
+    _begin();
+    _run("stop", 3000);
+
+    CHECK(stepper_get_position(&stp) < TARGET, "stop: ran to %d", stepper_get_position(&stp));
+}
+
+int main(void)
+{
+    _check_move();
+    _check_stop();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,87 @@
+// The register shadow against the simulated TMC2209, with the uart worker
+// running. An async write that never got queued leaves the shadow at what
+// the chip still holds, so the next change of the register goes out again,
+// and the StallGuard thresholds of a homing move are restored once the
+// queue takes them.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <string.h>
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _begin(void)
+{
+    memset(&stp, 0, sizeof(stp));
+    sim_tmc_reset(STP_VACTUAL_FCLK);
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    sim_run();
+}
+
+static uint32_t _shadow(uint8_t reg)
+{
+    uint32_t data = 0;
+    stepper_read_reg(&stp, reg, &data);
+    return data;
+}
+
+static void _check_async(void)
+{
+    _begin();
+    uint32_t before = _shadow(TMC_REG_IHOLD_IRUN);
+    uint32_t after = before ^ TMC_IHOLD_IRUN_IRUN_MASK;
+
+    sim_queue_fails = 1;
+    CHECK(stepper_write_reg_async(&stp, TMC_REG_IHOLD_IRUN, after, NULL, NULL) != 0, "async: failed submit reported done");
+    sim_run();
+    CHECK(_shadow(TMC_REG_IHOLD_IRUN) == before, "async: shadow %05x after a failed submit, chip has %05x",
+          (unsigned int)_shadow(TMC_REG_IHOLD_IRUN), (unsigned int)sim_tmc.regs[TMC_REG_IHOLD_IRUN]);
+
+    CHECK(stepper_write_reg_async(&stp, TMC_REG_IHOLD_IRUN, after, NULL, NULL) == 0, "async: submit failed");
+    sim_run();
+    CHECK(_shadow(TMC_REG_IHOLD_IRUN) == after && sim_tmc.regs[TMC_REG_IHOLD_IRUN] == after, "async: shadow %05x, chip %05x",
+          (unsigned int)_shadow(TMC_REG_IHOLD_IRUN), (unsigned int)sim_tmc.regs[TMC_REG_IHOLD_IRUN]);
+
+    // the IFCNT check of a blocking write counts only what went out
+    CHECK(stepper_write_reg(&stp, TMC_REG_TPWMTHRS, 1234) == 0 && sim_tmc.regs[TMC_REG_TPWMTHRS] == 1234, "async: blocking write failed");
+}
+
+static void _check_stall_guard(void)
+{
+    _begin();
+    CHECK(stepper_write_reg(&stp, TMC_REG_TCOOLTHRS, 500) == 0, "stall: TCOOLTHRS not set up");
+
+    _stp_stall_guard(&stp, 1);
+    sim_run();
+    CHECK(sim_tmc.regs[TMC_REG_TCOOLTHRS] == STP_TCOOLTHRS_MAX, "stall: TCOOLTHRS %u while homing", (unsigned int)sim_tmc.regs[TMC_REG_TCOOLTHRS]);
+
+    // the restore is not queued, the next move without StallGuard tries again
+    sim_queue_fails = 1;
+    _stp_stall_guard(&stp, 0);
+    sim_run();
+    CHECK(stp.stall_guard && sim_tmc.regs[TMC_REG_TCOOLTHRS] == STP_TCOOLTHRS_MAX, "stall: restore lost");
+
+    _stp_stall_guard(&stp, 0);
+    sim_run();
+    CHECK(!stp.stall_guard && sim_tmc.regs[TMC_REG_TCOOLTHRS] == 500, "stall: TCOOLTHRS %u after the restore", (unsigned int)sim_tmc.regs[TMC_REG_TCOOLTHRS]);
+    CHECK(_shadow(TMC_REG_TCOOLTHRS) == 500, "stall: shadow %u", (unsigned int)_shadow(TMC_REG_TCOOLTHRS));
+}
+
+int main(void)
+{
+    _check_async();
+    _check_stall_guard();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,277 @@
+// Retargets of an active move, the way the app sends them: a new target while
+// the move runs continues on a new ramp without a velocity jump, one behind
+// the motor brakes and comes back, and only the latest of several counts.
+// Each of them is one move to the app, reported done once at its end, and
+// every retarget the isr took is reported as STP_EVENT_START. One planned
+// from a status that went out of date before the isr got to it is planned
+// again instead of making the velocity jump.
+#include "stp_drv.c"
+#include "sim.h"
+#include <stdio.h>
+#include <string.h>
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+static uint32_t starts, dones;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _on_event(const stp_event_t *event)
+{
+    if (event->type == STP_EVENT_START)
+        starts++;
+    else if (event->type == STP_EVENT_DONE)
+        dones++;
+}
+
+static void _begin(uint32_t rpm, int32_t target)
+{
+    memset(&stp, 0, sizeof(stp));
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stp.on_event = _on_event;
+    stepper_init(&stp);
+    stepper_set_position(&stp, 0);
+    sim_run();
+    starts = dones = 0;
+
+    stepper_go_to_pos(&stp, rpm, target);
+    sim_run();
+}
+
+static void _run_until(uint8_t state)
+{
+    while (sim_timer.running && stp.ramp_state != state) {
+        sim_fire();
+        sim_run();
+    }
+}
+
+// velocity change of the last step in percent, v before it
+static uint32_t _jump(uint32_t v)
+{
+    if (stp.duty_set == 0 || v == 0)
+        return 0;
+
+    uint32_t d = stp.duty_set > v ? stp.duty_set - v : v - stp.duty_set;
+    return d * 100 / v;
+}
+
+// runs the move out with the stepper task, which starts the one waiting for
+// the brake, returns the largest velocity change from one step to the next
+static uint32_t _finish(uint32_t *stops)
+{
+    uint32_t jump = 0;
+
+    *stops = 0;
+    while (sim_timer.running || !stepper_ready(&stp)) {
+        if (!sim_timer.running) {
+            sim_run();
+            continue;
+        }
+
+        uint32_t v = stp.duty_set;
+        sim_fire();
+        if (_jump(v) > jump)
+            jump = _jump(v);
+        // the step timer ran out, a move waiting for it starts from the task
+        if (!sim_timer.running && !stepper_ready(&stp))
+            (*stops)++;
+        sim_run();
+    }
+    sim_run();
+    return jump;
+}
+
+// further out at cruise, continues without stopping
+static void _check_further(void)
+{
+    uint32_t stops;
+
+    _begin(150, 20000);
+    CHECK(starts == 1, "move start: %u START", starts);
+    _run_until(STP_RAMP_CRUISE);
+
+    stepper_go_to_pos(&stp, 150, 30000);
+    CHECK(stp.cmd.type == STP_CMD_RETARGET, "further: not retargeted");
+    uint32_t v = stp.duty_set;
+    sim_fire();
+    CHECK(stp.step_target == 30000 && !_stp_cmd_pending(&stp), "further: not taken on the next step");
+    uint32_t jump = _jump(v);
+    sim_run();
+    CHECK(starts == 2, "further: %u START after the retarget", starts);
+
+    uint32_t rest = _finish(&stops);
+    if (rest > jump)
+        jump = rest;
+    CHECK(stp.step_position == 30000, "further: ended at %d", stp.step_position);
+    CHECK(stops == 0, "further: stopped %u times", stops);
+    CHECK(starts == 2 && dones == 1, "further: %u START, %u DONE", starts, dones);
+    CHECK(jump < 5, "further: velocity jumps %u%%", jump);
+}
+
+// behind the motor, brakes on its ramp and comes back
+static void _check_reverse(void)
+{
+    uint32_t stops;
+
+    _begin(150, 20000);
+    _run_until(STP_RAMP_CRUISE);
+    int32_t turn = stp.step_position;
+
+    stepper_go_to_pos(&stp, 150, 1000);
+    CHECK(stp.cmd.type == STP_CMD_MOVE, "reverse: retargeted");
+
+    uint32_t jump = _finish(&stops);
+    CHECK(stp.step_position == 1000, "reverse: ended at %d", stp.step_position);
+    CHECK(stops == 1, "reverse: stopped %u times", stops);
+    CHECK(dones == 1, "reverse: %u DONE", dones);
+    CHECK(jump < 5, "reverse: velocity jumps %u%%", jump);
+    printf("reverse at %d: ended at %d, largest step %u%%\n", turn, stp.step_position, jump);
+}
+
+// several targets in a row, one step apart, only the last one counts
+static void _check_latest(void)
+{
+    static const int32_t targets[] = {30000, 25000, 40000, 28000};
+    uint32_t stops;
+
+    _begin(150, 20000);
+    _run_until(STP_RAMP_CRUISE);
+
+    uint32_t jump = 0;
+    for (int i = 0; i < 4; i++) {
+        stepper_go_to_pos(&stp, 150, targets[i]);
+        uint32_t v = stp.duty_set;
+        sim_fire();
+        if (_jump(v) > jump)
+            jump = _jump(v);
+        CHECK(stp.step_target == targets[i], "latest: %d not taken on the next step", targets[i]);
+        sim_run();
+    }
+
+    uint32_t rest = _finish(&stops);
+    if (rest > jump)
+        jump = rest;
+    CHECK(stp.step_position == 28000, "latest: ended at %d", stp.step_position);
+    CHECK(stops == 0, "latest: stopped %u times", stops);
+    CHECK(starts == 5 && dones == 1, "latest: %u START, %u DONE", starts, dones);
+    CHECK(jump < 5, "latest: velocity jumps %u%%", jump);
+}
+
+// a retarget as stepper_go_to_pos plans it, from the status right now
+static void _plan(uint32_t rpm, int32_t target, stp_cmd_t *cmd)
+{
+    stp_status_t status;
+    stepper_get_status(&stp, &status);
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = STP_CMD_MOVE;
+    cmd->rpm = rpm;
+    cmd->target = target;
+    cmd->report = 1;
+    _stp_retarget(&stp, &status, cmd, _stp_derate_rpm(&stp, NULL, _stp_profile_rpm(&stp, status.dir, rpm)));
+}
+
+// planned in cruise, posted when the move already brakes for its old target
+static void _check_decel(void)
+{
+    stp_cmd_t cmd;
+    uint32_t stops;
+
+    _begin(150, 20000);
+    _run_until(STP_RAMP_CRUISE);
+    _plan(150, 30000, &cmd);
+    CHECK(cmd.type == STP_CMD_RETARGET, "decel: not retargeted");
+
+    uint32_t v_cruise = stp.duty_set;
+    _run_until(STP_RAMP_DECEL);
+    while (sim_timer.running && stp.duty_set > v_cruise / 2) {
+        sim_fire();
+        sim_run();
+    }
+    _stp_cmd_post(&stp, &cmd);
+
+    // the isr leaves it, the task plans it again from where we are
+    uint32_t v = stp.duty_set;
+    sim_fire();
+    uint32_t jump = _jump(v);
+    CHECK(stp.cmd_stale == stp.cmd_seq && stp.ramp_state == STP_RAMP_DECEL, "decel: stale retarget taken");
+    uint32_t seq = stp.cmd_seq;
+    sim_run();
+    CHECK(stp.cmd_seq != seq && stp.cmd.type == STP_CMD_RETARGET, "decel: not planned again");
+
+    uint32_t rest = _finish(&stops);
+    if (rest > jump)
+        jump = rest;
+    CHECK(stp.step_position == 30000, "decel: ended at %d", stp.step_position);
+    CHECK(stops == 0, "decel: stopped %u times", stops);
+    CHECK(starts == 2 && dones == 1, "decel: %u START, %u DONE", starts, dones);
+    CHECK(jump < 5, "decel: velocity jumps %u%%", jump);
+}
+
+// planned in cruise, by the time it is posted the new target is too close to
+// brake for
+static void _check_close(void)
+{
+    stp_cmd_t cmd;
+    uint32_t stops;
+
+    _begin(150, 20000);
+    _run_until(STP_RAMP_CRUISE);
+    _plan(150, 19950, &cmd);
+    CHECK(cmd.type == STP_CMD_RETARGET, "close: not retargeted");
+
+    _run_until(STP_RAMP_DECEL);
+    _stp_cmd_post(&stp, &cmd);
+    uint32_t v = stp.duty_set;
+    sim_fire();
+    uint32_t jump = _jump(v);
+    sim_run();
+    CHECK(stp.cmd.type == STP_CMD_MOVE, "close: not a plain move");
+
+    // brakes on its old ramp and comes back
+    uint32_t rest = _finish(&stops);
+    if (rest > jump)
+        jump = rest;
+    CHECK(stp.step_position == 19950, "close: ended at %d", stp.step_position);
+    CHECK(stops == 1, "close: stopped %u times", stops);
+    CHECK(jump < 5, "close: velocity jumps %u%%", jump);
+}
+
+// a speed change of the adaptive cruise is no new move
+static void _check_adapt(void)
+{
+    uint32_t stops;
+
+    _begin(100, 20000);
+    _run_until(STP_RAMP_CRUISE);
+
+    stp_status_t status;
+    stepper_get_status(&stp, &status);
+    CHECK(_stp_adapt_set(&stp, &status, 150), "adapt: no speed up");
+    sim_fire();
+    sim_run();
+
+    _finish(&stops);
+    CHECK(stp.step_position == 20000, "adapt: ended at %d", stp.step_position);
+    CHECK(starts == 1 && dones == 1, "adapt: %u START, %u DONE", starts, dones);
+}
+
+int main(void)
+{
+    _check_further();
+    _check_reverse();
+    _check_latest();
+    _check_decel();
+    _check_close();
+    _check_adapt();
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+// The jerk-limited planner and the ramp the isr runs from it. The planner is
+// checked over a range of distances, the isr on full and short moves in
+// virtual time: the ramp takes as long as planned, stays within a_max,
+// starts without an acceleration jump and ends on the target. Ramps slow
+// enough to shift the table lookup are walked tick by tick, the test is
+// built with AddressSanitizer to catch a read past the table.
+#include "stp_drv.c"
+#include "sim.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WINDOW_S        0.01        // acceleration measured over 10ms
+
+static tmc2209_io_t stp;
+static uint32_t errors;
+
+#define CHECK(cond, ...) do { if (!(cond)) { errors++; printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void _check_plan(void)
+{
+    stp_plan_limits_t lim;
+    stp_plan_t plan;
+
+    memset(&stp, 0, sizeof(stp));
+    _stp_limits(&stp, STP_RPM_MAX, STP_DIR_FWD, &lim);
+
+    for (uint32_t distance = 1; distance <= 40000; distance += 7) {
+        stp_plan_move(&lim, distance, &plan);
+        CHECK(2 * plan.ramp_steps + plan.cruise_steps == distance,
+            "plan %u: ramps %u + cruise %u", distance, plan.ramp_steps, plan.cruise_steps);
+        CHECK(plan.v_peak <= lim.v_max, "plan %u: v_peak %u", distance, plan.v_peak);
+        CHECK(plan.a_peak <= lim.a_max, "plan %u: a_peak %u", distance, plan.a_peak);
+        CHECK((uint64_t)lim.j_max * plan.t_jerk / 1000000 <= lim.a_max, "plan %u: t_jerk %u us", distance, plan.t_jerk);
+    }
+
+    // a full ramp to 300 rpm
+    stp_plan_move(&lim, 40000, &plan);
+    uint32_t ramp_us = 2 * plan.t_jerk + plan.t_accel;
+    printf("300rpm ramp: %u us, %u steps\n", ramp_us, plan.ramp_steps);
+    CHECK(ramp_us > 900000 && ramp_us < 1000000, "300rpm ramp takes %u us", ramp_us);
+}
+
+static void _check_move(uint32_t rpm, int32_t target)
+{
+    double t, t_start, t_cruise = 0, t_window = 0, a_max = 0, a_start = 0;
+    uint32_t v_window;
+
+    memset(&stp, 0, sizeof(stp));
+    // every move on a freshly booted scheduler, the step timer runs on
+    _stp_sched.count = 0;
+    stepper_init(&stp);
+    stepper_set_position(&stp, 0);
+    stepper_go_to_pos(&stp, rpm, target);
+    stepper_handle(&stp, 0);
+
+    stp_plan_t plan = stp.plan;
+    double ramp_s = (2.0 * plan.t_jerk + plan.t_accel) / 1e6;
+    double a_lim = stp.accel_max ? stp.accel_max : STP_ACCEL_DEFAULT;
+
+    t = t_start = t_window = (double)sim_timer.now / STP_TIMER_HZ;
+    v_window = stp.duty_set;
+
+    while (sim_timer.running) {
+        t = sim_fire();
+
+        if (!t_cruise && stp.ramp_state != STP_RAMP_ACCEL)
+            t_cruise = t;
+
+        if (t - t_window >= WINDOW_S) {
+            double a = fabs((double)stp.duty_set - v_window) / (t - t_window);
+            if (a > a_max)
+                a_max = a;
+            // the first window of the ramp, still in the jerk phase
+            if (t_window == t_start)
+                a_start = a;
+            t_window = t;
+            v_window = stp.duty_set;
+        }
+    }
+
+    printf("%urpm to %d: ramp %.3f s of %.3f planned, a max %.0f, a start %.0f, move %.3f s of %.3f, at %d\n",
+        rpm, target, t_cruise - t_start, ramp_s, a_max, a_start, t - t_start, plan.duration_ms / 1000.0, stp.step_position);
+
+    CHECK(stp.step_position == target, "%urpm: ended at %d", rpm, stp.step_position);
+    CHECK(fabs(t_cruise - t_start - ramp_s) < 0.02 * ramp_s + 0.005, "%urpm: ramp off the plan", rpm);
+    CHECK(fabs(t - t_start - plan.duration_ms / 1000.0) < 0.02 * plan.duration_ms / 1000.0 + 0.005, "%urpm: move off the plan", rpm);
+    CHECK(a_max < 1.05 * a_lim, "%urpm: acceleration %.0f over %.0f", rpm, a_max, a_lim);
+
+    // jerk limited: after 10ms at j_max the acceleration is still small
+    double j_lim = stp.jerk_max ? stp.jerk_max : STP_JERK_DEFAULT;
+    CHECK(a_start < j_lim * WINDOW_S * 1.5, "%urpm: jumps to %.0f steps/s^2 at the start", rpm, a_start);
+}
+
+// low jerk limits make jerk phases long enough to shift the table lookup,
+// the velocity has to rise steadily up to the cruise on every tick
+static void _check_ramp(uint32_t j_max)
+{
+    stp_plan_limits_t lim;
+    stp_plan_t plan;
+    stp_ramp_t ramp;
+
+    memset(&stp, 0, sizeof(stp));
+    stp.jerk_max = j_max;
+    _stp_limits(&stp, STP_RPM_MAX, STP_DIR_FWD, &lim);
+    stp_plan_move(&lim, 40000, &plan);
+    _stp_ramp_load(&ramp, &plan);
+
+    // every 1000th tick, and every one where the shifted lookup reaches the
+    // end of the table
+    uint32_t end = ramp.ticks - (2u << ramp.shift);
+    uint32_t v_last = ramp.v_start;
+    uint32_t falls = 0;
+    for (uint32_t t = 0; t <= ramp.ticks; t += t + 1000 < end ? 1000 : 1) {
+        uint32_t v = _stp_ramp_velocity(&ramp, t);
+        if (v < v_last)
+            falls++;
+        v_last = v;
+    }
+
+    printf("jerk %u: shift %u, %u ticks, ends at %u of %u\n", j_max, ramp.shift, ramp.ticks, v_last, ramp.v_cruise);
+    CHECK(ramp.shift > 0, "jerk %u: table lookup not shifted", j_max);
+    CHECK(falls == 0, "jerk %u: velocity falls %u times", j_max, falls);
+    CHECK(v_last == ramp.v_cruise, "jerk %u: ends at %u", j_max, v_last);
+}
+
+int main(void)
+{
+    _check_plan();
+    _check_ramp(STP_JERK_DEFAULT / 20);
+    _check_ramp(STP_JERK_DEFAULT / 100);
+    _check_move(300, 20000);    // full ramp and cruise
+    _check_move(300, 2000);     // too short for 300rpm
+    _check_move(60, 5000);
+
+    if (errors) {
+        printf("FAIL: %u errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
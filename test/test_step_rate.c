@@ -0,0 +1,75 @@
+// Step rate of the cruise phase against the planned velocity, 30..300 rpm in
+// 1 rpm steps. With the period remainder carried over, 20000 steps must come
+// out at the planned rate and every single period must be one of the two
+// whole timer ticks around it.
+#include "stp_drv.c"
+#include "sim.h"
+#include <math.h>
+#include <stdio.h>
+
+#define CRUISE_STEPS    20000
+#define MAX_ERR_PPM     1.0
+
+int main(void)
+{
+    static tmc2209_io_t stp;
+    double worst = 0;
+    uint32_t worst_rpm = 0, errors = 0;
+
+    stepper_init(&stp);
+
+    for (uint32_t rpm = 30; rpm <= STP_RPM_MAX; rpm++) {
+        uint64_t t0 = 0, t_prev = 0;
+        int32_t p0 = 0, steps = 0;
+
+        stepper_set_position(&stp, 0);
+        stepper_go_to_pos(&stp, rpm, 3 * CRUISE_STEPS);
+        stepper_handle(&stp, 0);
+
+        while (sim_timer.running && steps < CRUISE_STEPS) {
+            sim_fire();
+            if (stp.ramp_state != STP_RAMP_CRUISE)
+                continue;
+
+            if (!t0) {
+                t0 = t_prev = sim_timer.now;
+                p0 = stp.step_position;
+                continue;
+            }
+
+            uint64_t period = sim_timer.now - t_prev;
+            uint64_t ideal = STP_TIMER_HZ / stp.duty_set;
+            if (period != ideal && period != ideal + 1) {
+                if (errors++ < 10)
+                    printf("rpm %u: period %llu, want %llu or %llu\n", rpm,
+                        (unsigned long long)period, (unsigned long long)ideal, (unsigned long long)ideal + 1);
+            }
+            t_prev = sim_timer.now;
+            steps = stp.step_position - p0;
+        }
+
+        double rate = steps / ((double)(sim_timer.now - t0) / STP_TIMER_HZ);
+        double err = fabs(rate - stp.duty_set) / stp.duty_set * 1e6;
+        if (err > worst) {
+            worst = err;
+            worst_rpm = rpm;
+        }
+        if (rpm % 30 == 0)
+            printf("rpm %3u: planned %5u/s, ran %.3f/s, %.3f ppm\n", rpm, stp.duty_set, rate, err);
+
+        // brake and finish the move
+        stepper_stop(&stp);
+        while (sim_timer.running)
+            sim_fire();
+        stepper_handle(&stp, STP_NOTIFY_DONE);
+    }
+
+    printf("worst %.3f ppm at %u rpm\n", worst, worst_rpm);
+    if (worst > MAX_ERR_PPM || errors) {
+        printf("FAIL\n");
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}